@@ -0,0 +1,170 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "arena.h"
+#include "util.h"
+
+
+static inline size_t alignArenaSize(size_t size) {
+
+    return (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+
+}
+
+
+static ArenaBlock* allocateArenaBlock(size_t size) {
+
+    size_t header = alignArenaSize(sizeof(ArenaBlock));
+
+    ArenaBlock *block = malloc(header + size);
+    if (block <= 0) {
+        error("Unable to allocate ArenaBlock\n")
+        return NULL;
+    }
+
+    block->previous = NULL;
+    block->next = (uintptr_t) block + header;
+    block->end = block->next + size;
+
+    return block;
+
+}
+
+
+Arena* createArena(const char *name) {
+
+    Arena *arena = calloc(1, sizeof(Arena));
+    if (arena <= 0) {
+        error("Unable to allocate Arena\n")
+        exit(-1);
+    }
+
+    arena->name = name;
+    arena->first = allocateArenaBlock(ARENA_BLOCK_SIZE);
+    if (arena->first <= 0) {
+        exit(-1);
+    }
+
+    arena->current = arena->first;
+    arena->blocks = 1;
+
+    registerLock(name, &arena->lock);
+
+    return arena;
+
+}
+
+
+static inline void* bumpArenaBlock(ArenaBlock *block, size_t size) {
+
+    uintptr_t next;
+
+    do {
+
+        next = block->next;
+
+        if (next + size > block->end) {
+            return NULL;
+        }
+
+    } while (!compareAndSwapPtrBool(&block->next, (void*) next, (void*) (next + size)));
+
+    return (void*) next;
+
+}
+
+
+void* arenaAllocate(Arena *arena, size_t size) {
+
+    size = alignArenaSize(size ? size : 1);
+
+    void *memory = bumpArenaBlock(arena->current, size);
+
+    if (memory <= 0) {
+
+        lock(&arena->lock, false);
+
+        memory = bumpArenaBlock(arena->current, size);
+
+        if (memory <= 0) {
+
+            // Oversized requests get a block of their own behind the current one so its free space is kept
+
+            ArenaBlock *block = allocateArenaBlock(size > ARENA_BLOCK_SIZE / 4 ? size : ARENA_BLOCK_SIZE);
+
+            if (block <= 0) {
+                unlock(&arena->lock, false);
+                return NULL;
+            }
+
+            memory = bumpArenaBlock(block, size);
+            arena->blocks++;
+
+            if (size > ARENA_BLOCK_SIZE / 4) {
+                block->previous = arena->current->previous;
+                arena->current->previous = block;
+            } else {
+                block->previous = arena->current;
+                memoryBarrier();
+                arena->current = block;
+            }
+
+        }
+
+        unlock(&arena->lock, false);
+
+    }
+
+    memset(memory, 0, size);
+
+    return memory;
+
+}
+
+
+void resetArena(Arena *arena) {
+
+    ArenaBlock *block = arena->current;
+
+    while (block > 0) {
+
+        ArenaBlock *tempBlock = block;
+        block = block->previous;
+
+        if (tempBlock != arena->first) {
+            free(tempBlock);
+        }
+
+    }
+
+    arena->first->previous = NULL;
+    arena->first->next = (uintptr_t) arena->first + alignArenaSize(sizeof(ArenaBlock));
+    arena->current = arena->first;
+    arena->blocks = 1;
+    arena->resets++;
+
+}
+
+
+void reportArenaStatistics(Arena *arena) {
+
+    uint64_t used = 0;
+    uint64_t reserved = 0;
+
+    for (ArenaBlock *block = arena->current; block > 0; block = block->previous) {
+        uintptr_t start = (uintptr_t) block + alignArenaSize(sizeof(ArenaBlock));
+        used += block->next - start;
+        reserved += block->end - start;
+    }
+
+    info("Arena %s:\n", arena->name)
+    info("\tBlocks: %d, Used: %" PRIu64 ", Reserved: %" PRIu64 ", Resets: %d\n", arena->blocks, used, reserved, arena->resets)
+    info("\n")
+
+}
@@ -0,0 +1,41 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "util.h"
+
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+#define ARENA_ALIGNMENT 8
+
+typedef struct ArenaBlock_struct ArenaBlock;
+typedef struct Arena_struct Arena;
+
+struct ArenaBlock_struct {
+    ArenaBlock *previous;
+    volatile uintptr_t next;
+    uintptr_t end;
+};
+
+struct Arena_struct {
+    volatile LockStructure lock;
+    const char *name;
+    ArenaBlock * volatile current;
+    ArenaBlock *first;
+    uint32_t blocks;
+    uint32_t resets;
+};
+
+Arena* createArena(const char *name);
+void* arenaAllocate(Arena *arena, size_t size);
+void resetArena(Arena *arena);
+void reportArenaStatistics(Arena *arena);
+
+
+#endif /* ARENA_H_ */
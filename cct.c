@@ -0,0 +1,201 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "cct.h"
+#include "util.h"
+
+
+CallTree* createCallTree() {
+
+    CallTree *callTree = calloc(1, sizeof(CallTree));
+
+    if (callTree <= 0) {
+        error("Unable to allocate CallTree\n")
+        return NULL;
+    }
+
+    callTree->current = &callTree->root;
+
+    return callTree;
+
+}
+
+
+CallTreeNode* addCallTreeChild(CallTree *callTree, CallTreeNode *parent, uint16_t classID, uint16_t methodID) {
+
+    CallTreeNode *child = calloc(1, sizeof(CallTreeNode));
+
+    if (child <= 0) {
+        error("Unable to allocate CallTreeNode\n")
+        return NULL;
+    }
+
+    child->classID = classID;
+    child->methodID = methodID;
+    child->parent = parent;
+    child->nextSibling = parent->firstChild;
+
+    memoryBarrier();
+
+    parent->firstChild = child;
+    parent->numberOfChildren++;
+    callTree->numberOfNodes++;
+
+    return child;
+
+}
+
+
+CallTreeNode* nextCallTreeNode(CallTree *callTree, CallTreeNode *node) {
+
+    if (node->firstChild) {
+        return node->firstChild;
+    }
+
+    while (node != &callTree->root && node->nextSibling == NULL) {
+        node = node->parent;
+    }
+
+    return (node == &callTree->root) ? NULL : node->nextSibling;
+
+}
+
+
+void resetCallTree(CallTree *callTree) {
+
+    CallTreeNode *node = callTree->root.firstChild;
+
+    while (node) {
+
+        if (node->firstChild) {
+            node = node->firstChild;
+            continue;
+        }
+
+        CallTreeNode *parent = node->parent;
+        parent->firstChild = node->nextSibling;
+        free(node);
+
+        node = (parent == &callTree->root) ? parent->firstChild : parent;
+
+    }
+
+    memset(&callTree->root, 0, sizeof(CallTreeNode));
+
+    callTree->current = &callTree->root;
+    callTree->numberOfNodes = 0;
+
+}
+
+
+void freeCallTree(CallTree *callTree) {
+
+    if (callTree == NULL) {
+        return;
+    }
+
+    resetCallTree(callTree);
+
+    free(callTree);
+
+}
+
+
+void mergeCallTree(CallTree *target, CallTree *source) {
+
+    CallTreeNode *from = source->root.firstChild;
+    CallTreeNode *to = &target->root;
+
+    while (from) {
+
+        CallTreeNode *merged = findCallTreeChild(to, from->classID, from->methodID);
+
+        if (merged == NULL) {
+            merged = addCallTreeChild(target, to, from->classID, from->methodID);
+            if (merged == NULL) {
+                return;
+            }
+        }
+
+        merged->calls += from->calls;
+        merged->inclusiveTicks += from->inclusiveTicks;
+        merged->childTicks += from->childTicks;
+
+        if (from->firstChild) {
+            from = from->firstChild;
+            to = merged;
+            continue;
+        }
+
+        while (from != &source->root && from->nextSibling == NULL) {
+            from = from->parent;
+            to = to->parent;
+        }
+
+        from = (from == &source->root) ? NULL : from->nextSibling;
+
+    }
+
+}
+
+
+/*
+ * Credits the frames the source thread is still in up to ticks, as if they returned then, to the nodes merged from
+ * them into target. The owner may move on meanwhile, but nodes are only freed by the owner between generations.
+ */
+void mergeOpenCallTreeFrames(CallTree *target, CallTree *source, uint64_t ticks) {
+
+    CallTreeNode *current = ((volatile CallTree*) source)->current;
+    uint32_t depth = 0;
+
+    for (CallTreeNode *node = current; node && node != &source->root; node = node->parent) {
+        depth++;
+    }
+
+    if (depth == 0) {
+        return;
+    }
+
+    CallTreeNode **path = calloc(depth, sizeof(CallTreeNode*));
+
+    if (path <= 0) {
+        error("Unable to allocate call tree path\n")
+        return;
+    }
+
+    uint32_t i = 0;
+
+    for (CallTreeNode *node = current; i < depth; node = node->parent) {
+        path[i++] = node;
+    }
+
+    CallTreeNode *to = &target->root;
+
+    while (i > 0) {
+
+        CallTreeNode *from = path[--i];
+        CallTreeNode *merged = findCallTreeChild(to, from->classID, from->methodID);
+
+        if (merged == NULL) {
+            break;
+        }
+
+        if (ticks > from->entryTicks) {
+            uint64_t elapsed = ticks - from->entryTicks;
+            merged->inclusiveTicks += elapsed;
+            to->childTicks += elapsed;
+        }
+
+        to = merged;
+
+    }
+
+    free(path);
+
+}
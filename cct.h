@@ -0,0 +1,96 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#ifndef CCT_H_
+#define CCT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "util.h"
+
+typedef struct CallTreeNode_struct CallTreeNode;
+typedef struct CallTree_struct CallTree;
+
+CallTree* createCallTree();
+void freeCallTree(CallTree *callTree);
+void resetCallTree(CallTree *callTree);
+CallTreeNode* addCallTreeChild(CallTree *callTree, CallTreeNode *parent, uint16_t classID, uint16_t methodID);
+void mergeCallTree(CallTree *target, CallTree *source);
+void mergeOpenCallTreeFrames(CallTree *target, CallTree *source, uint64_t ticks);
+CallTreeNode* nextCallTreeNode(CallTree *callTree, CallTreeNode *node);
+
+struct CallTreeNode_struct {
+    uint16_t classID;
+    uint16_t methodID;
+    uint32_t numberOfChildren;
+    uint64_t calls;
+    uint64_t inclusiveTicks;
+    uint64_t childTicks;
+    uint64_t entryTicks;
+    CallTreeNode *parent;
+    CallTreeNode *firstChild;
+    CallTreeNode *nextSibling;
+};
+
+struct CallTree_struct {
+    CallTreeNode root;
+    CallTreeNode *current;
+    uint32_t numberOfNodes;
+    volatile uint32_t generation;
+};
+
+
+static inline CallTreeNode* findCallTreeChild(CallTreeNode *parent, uint16_t classID, uint16_t methodID) {
+
+    CallTreeNode *child = parent->firstChild;
+
+    while (child && (child->classID != classID || child->methodID != methodID)) {
+        child = child->nextSibling;
+    }
+
+    return child;
+
+}
+
+
+static inline void callTreeEnter(CallTree *callTree, uint16_t classID, uint16_t methodID, uint64_t ticks) {
+
+    CallTreeNode *child = findCallTreeChild(callTree->current, classID, methodID);
+
+    if (child == NULL) {
+        child = addCallTreeChild(callTree, callTree->current, classID, methodID);
+        if (child == NULL) {
+            return;
+        }
+    }
+
+    child->calls++;
+    child->entryTicks = ticks;
+
+    callTree->current = child;
+
+}
+
+
+static inline void callTreeExit(CallTree *callTree, uint64_t ticks) {
+
+    CallTreeNode *node = callTree->current;
+
+    if (node == &callTree->root) {
+        return;
+    }
+
+    uint64_t elapsed = ticks - node->entryTicks;
+
+    node->inclusiveTicks += elapsed;
+    node->parent->childTicks += elapsed;
+
+    callTree->current = node->parent;
+
+}
+
+
+#endif /* CCT_H_ */
@@ -0,0 +1,225 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "filter.h"
+#include "util.h"
+
+
+// Patterns and class names are both in the JVM's encoding, so the wildcards are compared as JVM characters
+
+static bool globMatch(const uint8_t *pattern, const uint8_t *text) {
+
+    while (*pattern) {
+
+        if (pattern[0] == FILTER_JVM_ANY && pattern[1] == FILTER_JVM_ANY) {
+
+            pattern += 2;
+
+            if (*pattern == 0) {
+                return true;
+            }
+
+            for (const uint8_t *t = text; ; t++) {
+                if (globMatch(pattern, t)) {
+                    return true;
+                }
+                if (*t == 0) {
+                    return false;
+                }
+            }
+
+        } else if (*pattern == FILTER_JVM_ANY) {
+
+            pattern++;
+
+            for (const uint8_t *t = text; ; t++) {
+                if (globMatch(pattern, t)) {
+                    return true;
+                }
+                if (*t == 0 || *t == FILTER_JVM_SEPARATOR) {
+                    return false;
+                }
+            }
+
+        } else if (*pattern == FILTER_JVM_ONE) {
+
+            if (*text == 0 || *text == FILTER_JVM_SEPARATOR) {
+                return false;
+            }
+
+            pattern++;
+            text++;
+
+        } else {
+
+            if (*pattern != *text) {
+                return false;
+            }
+
+            pattern++;
+            text++;
+
+        }
+
+    }
+
+    return *text == 0;
+
+}
+
+
+static bool patternMatches(const uint8_t *pattern, const uint8_t *className) {
+
+    if (strchr((const char*) pattern, FILTER_JVM_ANY) == NULL && strchr((const char*) pattern, FILTER_JVM_ONE) == NULL) {
+        return strncmp((const char*) className, (const char*) pattern, strlen((const char*) pattern)) == 0;
+    }
+
+    return globMatch(pattern, className);
+
+}
+
+
+static uint8_t** parsePatterns(const char *list, uint32_t *numberOfPatterns) {
+
+    *numberOfPatterns = 0;
+
+    if (list == NULL || *list == 0) {
+        return NULL;
+    }
+
+    uint32_t maximumPatterns = 1;
+
+    for (const char *c = list; *c; c++) {
+        if (*c == FILTER_LIST_DELIMITER) {
+            maximumPatterns++;
+        }
+    }
+
+    uint8_t **patterns = calloc(maximumPatterns, sizeof(uint8_t*));
+    if (patterns <= 0) {
+        error("Unable to allocate filter patterns\n")
+        return NULL;
+    }
+
+    const char *from = list;
+
+    while (1) {
+
+        const char *to = strchr(from, FILTER_LIST_DELIMITER);
+        uint32_t length = to ? (uint32_t) (to - from) : (uint32_t) strlen(from);
+
+        if (length) {
+
+            uint8_t *pattern = calloc(1, length + 1);
+            if (pattern <= 0) {
+                error("Unable to allocate filter pattern\n")
+                break;
+            }
+
+            for (uint32_t i = 0; i < length; i++) {
+                pattern[i] = (from[i] == '.') ? '/' : from[i];
+            }
+
+            memmove(pattern, platformStringToJVM((char*) pattern), length);
+
+            patterns[(*numberOfPatterns)++] = pattern;
+
+        }
+
+        if (to == NULL) {
+            break;
+        }
+
+        from = to + 1;
+    }
+
+    return patterns;
+
+}
+
+
+ClassFilter* createClassFilter(const char *includes, const char *excludes) {
+
+    if ((includes == NULL || *includes == 0) && (excludes == NULL || *excludes == 0)) {
+        return NULL;
+    }
+
+    ClassFilter *filter = calloc(1, sizeof(ClassFilter));
+    if (filter <= 0) {
+        error("Unable to allocate ClassFilter\n")
+        return NULL;
+    }
+
+    filter->includes = parsePatterns(includes, &filter->numberOfIncludes);
+    filter->excludes = parsePatterns(excludes, &filter->numberOfExcludes);
+
+    for (int i = 0; i < filter->numberOfIncludes; i++) {
+        info("Include: %s\n", JVMStringToPlatform((char*) filter->includes[i]))
+    }
+
+    for (int i = 0; i < filter->numberOfExcludes; i++) {
+        info("Exclude: %s\n", JVMStringToPlatform((char*) filter->excludes[i]))
+    }
+
+    return filter;
+
+}
+
+
+void freeClassFilter(ClassFilter *filter) {
+
+    if (filter == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < filter->numberOfIncludes; i++) {
+        free(filter->includes[i]);
+    }
+
+    for (int i = 0; i < filter->numberOfExcludes; i++) {
+        free(filter->excludes[i]);
+    }
+
+    if (filter->includes) free(filter->includes);
+    if (filter->excludes) free(filter->excludes);
+
+    free(filter);
+
+}
+
+
+bool isClassIncluded(ClassFilter *filter, const uint8_t *className) {
+
+    if (filter == NULL || className == NULL) {
+        return true;
+    }
+
+    if (filter->numberOfIncludes) {
+
+        bool included = false;
+
+        for (int i = 0; i < filter->numberOfIncludes && !included; i++) {
+            included = patternMatches(filter->includes[i], className);
+        }
+
+        if (!included) {
+            return false;
+        }
+
+    }
+
+    for (int i = 0; i < filter->numberOfExcludes; i++) {
+        if (patternMatches(filter->excludes[i], className)) {
+            return false;
+        }
+    }
+
+    return true;
+
+}
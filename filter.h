@@ -0,0 +1,33 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#ifndef FILTER_H_
+#define FILTER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "util.h"
+
+#define FILTER_LIST_DELIMITER ':'
+#define FILTER_JVM_ANY 0x2A
+#define FILTER_JVM_ONE 0x3F
+#define FILTER_JVM_SEPARATOR 0x2F
+
+typedef struct ClassFilter_struct ClassFilter;
+
+ClassFilter* createClassFilter(const char *includes, const char *excludes);
+void freeClassFilter(ClassFilter *filter);
+bool isClassIncluded(ClassFilter *filter, const uint8_t *className);
+
+struct ClassFilter_struct {
+    uint32_t numberOfIncludes;
+    uint8_t **includes;
+    uint32_t numberOfExcludes;
+    uint8_t **excludes;
+};
+
+
+#endif /* FILTER_H_ */
@@ -0,0 +1,1046 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "instrument.h"
+#include "util.h"
+
+
+typedef struct ClassBytes_struct ClassBytes;
+typedef struct ClassReader_struct ClassReader;
+typedef struct MethodRecord_struct MethodRecord;
+
+struct ClassBytes_struct {
+    uint8_t *data;
+    uint32_t length;
+    uint32_t capacity;
+    bool failed;
+};
+
+struct MethodRecord_struct {
+    uint32_t start;
+    uint32_t end;
+    uint16_t accessFlags;
+    uint16_t nameIndex;
+    uint16_t signatureIndex;
+    uint32_t codeStart;
+    uint32_t codeEnd;
+    bool instrument;
+    uint32_t hookID;
+    uint16_t argumentSlots;
+    uint16_t renamedNameIndex;
+    uint16_t renamedMethodIndex;
+    uint16_t hookIDIndex;
+};
+
+struct ClassReader_struct {
+    const uint8_t *data;
+    uint32_t length;
+    uint32_t offset;
+    bool failed;
+};
+
+
+static volatile jmethodID *hookChunks[HOOK_CHUNKS];
+static volatile uint32_t numberOfHooks = 0;
+static LockStructure hookLock = UNLOCKED;
+static volatile bool hookDefined = false;
+static jobject hookModule = NULL;
+
+
+static inline uint8_t readU1(ClassReader *reader) {
+
+    if (reader->offset + 1 > reader->length) {
+        reader->failed = true;
+        return 0;
+    }
+
+    return reader->data[reader->offset++];
+
+}
+
+
+static inline uint16_t readU2(ClassReader *reader) {
+
+    if (reader->offset + 2 > reader->length) {
+        reader->failed = true;
+        return 0;
+    }
+
+    uint16_t value = (uint16_t) ((reader->data[reader->offset] << 8) | reader->data[reader->offset + 1]);
+    reader->offset += 2;
+
+    return value;
+
+}
+
+
+static inline uint32_t readU4(ClassReader *reader) {
+
+    if (reader->offset + 4 > reader->length) {
+        reader->failed = true;
+        return 0;
+    }
+
+    uint32_t value = ((uint32_t) reader->data[reader->offset] << 24) | ((uint32_t) reader->data[reader->offset + 1] << 16)
+            | ((uint32_t) reader->data[reader->offset + 2] << 8) | (uint32_t) reader->data[reader->offset + 3];
+    reader->offset += 4;
+
+    return value;
+
+}
+
+
+static inline void skip(ClassReader *reader, uint32_t length) {
+
+    if (reader->offset + length > reader->length) {
+        reader->failed = true;
+        return;
+    }
+
+    reader->offset += length;
+
+}
+
+
+static void ensureCapacity(ClassBytes *bytes, uint32_t length) {
+
+    if (bytes->failed || bytes->length + length <= bytes->capacity) {
+        return;
+    }
+
+    uint32_t capacity = bytes->capacity ? bytes->capacity : 4096;
+
+    while (capacity < bytes->length + length) {
+        capacity *= 2;
+    }
+
+    uint8_t *data = realloc(bytes->data, capacity);
+
+    if (data <= 0) {
+        error("Unable to allocate instrumented class bytes (%d)\n", capacity)
+        bytes->failed = true;
+        return;
+    }
+
+    bytes->data = data;
+    bytes->capacity = capacity;
+
+}
+
+
+static inline void putU1(ClassBytes *bytes, uint8_t value) {
+
+    ensureCapacity(bytes, 1);
+
+    if (!bytes->failed) {
+        bytes->data[bytes->length++] = value;
+    }
+
+}
+
+
+static inline void putU2(ClassBytes *bytes, uint16_t value) {
+
+    putU1(bytes, (uint8_t) (value >> 8));
+    putU1(bytes, (uint8_t) value);
+
+}
+
+
+static inline void putU4(ClassBytes *bytes, uint32_t value) {
+
+    putU2(bytes, (uint16_t) (value >> 16));
+    putU2(bytes, (uint16_t) value);
+
+}
+
+
+static inline void putBytes(ClassBytes *bytes, const uint8_t *data, uint32_t length) {
+
+    ensureCapacity(bytes, length);
+
+    if (!bytes->failed) {
+        memcpy(bytes->data + bytes->length, data, length);
+        bytes->length += length;
+    }
+
+}
+
+
+static uint16_t addConstant(ClassBytes *pool, uint16_t *poolCount, uint8_t tag, uint16_t first, uint16_t second) {
+
+    putU1(pool, tag);
+    putU2(pool, first);
+
+    if (tag != CONSTANT_Class) {
+        putU2(pool, second);
+    }
+
+    return (*poolCount)++;
+
+}
+
+
+static uint16_t addUtf8(ClassBytes *pool, uint16_t *poolCount, const uint8_t *jvmString, uint32_t length) {
+
+    putU1(pool, CONSTANT_Utf8);
+    putU2(pool, (uint16_t) length);
+    putBytes(pool, jvmString, length);
+
+    return (*poolCount)++;
+
+}
+
+
+static uint16_t addPlatformUtf8(ClassBytes *pool, uint16_t *poolCount, char *platformString) {
+
+    uint8_t *jvmString = (uint8_t*) platformStringToJVM(platformString);
+
+    return addUtf8(pool, poolCount, jvmString, strlen((const char*) jvmString));
+
+}
+
+
+static uint16_t addInteger(ClassBytes *pool, uint16_t *poolCount, uint32_t value) {
+
+    putU1(pool, CONSTANT_Integer);
+    putU4(pool, value);
+
+    return (*poolCount)++;
+
+}
+
+
+static bool utf8Equals(const uint8_t *data, const uint32_t *constants, uint16_t index, const uint8_t *jvmString) {
+
+    if (index == 0 || constants[index] == 0 || data[constants[index]] != CONSTANT_Utf8) {
+        return false;
+    }
+
+    uint32_t offset = constants[index];
+    uint16_t length = (uint16_t) ((data[offset + 1] << 8) | data[offset + 2]);
+
+    return (length == strlen((const char*) jvmString)) && (memcmp(data + offset + 3, jvmString, length) == 0);
+
+}
+
+
+static uint16_t findUtf8(const uint8_t *data, const uint32_t *constants, uint16_t numberOfConstants, char *platformString) {
+
+    uint8_t *jvmString = (uint8_t*) platformStringToJVM(platformString);
+
+    for (uint16_t i = 1; i < numberOfConstants; i++) {
+        if (utf8Equals(data, constants, i, jvmString)) {
+            return i;
+        }
+    }
+
+    return 0;
+
+}
+
+
+static bool countArgumentSlots(const uint8_t *signature, uint32_t length, bool isStatic, uint16_t *slots, uint8_t *returnOpcode, uint16_t *returnSlots) {
+
+    uint32_t i = 1;
+    uint32_t count = isStatic ? 0 : 1;
+
+    if (length == 0 || signature[0] != DESCRIPTOR_ARGUMENTS) {
+        return false;
+    }
+
+    while (i < length && signature[i] != DESCRIPTOR_ARGUMENTS_END) {
+
+        uint8_t type = signature[i];
+
+        while (i < length && signature[i] == DESCRIPTOR_ARRAY) {
+            i++;
+        }
+
+        if (i < length && signature[i] == DESCRIPTOR_OBJECT) {
+            while (i < length && signature[i] != DESCRIPTOR_OBJECT_END) {
+                i++;
+            }
+        }
+
+        count += (type == DESCRIPTOR_LONG || type == DESCRIPTOR_DOUBLE) ? 2 : 1;
+
+        i++;
+
+    }
+
+    if (i + 1 >= length) {
+        return false;
+    }
+
+    switch (signature[i + 1]) {
+        case DESCRIPTOR_VOID:
+            *returnOpcode = OPCODE_RETURN;
+            *returnSlots = 0;
+            break;
+        case DESCRIPTOR_LONG:
+            *returnOpcode = OPCODE_IRETURN + 1;
+            *returnSlots = 2;
+            break;
+        case DESCRIPTOR_FLOAT:
+            *returnOpcode = OPCODE_IRETURN + 2;
+            *returnSlots = 1;
+            break;
+        case DESCRIPTOR_DOUBLE:
+            *returnOpcode = OPCODE_IRETURN + 3;
+            *returnSlots = 2;
+            break;
+        case DESCRIPTOR_OBJECT:
+        case DESCRIPTOR_ARRAY:
+            *returnOpcode = OPCODE_IRETURN + 4;
+            *returnSlots = 1;
+            break;
+        default:
+            *returnOpcode = OPCODE_IRETURN;
+            *returnSlots = 1;
+            break;
+    }
+
+    *slots = (uint16_t) count;
+
+    return count <= 255;
+
+}
+
+
+static void putLoad(ClassBytes *code, uint8_t type, uint16_t slot) {
+
+    uint8_t kind;
+
+    switch (type) {
+        case DESCRIPTOR_LONG:
+            kind = 1;
+            break;
+        case DESCRIPTOR_FLOAT:
+            kind = 2;
+            break;
+        case DESCRIPTOR_DOUBLE:
+            kind = 3;
+            break;
+        case DESCRIPTOR_OBJECT:
+        case DESCRIPTOR_ARRAY:
+            kind = 4;
+            break;
+        default:
+            kind = 0;
+            break;
+    }
+
+    if (slot <= 3) {
+        putU1(code, (uint8_t) (OPCODE_ILOAD_0 + kind * 4 + slot));
+    } else {
+        putU1(code, (uint8_t) (OPCODE_ILOAD + kind));
+        putU1(code, (uint8_t) slot);
+    }
+
+}
+
+
+static void putHookCall(ClassBytes *code, MethodRecord *method, uint16_t hookMethodIndex) {
+
+    if (method->hookIDIndex) {
+        putU1(code, OPCODE_LDC_W);
+        putU2(code, method->hookIDIndex);
+    } else {
+        putU1(code, OPCODE_SIPUSH);
+        putU2(code, (uint16_t) method->hookID);
+    }
+
+    putU1(code, OPCODE_INVOKESTATIC);
+    putU2(code, hookMethodIndex);
+
+}
+
+
+static void writeWrapperCode(ClassBytes *output, const uint8_t *signature, uint32_t signatureLength, MethodRecord *method, uint16_t codeIndex,
+        uint16_t stackMapIndex, uint16_t throwableIndex, uint16_t enterIndex, uint16_t exitIndex) {
+
+    ClassBytes code = {0};
+
+    bool isStatic = (method->accessFlags & ACC_STATIC) != 0;
+    uint16_t argumentSlots = 0;
+    uint16_t returnSlots = 0;
+    uint8_t returnOpcode = OPCODE_RETURN;
+
+    countArgumentSlots(signature, signatureLength, isStatic, &argumentSlots, &returnOpcode, &returnSlots);
+
+    putHookCall(&code, method, enterIndex);
+
+    uint32_t tryStart = code.length;
+    uint16_t slot = 0;
+
+    if (!isStatic) {
+        putLoad(&code, DESCRIPTOR_OBJECT, slot++);
+    }
+
+    for (uint32_t i = 1; i < signatureLength && signature[i] != DESCRIPTOR_ARGUMENTS_END; i++) {
+
+        uint8_t type = signature[i];
+
+        if (type == DESCRIPTOR_ARRAY) {
+            while (signature[i] == DESCRIPTOR_ARRAY) {
+                i++;
+            }
+        }
+
+        if (signature[i] == DESCRIPTOR_OBJECT) {
+            while (signature[i] != DESCRIPTOR_OBJECT_END) {
+                i++;
+            }
+        }
+
+        putLoad(&code, type, slot);
+        slot += (type == DESCRIPTOR_LONG || type == DESCRIPTOR_DOUBLE) ? 2 : 1;
+
+    }
+
+    putU1(&code, isStatic ? OPCODE_INVOKESTATIC : OPCODE_INVOKESPECIAL);
+    putU2(&code, method->renamedMethodIndex);
+
+    uint32_t tryEnd = code.length;
+
+    putHookCall(&code, method, exitIndex);
+    putU1(&code, returnOpcode);
+
+    uint32_t handler = code.length;
+
+    putHookCall(&code, method, exitIndex);
+    putU1(&code, OPCODE_ATHROW);
+
+    uint16_t maxStack = argumentSlots;
+    if (maxStack < returnSlots + 1) {
+        maxStack = returnSlots + 1;
+    }
+    if (maxStack < 2) {
+        maxStack = 2;
+    }
+
+    uint32_t stackMapLength = stackMapIndex ? 2 + 4 + 2 + 1 + 2 + 2 + 2 + 1 + 2 : 0;
+
+    putU2(output, codeIndex);
+    putU4(output, 2 + 2 + 4 + code.length + 2 + 8 + 2 + stackMapLength);
+    putU2(output, maxStack);
+    putU2(output, argumentSlots);
+    putU4(output, code.length);
+    putBytes(output, code.data, code.length);
+
+    putU2(output, 1);
+    putU2(output, (uint16_t) tryStart);
+    putU2(output, (uint16_t) tryEnd);
+    putU2(output, (uint16_t) handler);
+    putU2(output, 0);
+
+    if (stackMapIndex) {
+        putU2(output, 1);
+        putU2(output, stackMapIndex);
+        putU4(output, 2 + 1 + 2 + 2 + 2 + 1 + 2);
+        putU2(output, 1);
+        putU1(output, FRAME_FULL);
+        putU2(output, (uint16_t) handler);
+        putU2(output, 0);
+        putU2(output, 1);
+        putU1(output, ITEM_OBJECT);
+        putU2(output, throwableIndex);
+    } else {
+        putU2(output, 0);
+    }
+
+    if (code.failed) {
+        output->failed = true;
+    }
+
+    free(code.data);
+
+}
+
+
+static uint32_t registerHook() {
+
+    lock(&hookLock, false);
+
+    uint32_t hookID = numberOfHooks;
+    uint32_t chunk = hookID >> HOOK_CHUNK_BITS;
+
+    if (chunk >= HOOK_CHUNKS) {
+        unlock(&hookLock, false);
+        return (uint32_t) -1;
+    }
+
+    if (hookChunks[chunk] == NULL) {
+
+        jmethodID *methods = calloc(HOOK_CHUNK_LENGTH, sizeof(jmethodID));
+
+        if (methods <= 0) {
+            error("Unable to allocate hook chunk\n")
+            unlock(&hookLock, false);
+            return (uint32_t) -1;
+        }
+
+        memoryBarrier();
+
+        hookChunks[chunk] = methods;
+
+    }
+
+    numberOfHooks++;
+
+    unlock(&hookLock, false);
+
+    return hookID;
+
+}
+
+
+jmethodID getHookMethod(uint32_t hookID) {
+
+    volatile jmethodID *methods = hookChunks[(hookID >> HOOK_CHUNK_BITS) & (HOOK_CHUNKS - 1)];
+
+    if (methods == NULL || hookID >= numberOfHooks) {
+        return NULL;
+    }
+
+    return methods[hookID & HOOK_CHUNK_MASK];
+
+}
+
+
+void setHookMethod(uint32_t hookID, jmethodID method) {
+
+    volatile jmethodID *methods = hookChunks[(hookID >> HOOK_CHUNK_BITS) & (HOOK_CHUNKS - 1)];
+
+    if (methods) {
+        methods[hookID & HOOK_CHUNK_MASK] = method;
+    }
+
+}
+
+
+uint32_t getNumberOfHooks() {
+
+    return numberOfHooks;
+
+}
+
+
+bool isRenamedMethod(const uint8_t *methodName) {
+
+    if (methodName == NULL) {
+        return false;
+    }
+
+    uint8_t *suffix = (uint8_t*) platformStringToJVM(INSTRUMENT_SUFFIX);
+
+    size_t nameLength = strlen((const char*) methodName);
+    size_t suffixLength = strlen((const char*) suffix);
+
+    return nameLength > suffixLength && memcmp(methodName + nameLength - suffixLength, suffix, suffixLength) == 0;
+
+}
+
+
+bool isWrapperMethod(MethodInfo *methods, uint32_t numberOfMethods, uint32_t index) {
+
+    const uint8_t *name = methods[index].name;
+    const uint8_t *signature = methods[index].signature;
+
+    if (name == NULL || signature == NULL || isRenamedMethod(name)) {
+        return false;
+    }
+
+    uint8_t *suffix = (uint8_t*) platformStringToJVM(INSTRUMENT_SUFFIX);
+
+    size_t nameLength = strlen((const char*) name);
+    size_t suffixLength = strlen((const char*) suffix);
+
+    for (uint32_t i = 0; i < numberOfMethods; i++) {
+
+        const uint8_t *candidate = methods[i].name;
+
+        if (candidate && methods[i].signature
+                && strlen((const char*) candidate) == nameLength + suffixLength
+                && memcmp(candidate, name, nameLength) == 0
+                && memcmp(candidate + nameLength, suffix, suffixLength) == 0
+                && strcmp((const char*) methods[i].signature, (const char*) signature) == 0) {
+            return true;
+        }
+
+    }
+
+    return false;
+
+}
+
+
+bool instrumentClass(jvmtiEnv *jvmtiInterface, ClassFilter *filter, const char *name, jint classDataLength, const unsigned char *classData, jint *newClassDataLength, unsigned char **newClassData) {
+
+    if (!hookDefined || name == NULL) {
+        return false;
+    }
+
+    uint8_t *platformName = (uint8_t*) JVMStringToPlatform((char*) name);
+
+    if (!isClassIncluded(filter, (const uint8_t*) name)) {
+        return false;
+    }
+
+    ClassReader reader = {classData, (uint32_t) classDataLength, 0, false};
+
+    if (readU4(&reader) != CLASS_MAGIC) {
+        return false;
+    }
+
+    readU2(&reader);
+    uint16_t majorVersion = readU2(&reader);
+
+    uint16_t numberOfConstants = readU2(&reader);
+
+    uint32_t *constants = calloc(numberOfConstants + 1, sizeof(uint32_t));
+    if (constants <= 0) {
+        error("Unable to allocate constant pool index\n")
+        return false;
+    }
+
+    for (uint16_t i = 1; i < numberOfConstants && !reader.failed; i++) {
+
+        constants[i] = reader.offset;
+
+        uint8_t tag = readU1(&reader);
+
+        switch (tag) {
+            case CONSTANT_Utf8:
+                skip(&reader, readU2(&reader));
+                break;
+            case CONSTANT_Integer:
+            case CONSTANT_Float:
+            case CONSTANT_Fieldref:
+            case CONSTANT_Methodref:
+            case CONSTANT_InterfaceMethodref:
+            case CONSTANT_NameAndType:
+            case CONSTANT_Dynamic:
+            case CONSTANT_InvokeDynamic:
+                skip(&reader, 4);
+                break;
+            case CONSTANT_Long:
+            case CONSTANT_Double:
+                skip(&reader, 8);
+                i++;
+                break;
+            case CONSTANT_Class:
+            case CONSTANT_String:
+            case CONSTANT_MethodType:
+            case CONSTANT_Module:
+            case CONSTANT_Package:
+                skip(&reader, 2);
+                break;
+            case CONSTANT_MethodHandle:
+                skip(&reader, 3);
+                break;
+            default:
+                warn("Unknown constant tag %d in %s, not instrumenting\n", tag, platformName)
+                reader.failed = true;
+                break;
+        }
+
+    }
+
+    uint32_t constantsEnd = reader.offset;
+
+    uint16_t accessFlags = readU2(&reader);
+    uint16_t thisClass = readU2(&reader);
+    readU2(&reader);
+
+    if (reader.failed || (accessFlags & (ACC_INTERFACE | ACC_ANNOTATION | ACC_MODULE))) {
+        free(constants);
+        return false;
+    }
+
+    skip(&reader, 2 * readU2(&reader));
+
+    uint16_t numberOfFields = readU2(&reader);
+
+    for (uint16_t i = 0; i < numberOfFields && !reader.failed; i++) {
+        skip(&reader, 6);
+        uint16_t numberOfAttributes = readU2(&reader);
+        for (uint16_t j = 0; j < numberOfAttributes && !reader.failed; j++) {
+            skip(&reader, 2);
+            skip(&reader, readU4(&reader));
+        }
+    }
+
+    uint32_t methodsCountOffset = reader.offset;
+    uint16_t numberOfMethods = readU2(&reader);
+
+    MethodRecord *methods = calloc(numberOfMethods + 1, sizeof(MethodRecord));
+    if (methods <= 0) {
+        error("Unable to allocate method records\n")
+        free(constants);
+        return false;
+    }
+
+    uint16_t codeIndex = findUtf8(classData, constants, numberOfConstants, "Code");
+    uint8_t *codeName = (uint8_t*) platformStringToJVM("Code");
+    uint8_t *initName = (uint8_t*) platformStringToJVM("<init>");
+    uint8_t *clinitName = (uint8_t*) platformStringToJVM("<clinit>");
+    uint32_t numberToInstrument = 0;
+
+    for (uint16_t i = 0; i < numberOfMethods && !reader.failed; i++) {
+
+        MethodRecord *method = &methods[i];
+
+        method->start = reader.offset;
+        method->accessFlags = readU2(&reader);
+        method->nameIndex = readU2(&reader);
+        method->signatureIndex = readU2(&reader);
+
+        uint16_t numberOfAttributes = readU2(&reader);
+
+        for (uint16_t j = 0; j < numberOfAttributes && !reader.failed; j++) {
+
+            uint32_t attributeStart = reader.offset;
+            uint16_t attributeName = readU2(&reader);
+            uint32_t attributeLength = readU4(&reader);
+
+            skip(&reader, attributeLength);
+
+            if (utf8Equals(classData, constants, attributeName, codeName)) {
+                method->codeStart = attributeStart;
+                method->codeEnd = reader.offset;
+            }
+
+        }
+
+        method->end = reader.offset;
+
+        if (reader.failed || method->codeStart == 0
+                || (method->accessFlags & (ACC_ABSTRACT | ACC_NATIVE | ACC_BRIDGE))
+                || utf8Equals(classData, constants, method->nameIndex, initName)
+                || utf8Equals(classData, constants, method->nameIndex, clinitName)
+                || constants[method->signatureIndex] == 0) {
+            continue;
+        }
+
+        uint32_t signatureOffset = constants[method->signatureIndex];
+        uint16_t signatureLength = (uint16_t) ((classData[signatureOffset + 1] << 8) | classData[signatureOffset + 2]);
+        uint8_t returnOpcode;
+        uint16_t returnSlots;
+
+        if (!countArgumentSlots(classData + signatureOffset + 3, signatureLength, (method->accessFlags & ACC_STATIC) != 0,
+                &method->argumentSlots, &returnOpcode, &returnSlots)) {
+            continue;
+        }
+
+        method->instrument = true;
+        numberToInstrument++;
+
+    }
+
+    if (reader.failed || numberToInstrument == 0) {
+        free(methods);
+        free(constants);
+        return false;
+    }
+
+    // The count of the constant pool is a u2, so the class is left alone unless the hook constants and those of
+    // at least one method fit
+
+    if ((uint32_t) numberOfConstants + INSTRUMENT_CLASS_CONSTANTS + INSTRUMENT_METHOD_CONSTANTS > CLASS_CONSTANTS_LIMIT) {
+        warn("Constant pool of %s too large, not instrumenting\n", platformName)
+        free(methods);
+        free(constants);
+        return false;
+    }
+
+    ClassBytes pool = {0};
+    uint16_t poolCount = numberOfConstants;
+
+    uint16_t hookNameIndex = addPlatformUtf8(&pool, &poolCount, HOOK_CLASS_NAME);
+    uint16_t hookClassIndex = addConstant(&pool, &poolCount, CONSTANT_Class, hookNameIndex, 0);
+    uint16_t hookSignatureIndex = addPlatformUtf8(&pool, &poolCount, HOOK_SIGNATURE);
+    uint16_t enterNameIndex = addPlatformUtf8(&pool, &poolCount, HOOK_ENTER_NAME);
+    uint16_t exitNameIndex = addPlatformUtf8(&pool, &poolCount, HOOK_EXIT_NAME);
+    uint16_t enterTypeIndex = addConstant(&pool, &poolCount, CONSTANT_NameAndType, enterNameIndex, hookSignatureIndex);
+    uint16_t exitTypeIndex = addConstant(&pool, &poolCount, CONSTANT_NameAndType, exitNameIndex, hookSignatureIndex);
+    uint16_t enterIndex = addConstant(&pool, &poolCount, CONSTANT_Methodref, hookClassIndex, enterTypeIndex);
+    uint16_t exitIndex = addConstant(&pool, &poolCount, CONSTANT_Methodref, hookClassIndex, exitTypeIndex);
+
+    if (codeIndex == 0) {
+        codeIndex = addPlatformUtf8(&pool, &poolCount, "Code");
+    }
+
+    uint16_t stackMapIndex = 0;
+    uint16_t throwableIndex = 0;
+
+    if (majorVersion >= STACK_MAP_MAJOR_VERSION) {
+        stackMapIndex = findUtf8(classData, constants, numberOfConstants, "StackMapTable");
+        if (stackMapIndex == 0) {
+            stackMapIndex = addPlatformUtf8(&pool, &poolCount, "StackMapTable");
+        }
+        uint16_t throwableNameIndex = addPlatformUtf8(&pool, &poolCount, "java/lang/Throwable");
+        throwableIndex = addConstant(&pool, &poolCount, CONSTANT_Class, throwableNameIndex, 0);
+    }
+
+    uint8_t *suffix = (uint8_t*) strdup((const char*) platformStringToJVM(INSTRUMENT_SUFFIX));
+    uint32_t suffixLength = strlen((const char*) suffix);
+
+    for (uint16_t i = 0; i < numberOfMethods; i++) {
+
+        MethodRecord *method = &methods[i];
+
+        if (!method->instrument) {
+            continue;
+        }
+
+        method->hookID = registerHook();
+
+        if (method->hookID == (uint32_t) -1 || poolCount > CLASS_CONSTANTS_LIMIT - INSTRUMENT_METHOD_CONSTANTS) {
+            method->instrument = false;
+            continue;
+        }
+
+        uint32_t nameOffset = constants[method->nameIndex];
+        uint16_t nameLength = (uint16_t) ((classData[nameOffset + 1] << 8) | classData[nameOffset + 2]);
+
+        uint8_t *renamed = calloc(1, nameLength + suffixLength + 1);
+        if (renamed <= 0) {
+            error("Unable to allocate renamed method name\n")
+            method->instrument = false;
+            continue;
+        }
+
+        memcpy(renamed, classData + nameOffset + 3, nameLength);
+        memcpy(renamed + nameLength, suffix, suffixLength);
+
+        method->renamedNameIndex = addUtf8(&pool, &poolCount, renamed, nameLength + suffixLength);
+        uint16_t renamedTypeIndex = addConstant(&pool, &poolCount, CONSTANT_NameAndType, method->renamedNameIndex, method->signatureIndex);
+        method->renamedMethodIndex = addConstant(&pool, &poolCount, CONSTANT_Methodref, thisClass, renamedTypeIndex);
+
+        if (method->hookID > INT16_MAX) {
+            method->hookIDIndex = addInteger(&pool, &poolCount, method->hookID);
+        }
+
+        free(renamed);
+
+    }
+
+    free(suffix);
+
+    ClassBytes output = {0};
+    uint16_t methodCount = numberOfMethods;
+
+    for (uint16_t i = 0; i < numberOfMethods; i++) {
+        if (methods[i].instrument) {
+            methodCount++;
+        }
+    }
+
+    putBytes(&output, classData, 8);
+    putU2(&output, poolCount);
+    putBytes(&output, classData + 10, constantsEnd - 10);
+    putBytes(&output, pool.data, pool.length);
+    putBytes(&output, classData + constantsEnd, methodsCountOffset - constantsEnd);
+    putU2(&output, methodCount);
+
+    for (uint16_t i = 0; i < numberOfMethods; i++) {
+
+        MethodRecord *method = &methods[i];
+
+        if (!method->instrument) {
+            putBytes(&output, classData + method->start, method->end - method->start);
+            continue;
+        }
+
+        putU2(&output, (uint16_t) ((method->accessFlags & ~(ACC_PUBLIC | ACC_PROTECTED)) | ACC_PRIVATE | ACC_SYNTHETIC));
+        putU2(&output, method->renamedNameIndex);
+        putU2(&output, method->signatureIndex);
+        putU2(&output, 1);
+        putBytes(&output, classData + method->codeStart, method->codeEnd - method->codeStart);
+
+        ClassReader attributes = {classData, method->end, method->start + 6, false};
+        uint16_t numberOfAttributes = readU2(&attributes);
+
+        putU2(&output, (uint16_t) (method->accessFlags & ~ACC_SYNCHRONIZED));
+        putU2(&output, method->nameIndex);
+        putU2(&output, method->signatureIndex);
+        putU2(&output, numberOfAttributes);
+
+        for (uint16_t j = 0; j < numberOfAttributes && !attributes.failed; j++) {
+
+            uint32_t attributeStart = attributes.offset;
+            skip(&attributes, 2);
+            skip(&attributes, readU4(&attributes));
+
+            if (attributeStart != method->codeStart) {
+                putBytes(&output, classData + attributeStart, attributes.offset - attributeStart);
+            }
+
+        }
+
+        uint32_t signatureOffset = constants[method->signatureIndex];
+        uint16_t signatureLength = (uint16_t) ((classData[signatureOffset + 1] << 8) | classData[signatureOffset + 2]);
+
+        writeWrapperCode(&output, classData + signatureOffset + 3, signatureLength, method, codeIndex, stackMapIndex, throwableIndex, enterIndex, exitIndex);
+
+    }
+
+    putBytes(&output, classData + reader.offset, classDataLength - reader.offset);
+
+    bool instrumented = false;
+
+    if (!output.failed && !pool.failed) {
+
+        unsigned char *newData = NULL;
+
+        jvmtiError returnCode = (*jvmtiInterface)->Allocate(jvmtiInterface, output.length, &newData);
+
+        if (returnCode == JNI_OK) {
+            memcpy(newData, output.data, output.length);
+            *newClassData = newData;
+            *newClassDataLength = (jint) output.length;
+            instrumented = true;
+            debug("Instrumented %s, %d methods, %d bytes\n", platformName, numberToInstrument, output.length)
+        } else {
+            error("Unable to allocate instrumented class (%d)\n", returnCode)
+        }
+
+    }
+
+    free(output.data);
+    free(pool.data);
+    free(methods);
+    free(constants);
+
+    return instrumented;
+
+}
+
+
+jclass defineHookClass(JNIEnv *jni_env, const JNINativeMethod *natives, jint numberOfNatives) {
+
+    ClassBytes pool = {0};
+    uint16_t poolCount = 1;
+
+    uint16_t hookNameIndex = addPlatformUtf8(&pool, &poolCount, HOOK_CLASS_NAME);
+    uint16_t hookClassIndex = addConstant(&pool, &poolCount, CONSTANT_Class, hookNameIndex, 0);
+    uint16_t objectNameIndex = addPlatformUtf8(&pool, &poolCount, "java/lang/Object");
+    uint16_t objectClassIndex = addConstant(&pool, &poolCount, CONSTANT_Class, objectNameIndex, 0);
+    uint16_t hookSignatureIndex = addPlatformUtf8(&pool, &poolCount, HOOK_SIGNATURE);
+    uint16_t enterNameIndex = addPlatformUtf8(&pool, &poolCount, HOOK_ENTER_NAME);
+    uint16_t exitNameIndex = addPlatformUtf8(&pool, &poolCount, HOOK_EXIT_NAME);
+
+    ClassBytes output = {0};
+
+    putU4(&output, CLASS_MAGIC);
+    putU2(&output, 0);
+    putU2(&output, STACK_MAP_MAJOR_VERSION);
+    putU2(&output, poolCount);
+    putBytes(&output, pool.data, pool.length);
+    putU2(&output, ACC_PUBLIC | ACC_FINAL | ACC_SUPER);
+    putU2(&output, hookClassIndex);
+    putU2(&output, objectClassIndex);
+    putU2(&output, 0);
+    putU2(&output, 0);
+    putU2(&output, 2);
+
+    putU2(&output, ACC_PUBLIC | ACC_STATIC | ACC_NATIVE);
+    putU2(&output, enterNameIndex);
+    putU2(&output, hookSignatureIndex);
+    putU2(&output, 0);
+
+    putU2(&output, ACC_PUBLIC | ACC_STATIC | ACC_NATIVE);
+    putU2(&output, exitNameIndex);
+    putU2(&output, hookSignatureIndex);
+    putU2(&output, 0);
+
+    putU2(&output, 0);
+
+    jclass hookClass = NULL;
+
+    if (!output.failed && !pool.failed) {
+
+        hookClass = (*jni_env)->DefineClass(jni_env, platformStringToJVM(HOOK_CLASS_NAME), NULL, (const jbyte*) output.data, (jsize) output.length);
+
+        if (hookClass == NULL || (*jni_env)->ExceptionCheck(jni_env)) {
+            (*jni_env)->ExceptionDescribe(jni_env);
+            (*jni_env)->ExceptionClear(jni_env);
+            error("Unable to define the hook class\n")
+            hookClass = NULL;
+        } else if ((*jni_env)->RegisterNatives(jni_env, hookClass, natives, numberOfNatives) != JNI_OK) {
+            (*jni_env)->ExceptionClear(jni_env);
+            error("Unable to register the hook natives\n")
+            hookClass = NULL;
+        } else {
+            hookClass = (*jni_env)->NewGlobalRef(jni_env, hookClass);
+            hookDefined = true;
+#ifdef JNI_VERSION_9
+            if ((*jni_env)->GetVersion(jni_env) >= JNI_VERSION_9) {
+                hookModule = (*jni_env)->NewGlobalRef(jni_env, (*jni_env)->GetModule(jni_env, hookClass));
+            }
+#endif
+        }
+
+    }
+
+    free(output.data);
+    free(pool.data);
+
+    return hookClass;
+
+}
+
+
+/*
+ * The hook class is in the unnamed module of the boot loader, which a named module does not read, so the module of
+ * an instrumented class in a named package is given the edge before its wrappers can call the hook. Built against a
+ * JDK 8 jvmti.h, or on a VM without modules, there is nothing to do.
+ */
+void readHookModule(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jobject loader, const char *name) {
+
+#ifdef JNI_VERSION_9
+    if (hookModule == NULL || name == NULL) {
+        return;
+    }
+
+    const char *separator = strrchr(name, FILTER_JVM_SEPARATOR);
+
+    if (separator == NULL) {
+        return;
+    }
+
+    size_t length = separator - name;
+    char *packageName = calloc(1, length + 1);
+    if (packageName <= 0) {
+        error("Unable to allocate package name\n")
+        return;
+    }
+
+    memcpy(packageName, name, length);
+
+    jobject module = NULL;
+    jvmtiError returnCode = (*jvmtiInterface)->GetNamedModule(jvmtiInterface, loader, packageName, &module);
+
+    if (returnCode == JVMTI_ERROR_NONE && module != NULL) {
+
+        returnCode = (*jvmtiInterface)->AddModuleReads(jvmtiInterface, module, hookModule);
+        if (returnCode != JVMTI_ERROR_NONE) {
+            warn("Unable to let the module of %s read the hook class (%d)\n", JVMStringToPlatform((char*) name), returnCode)
+        }
+
+        (*jni_env)->DeleteLocalRef(jni_env, module);
+
+    }
+
+    free(packageName);
+#endif
+
+}
@@ -0,0 +1,102 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#ifndef INSTRUMENT_H_
+#define INSTRUMENT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "util.h"
+#include "filter.h"
+#include "tables.h"
+#include "jvmti.h"
+
+#define INSTRUMENT_SUFFIX "$$prf"
+#define HOOK_CLASS_NAME "profiler/Hook"
+#define HOOK_ENTER_NAME "enter"
+#define HOOK_EXIT_NAME "exit"
+#define HOOK_SIGNATURE "(I)V"
+
+#define HOOK_CHUNK_BITS 12
+#define HOOK_CHUNK_LENGTH (1 << HOOK_CHUNK_BITS)
+#define HOOK_CHUNK_MASK (HOOK_CHUNK_LENGTH - 1)
+#define HOOK_CHUNKS 4096
+
+#define CLASS_CONSTANTS_LIMIT 65535
+#define INSTRUMENT_CLASS_CONSTANTS 13
+#define INSTRUMENT_METHOD_CONSTANTS 4
+
+#define CLASS_MAGIC 0xCAFEBABE
+#define STACK_MAP_MAJOR_VERSION 50
+
+#define CONSTANT_Utf8 1
+#define CONSTANT_Integer 3
+#define CONSTANT_Float 4
+#define CONSTANT_Long 5
+#define CONSTANT_Double 6
+#define CONSTANT_Class 7
+#define CONSTANT_String 8
+#define CONSTANT_Fieldref 9
+#define CONSTANT_Methodref 10
+#define CONSTANT_InterfaceMethodref 11
+#define CONSTANT_NameAndType 12
+#define CONSTANT_MethodHandle 15
+#define CONSTANT_MethodType 16
+#define CONSTANT_Dynamic 17
+#define CONSTANT_InvokeDynamic 18
+#define CONSTANT_Module 19
+#define CONSTANT_Package 20
+
+#define ACC_PUBLIC 0x0001
+#define ACC_PRIVATE 0x0002
+#define ACC_PROTECTED 0x0004
+#define ACC_FINAL 0x0010
+#define ACC_SUPER 0x0020
+#define ACC_SYNCHRONIZED 0x0020
+#define ACC_BRIDGE 0x0040
+#define ACC_NATIVE 0x0100
+#define ACC_INTERFACE 0x0200
+#define ACC_ABSTRACT 0x0400
+#define ACC_SYNTHETIC 0x1000
+#define ACC_ANNOTATION 0x2000
+#define ACC_MODULE 0x8000
+
+#define OPCODE_ILOAD 0x15
+#define OPCODE_ILOAD_0 0x1a
+#define OPCODE_SIPUSH 0x11
+#define OPCODE_LDC_W 0x13
+#define OPCODE_IRETURN 0xac
+#define OPCODE_RETURN 0xb1
+#define OPCODE_INVOKESPECIAL 0xb7
+#define OPCODE_INVOKESTATIC 0xb8
+#define OPCODE_ATHROW 0xbf
+
+#define FRAME_FULL 255
+#define ITEM_OBJECT 7
+
+// Descriptor characters as the class file holds them, in ASCII on every platform
+
+#define DESCRIPTOR_ARGUMENTS 0x28
+#define DESCRIPTOR_ARGUMENTS_END 0x29
+#define DESCRIPTOR_OBJECT 0x4C
+#define DESCRIPTOR_OBJECT_END 0x3B
+#define DESCRIPTOR_ARRAY 0x5B
+#define DESCRIPTOR_LONG 0x4A
+#define DESCRIPTOR_DOUBLE 0x44
+#define DESCRIPTOR_FLOAT 0x46
+#define DESCRIPTOR_VOID 0x56
+
+bool instrumentClass(jvmtiEnv *jvmtiInterface, ClassFilter *filter, const char *name, jint classDataLength, const unsigned char *classData, jint *newClassDataLength, unsigned char **newClassData);
+jclass defineHookClass(JNIEnv *jni_env, const JNINativeMethod *natives, jint numberOfNatives);
+void readHookModule(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jobject loader, const char *name);
+jmethodID getHookMethod(uint32_t hookID);
+void setHookMethod(uint32_t hookID, jmethodID method);
+bool isRenamedMethod(const uint8_t *methodName);
+bool isWrapperMethod(MethodInfo *methods, uint32_t numberOfMethods, uint32_t index);
+uint32_t getNumberOfHooks();
+
+
+#endif /* INSTRUMENT_H_ */
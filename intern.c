@@ -0,0 +1,141 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "intern.h"
+#include "util.h"
+
+typedef struct InternTable_struct InternTable;
+
+struct InternTable_struct {
+    volatile LockStructure lock;
+    Arena *arena;
+    uint32_t entries;
+    uint32_t uniqueStringID;
+    uint64_t requests;
+    uint64_t hits;
+    uint64_t bytesSaved;
+    InternedString * volatile buckets[INTERN_TABLE_BUCKETS];
+};
+
+static InternTable *internTable;
+
+
+void createInternTable(Arena *arena) {
+
+    internTable = calloc(1, sizeof(InternTable));
+    if (internTable <= 0) {
+        error("Unable to allocate InternTable\n")
+        exit(-1);
+    }
+
+    internTable->arena = arena;
+    internTable->uniqueStringID = 1;
+
+    registerLock("internTable", &internTable->lock);
+
+}
+
+
+void clearInternTable() {
+
+    // The strings themselves are released with the arena
+
+    memset((void*) internTable->buckets, 0, sizeof(internTable->buckets));
+    internTable->entries = 0;
+    internTable->uniqueStringID = 1;
+
+}
+
+
+static inline InternedString* findInternedString(InternedString *node, const char *original, uint32_t length, uint32_t hashCode) {
+
+    while (node > 0) {
+
+        if (node->hashCode == hashCode && node->length == length && memcmp(node->string, original, length) == 0) {
+            return node;
+        }
+
+        node = node->next;
+    }
+
+    return NULL;
+
+}
+
+
+uint8_t* internString(const char *original) {
+
+    if (original == NULL) {
+        return NULL;
+    }
+
+    uint32_t length = strlen(original);
+
+    if (length == 0 || length > UINT16_MAX) {
+        return NULL;
+    }
+
+    uint32_t hashCode = jenkins_one_at_a_time_hash(original, length);
+    uint32_t key = hashCode & INTERN_TABLE_MASK;
+
+    internTable->requests++;
+
+    InternedString *node = findInternedString(internTable->buckets[key], original, length, hashCode);
+
+    if (node <= 0) {
+
+        lock(&internTable->lock, false);
+
+        node = findInternedString(internTable->buckets[key], original, length, hashCode);
+
+        if (node <= 0) {
+
+            node = arenaAllocate(internTable->arena, sizeof(InternedString) + length + 1);
+            if (node <= 0) {
+                unlock(&internTable->lock, false);
+                error("Unable to allocate InternedString\n")
+                return NULL;
+            }
+
+            memcpy(node->string, original, length);
+            node->length = (uint16_t) length;
+            node->hashCode = hashCode;
+            node->stringID = internTable->uniqueStringID++;
+            node->next = internTable->buckets[key];
+
+            memoryBarrier();
+
+            internTable->buckets[key] = node;
+            internTable->entries++;
+
+            unlock(&internTable->lock, false);
+
+            return node->string;
+        }
+
+        unlock(&internTable->lock, false);
+
+    }
+
+    internTable->hits++;
+    internTable->bytesSaved += length + 1;
+
+    return node->string;
+
+}
+
+
+void reportInternStatistics() {
+
+    info("InternTable:\n")
+    info("\tUnique Strings: %d\n", internTable->entries)
+    info("\tRequests: %" PRIu64 ", Hits: %" PRIu64 ", Bytes Saved: %" PRIu64 "\n", internTable->requests, internTable->hits, internTable->bytesSaved)
+    info("\n")
+
+}
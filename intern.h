@@ -0,0 +1,41 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#ifndef INTERN_H_
+#define INTERN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "arena.h"
+
+#define INTERN_TABLE_BUCKETS 16384
+#define INTERN_TABLE_MASK 16383
+
+typedef struct InternedString_struct InternedString;
+
+struct InternedString_struct {
+    InternedString * volatile next;
+    uint32_t hashCode;
+    uint32_t stringID;
+    volatile uint32_t epoch;
+    uint16_t length;
+    uint8_t string[];
+};
+
+void createInternTable(Arena *arena);
+void clearInternTable();
+uint8_t* internString(const char *original);
+void reportInternStatistics();
+
+
+static inline InternedString* getInternedString(const uint8_t *string) {
+
+    return (InternedString*) (string - offsetof(InternedString, string));
+
+}
+
+
+#endif /* INTERN_H_ */
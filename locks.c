@@ -0,0 +1,128 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#include <string.h>
+#include <inttypes.h>
+#include "locks.h"
+#include "util.h"
+
+#ifdef __linux
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+static LockStatistics namedLocks[MAX_NAMED_LOCKS];
+static volatile uint32_t numberOfNamedLocks = 0;
+
+
+/*
+ * Only the futex lock records statistics, so only there does the lock word
+ * carry the index of its entry in namedLocks (offset by one, zero is unnamed).
+ */
+static void tagLock(volatile uint32_t *lock, uint32_t index) {
+
+#ifdef __linux
+    uint32_t tag = (index + 1) << LOCK_INDEX_SHIFT;
+    uint32_t current = *lock;
+
+    while (!__sync_bool_compare_and_swap(lock, current, (current & LOCK_STATE_MASK) | tag)) {
+        current = *lock;
+    }
+#endif
+
+}
+
+
+void registerLock(const char *name, volatile uint32_t *lock) {
+
+    for (int i = 0; i < numberOfNamedLocks; i++) {
+        if (strcmp(namedLocks[i].name, name) == 0) {
+            namedLocks[i].lock = lock;
+            tagLock(lock, i);
+            return;
+        }
+    }
+
+    if (numberOfNamedLocks >= MAX_NAMED_LOCKS) {
+        warn("Too many named locks, %s not recorded\n", name)
+        return;
+    }
+
+    namedLocks[numberOfNamedLocks].name = name;
+    namedLocks[numberOfNamedLocks].lock = lock;
+
+    memoryBarrier();
+
+    tagLock(lock, numberOfNamedLocks);
+    numberOfNamedLocks++;
+
+}
+
+
+void recordLock(uint32_t tag, bool contended, uint64_t waitTicks) {
+
+    LockStatistics *statistics = &namedLocks[(tag >> LOCK_INDEX_SHIFT) - 1];
+
+    statistics->acquisitions++;
+    if (contended) {
+        statistics->contended++;
+        statistics->waitTicks += waitTicks;
+    }
+
+}
+
+
+#ifdef __linux
+
+uint64_t lockContended(volatile uint32_t *lock) {
+
+    uint64_t start = getTicks();
+    uint32_t tag = *lock & ~LOCK_STATE_MASK;
+
+    for (int i = 0; i < LOCK_SPIN_COUNT; i++) {
+
+        cpuRelax();
+
+        if (*lock == (tag | UNLOCKED) && __sync_bool_compare_and_swap(lock, tag | UNLOCKED, tag | LOCKED)) {
+            return getTicks() - start;
+        }
+
+    }
+
+    while (__sync_lock_test_and_set(lock, tag | CONTENDED) != (tag | UNLOCKED)) {
+        syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, tag | CONTENDED, NULL, NULL, 0);
+    }
+
+    return getTicks() - start;
+
+}
+
+
+void wakeLockWaiter(volatile uint32_t *lock) {
+
+    syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+
+}
+
+#endif
+
+
+void reportLockStatistics() {
+
+    info("Locks:\n")
+
+    for (int i = 0; i < numberOfNamedLocks; i++) {
+
+        LockStatistics *statistics = &namedLocks[i];
+
+        info("\t%s: Acquisitions: %" PRIu64 ", Contended: %" PRIu64 ", Wait Ticks: %" PRIu64 "\n",
+                statistics->name, statistics->acquisitions, statistics->contended, statistics->waitTicks)
+
+    }
+
+    info("\n")
+
+}
@@ -0,0 +1,36 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#ifndef LOCKS_H_
+#define LOCKS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CONTENDED 2
+#define LOCK_SPIN_COUNT 128
+#define MAX_NAMED_LOCKS 32
+#define LOCK_STATE_MASK 0xFFu
+#define LOCK_INDEX_SHIFT 8
+
+typedef struct LockStatistics_struct LockStatistics;
+
+struct LockStatistics_struct {
+    const char *name;
+    volatile uint32_t *lock;
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t waitTicks;
+};
+
+void registerLock(const char *name, volatile uint32_t *lock);
+void recordLock(uint32_t tag, bool contended, uint64_t waitTicks);
+uint64_t lockContended(volatile uint32_t *lock);
+void wakeLockWaiter(volatile uint32_t *lock);
+void reportLockStatistics();
+
+
+#endif /* LOCKS_H_ */
@@ -0,0 +1,1758 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include "output.h"
+#include "locks.h"
+#include "util.h"
+
+#ifdef __linux
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <time.h>
+#endif
+
+#if defined __linux || defined __MVS__
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#endif
+
+#if defined __linux && !defined NO_IO_URING
+#define HAVE_IO_URING
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#define FRAME_FREE 0
+#define FRAME_FILLING 1
+#define FRAME_QUEUED 2
+#define FRAME_DONE 3
+
+typedef struct OutputFrame_struct OutputFrame;
+typedef struct FrameIndexEntry_struct FrameIndexEntry;
+typedef struct CompressorState_struct CompressorState;
+
+struct OutputFrame_struct {
+    volatile uint32_t state;
+    uint32_t sequence;
+    uint8_t *input;
+    uint32_t inputLength;
+    uint8_t *output;
+    uint32_t outputLength;
+    uint8_t codec;
+};
+
+struct FrameIndexEntry_struct {
+    uint64_t fileOffset;
+    uint64_t streamOffset;
+    uint32_t storedLength;
+    uint32_t inputLength;
+};
+
+struct CompressorState_struct {
+    uint32_t *hashTable;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstdContext;
+#endif
+};
+
+static FILE *outputFile = NULL;
+static bool framedOutput = false;
+static uint32_t outputCodec = OUTPUT_CODEC_STORED;
+static uint32_t outputCapacity;
+
+static OutputFrame frames[OUTPUT_FRAME_SLOTS];
+static OutputFrame *currentFrame = NULL;
+static pthread_mutex_t frameMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t frameQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t frameWritten = PTHREAD_COND_INITIALIZER;
+static uint32_t fillSequence;
+static uint32_t queuedSequence;
+static uint32_t compressSequence;
+static uint32_t writeSequence;
+static bool writingFrames;
+
+static uint32_t numberOfCompressors = 0;
+static pthread_t compressorThreads[OUTPUT_MAX_COMPRESSION_THREADS];
+static volatile bool compressorsRunning = false;
+static CompressorState producerState;
+
+static FrameIndexEntry *frameIndex = NULL;
+static uint32_t indexEntries;
+static uint32_t indexCapacity;
+static uint64_t fileOffset;
+static uint64_t streamOffset;
+
+static bool mappedOutput = false;
+static int mappedFile = -1;
+static uint8_t * volatile mappedWindows[OUTPUT_MAP_WINDOWS];
+static volatile uint64_t mappedOffset = OUTPUT_MAP_CLOSED;
+static volatile uint64_t mappedCompleted = 0;
+static uint32_t mappedWindowCount = 0;
+static LockStructure mapLock = UNLOCKED;
+static volatile bool mappedStopped = false;
+static uint64_t mappedDropped;
+
+static bool uringOutput = false;
+
+#ifdef HAVE_IO_URING
+static int uringRing = -1;
+static int uringFile = -1;
+static volatile uint32_t *submissionHead;
+static volatile uint32_t *submissionTail;
+static uint32_t *submissionArray;
+static uint32_t submissionMask;
+static struct io_uring_sqe *submissionEntries;
+static volatile uint32_t *completionHead;
+static volatile uint32_t *completionTail;
+static uint32_t completionMask;
+static struct io_uring_cqe *completionEntries;
+static uint8_t *uringBuffers = NULL;
+static bool uringRegistered = false;
+static bool uringBusy[OUTPUT_URING_BUFFERS];
+static uint32_t uringLengths[OUTPUT_URING_BUFFERS];
+static uint64_t uringOffsets[OUTPUT_URING_BUFFERS];
+static uint32_t uringNext;
+static uint32_t uringInFlight;
+static uint64_t uringOffset;
+static uint64_t uringWrites;
+static uint64_t uringWaits;
+static uint64_t uringErrors;
+#endif
+
+static uint64_t bytesIn;
+static uint64_t bytesOut;
+static uint64_t framesWritten;
+static uint64_t producerWaits;
+
+static uint8_t *collectorRing = NULL;
+static uint64_t collectorCapacity;
+static uint64_t collectorHead;
+static uint64_t collectorTail;
+static int collectorSocket = -1;
+static bool collectorOnly = false;
+static bool collectorWaiting = false;
+static bool collectorActive = false;
+static bool collectorFileOpen = false;
+static volatile bool collectorRunning = false;
+static pthread_t collectorThread;
+static pthread_mutex_t collectorMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t collectorQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t collectorDrained = PTHREAD_COND_INITIALIZER;
+static uint64_t collectorSent;
+static uint64_t collectorDropped;
+static uint64_t collectorDroppedWrites;
+static uint32_t collectorDisconnects;
+
+
+static inline void putUint32(uint8_t *to, uint32_t value) {
+
+    to[0] = (uint8_t) value;
+    to[1] = (uint8_t) (value >> 8);
+    to[2] = (uint8_t) (value >> 16);
+    to[3] = (uint8_t) (value >> 24);
+
+}
+
+
+static inline void putUint64(uint8_t *to, uint64_t value) {
+
+    putUint32(to, (uint32_t) value);
+    putUint32(to + 4, (uint32_t) (value >> 32));
+
+}
+
+
+static inline uint32_t readUint32(const uint8_t *from) {
+
+    uint32_t value;
+    memcpy(&value, from, sizeof(value));
+    return value;
+
+}
+
+
+static uint32_t frameChecksum(const uint8_t *data, uint32_t length) {
+
+    uint32_t hash = 2166136261u;
+
+    for (uint32_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+
+    return hash;
+
+}
+
+
+static inline uint8_t* writeLZLength(uint8_t *to, uint32_t length) {
+
+    length -= 15;
+
+    while (length >= 255) {
+        *to++ = 255;
+        length -= 255;
+    }
+
+    *to++ = (uint8_t) length;
+    return to;
+
+}
+
+
+/*
+ * Greedy single probe compressor that writes the LZ4 block format, used when liblz4 is not built in,
+ * so either way a frame is read back with LZ4_decompress_safe.
+ */
+static uint32_t lzCompress(const uint8_t *input, uint32_t length, uint8_t *output, uint32_t capacity, uint32_t *hashTable) {
+
+    const uint8_t *ip = input;
+    const uint8_t *anchor = input;
+    const uint8_t *inputEnd = input + length;
+    uint8_t *op = output;
+    uint8_t *outputEnd = output + capacity;
+
+    memset(hashTable, 0, sizeof(uint32_t) << LZ_HASH_BITS);
+
+    if (length > LZ_MATCH_LIMIT) {
+
+        const uint8_t *matchStartLimit = inputEnd - LZ_MATCH_LIMIT;
+        const uint8_t *matchEndLimit = inputEnd - LZ_LAST_LITERALS;
+
+        while (ip <= matchStartLimit) {
+
+            uint32_t sequence = readUint32(ip);
+            uint32_t hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+            const uint8_t *match = input + hashTable[hash];
+
+            hashTable[hash] = (uint32_t) (ip - input);
+
+            if (match >= ip || ip - match > LZ_MAX_OFFSET || readUint32(match) != sequence) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            const uint8_t *matchEnd = ip + LZ_MIN_MATCH;
+            const uint8_t *reference = match + LZ_MIN_MATCH;
+
+            while (matchEnd < matchEndLimit && *matchEnd == *reference) {
+                matchEnd++;
+                reference++;
+            }
+
+            uint32_t literalLength = (uint32_t) (ip - anchor);
+            uint32_t matchLength = (uint32_t) (matchEnd - ip) - LZ_MIN_MATCH;
+
+            if (op + 1 + (literalLength / 255 + 1) + literalLength + 2 + (matchLength / 255 + 1) > outputEnd) {
+                return 0;
+            }
+
+            uint8_t *token = op++;
+
+            *token = (uint8_t) ((literalLength >= 15 ? 15 : literalLength) << 4);
+            if (literalLength >= 15) {
+                op = writeLZLength(op, literalLength);
+            }
+
+            memcpy(op, anchor, literalLength);
+            op += literalLength;
+
+            uint32_t offset = (uint32_t) (ip - match);
+            *op++ = (uint8_t) offset;
+            *op++ = (uint8_t) (offset >> 8);
+
+            *token |= (uint8_t) (matchLength >= 15 ? 15 : matchLength);
+            if (matchLength >= 15) {
+                op = writeLZLength(op, matchLength);
+            }
+
+            ip = matchEnd;
+            anchor = ip;
+        }
+    }
+
+    uint32_t literalLength = (uint32_t) (inputEnd - anchor);
+
+    if (op + 1 + (literalLength / 255 + 1) + literalLength > outputEnd) {
+        return 0;
+    }
+
+    *op++ = (uint8_t) ((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15) {
+        op = writeLZLength(op, literalLength);
+    }
+
+    memcpy(op, anchor, literalLength);
+    op += literalLength;
+
+    return (uint32_t) (op - output);
+
+}
+
+
+static uint32_t compressBound(uint32_t codec, uint32_t length) {
+
+#ifdef HAVE_ZSTD
+    if (codec == OUTPUT_CODEC_ZSTD) {
+        return (uint32_t) ZSTD_compressBound(length);
+    }
+#endif
+#ifdef HAVE_LZ4
+    if (codec == OUTPUT_CODEC_LZ4) {
+        return (uint32_t) LZ4_compressBound(length);
+    }
+#endif
+
+    return length + (length / 255) + 16;
+
+}
+
+
+static bool initCompressorState(CompressorState *state) {
+
+    state->hashTable = calloc(1, sizeof(uint32_t) << LZ_HASH_BITS);
+    if (state->hashTable <= 0) {
+        error("Unable to allocate the compressor hash table\n")
+        return false;
+    }
+
+#ifdef HAVE_ZSTD
+    state->zstdContext = ZSTD_createCCtx();
+    if (state->zstdContext == NULL) {
+        error("Unable to create a zstd context\n")
+        return false;
+    }
+#endif
+
+    return true;
+
+}
+
+
+static void freeCompressorState(CompressorState *state) {
+
+    free(state->hashTable);
+    state->hashTable = NULL;
+
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(state->zstdContext);
+    state->zstdContext = NULL;
+#endif
+
+}
+
+
+static void compressFrame(OutputFrame *frame, CompressorState *state) {
+
+    uint32_t stored = 0;
+
+    if (outputCodec == OUTPUT_CODEC_ZSTD) {
+#ifdef HAVE_ZSTD
+        size_t returnCode = ZSTD_compressCCtx(state->zstdContext, frame->output, outputCapacity, frame->input, frame->inputLength, OUTPUT_ZSTD_LEVEL);
+        if (!ZSTD_isError(returnCode)) {
+            stored = (uint32_t) returnCode;
+        }
+#endif
+    } else if (outputCodec == OUTPUT_CODEC_LZ4) {
+#ifdef HAVE_LZ4
+        stored = (uint32_t) LZ4_compress_default((const char*) frame->input, (char*) frame->output, (int) frame->inputLength, (int) outputCapacity);
+#else
+        stored = lzCompress(frame->input, frame->inputLength, frame->output, outputCapacity, state->hashTable);
+#endif
+    }
+
+    // Incompressible frames are kept as they are, and written straight from the input
+
+    if (stored == 0 || stored >= frame->inputLength) {
+        frame->codec = OUTPUT_CODEC_STORED;
+        frame->outputLength = frame->inputLength;
+    } else {
+        frame->codec = (uint8_t) outputCodec;
+        frame->outputLength = stored;
+    }
+
+}
+
+
+static void writeFrame(OutputFrame *frame) {
+
+    const uint8_t *payload = frame->codec == OUTPUT_CODEC_STORED ? frame->input : frame->output;
+    uint8_t header[OUTPUT_FRAME_HEADER_LENGTH] = {0};
+
+    memcpy(header, OUTPUT_FRAME_MAGIC, 4);
+    putUint32(header + 4, frame->sequence);
+    header[8] = frame->codec;
+    putUint32(header + 12, frame->inputLength);
+    putUint32(header + 16, frame->outputLength);
+    putUint32(header + 20, frameChecksum(payload, frame->outputLength));
+
+    if (fwrite(header, 1, OUTPUT_FRAME_HEADER_LENGTH, outputFile) != OUTPUT_FRAME_HEADER_LENGTH
+            || fwrite(payload, 1, frame->outputLength, outputFile) != frame->outputLength) {
+        error("Unable to write frame %d (%s)\n", frame->sequence, strerror(errno))
+    }
+
+    fflush(outputFile);
+
+    if (indexEntries == indexCapacity) {
+
+        uint32_t capacity = indexCapacity ? indexCapacity << 1 : OUTPUT_INDEX_ENTRIES;
+        FrameIndexEntry *entries = realloc(frameIndex, sizeof(FrameIndexEntry) * capacity);
+
+        if (entries > 0) {
+            frameIndex = entries;
+            indexCapacity = capacity;
+        }
+    }
+
+    if (indexEntries < indexCapacity) {
+        FrameIndexEntry *entry = &frameIndex[indexEntries++];
+        entry->fileOffset = fileOffset;
+        entry->streamOffset = streamOffset;
+        entry->storedLength = frame->outputLength;
+        entry->inputLength = frame->inputLength;
+    }
+
+    fileOffset += OUTPUT_FRAME_HEADER_LENGTH + frame->outputLength;
+    streamOffset += frame->inputLength;
+
+    bytesIn += frame->inputLength;
+    bytesOut += OUTPUT_FRAME_HEADER_LENGTH + frame->outputLength;
+    framesWritten++;
+
+}
+
+
+static void writeCompletedFrames() {
+
+    // Called with frameMutex held, only one thread writes at a time so frames reach the file in sequence
+
+    if (writingFrames) {
+        return;
+    }
+
+    writingFrames = true;
+
+    while (writeSequence != queuedSequence && frames[writeSequence % OUTPUT_FRAME_SLOTS].state == FRAME_DONE) {
+
+        OutputFrame *frame = &frames[writeSequence % OUTPUT_FRAME_SLOTS];
+
+        pthread_mutex_unlock(&frameMutex);
+        writeFrame(frame);
+        pthread_mutex_lock(&frameMutex);
+
+        frame->state = FRAME_FREE;
+        writeSequence++;
+
+        pthread_cond_broadcast(&frameWritten);
+    }
+
+    writingFrames = false;
+
+}
+
+
+static bool compressNextFrame(CompressorState *state) {
+
+    // Called with frameMutex held
+
+    if (compressSequence == queuedSequence) {
+        return false;
+    }
+
+    OutputFrame *frame = &frames[compressSequence++ % OUTPUT_FRAME_SLOTS];
+
+    pthread_mutex_unlock(&frameMutex);
+    compressFrame(frame, state);
+    pthread_mutex_lock(&frameMutex);
+
+    frame->state = FRAME_DONE;
+
+    writeCompletedFrames();
+
+    return true;
+
+}
+
+
+static void* compressor(void *arg) {
+
+    CompressorState state;
+
+    if (!initCompressorState(&state)) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&frameMutex);
+
+    while (compressorsRunning) {
+
+        if (!compressNextFrame(&state)) {
+            pthread_cond_wait(&frameQueued, &frameMutex);
+        }
+
+    }
+
+    pthread_mutex_unlock(&frameMutex);
+
+    freeCompressorState(&state);
+
+    return NULL;
+
+}
+
+
+static OutputFrame* acquireFrame() {
+
+    pthread_mutex_lock(&frameMutex);
+
+    OutputFrame *frame = &frames[fillSequence % OUTPUT_FRAME_SLOTS];
+
+    while (frame->state != FRAME_FREE) {
+        producerWaits++;
+        pthread_cond_wait(&frameWritten, &frameMutex);
+    }
+
+    frame->state = FRAME_FILLING;
+    frame->sequence = fillSequence;
+    frame->inputLength = 0;
+
+    pthread_mutex_unlock(&frameMutex);
+
+    return frame;
+
+}
+
+
+static void queueFrame() {
+
+    pthread_mutex_lock(&frameMutex);
+
+    currentFrame->state = FRAME_QUEUED;
+    queuedSequence = ++fillSequence;
+    currentFrame = NULL;
+
+    if (numberOfCompressors) {
+        pthread_cond_signal(&frameQueued);
+    } else {
+        compressNextFrame(&producerState);
+    }
+
+    pthread_mutex_unlock(&frameMutex);
+
+}
+
+
+#ifdef __linux
+
+static bool mapWindow(uint32_t index) {
+
+    if (mappedWindows[index]) {
+        return true;
+    }
+
+    off_t offset = (off_t) index << OUTPUT_MAP_WINDOW_BITS;
+
+    int returnCode = posix_fallocate(mappedFile, offset, OUTPUT_MAP_WINDOW_LENGTH);
+    if (returnCode) {
+        error("Unable to extend the trace file to %" PRIu64 " (%s)\n", (uint64_t) offset + OUTPUT_MAP_WINDOW_LENGTH, strerror(returnCode))
+        return false;
+    }
+
+    void *window = mmap(NULL, OUTPUT_MAP_WINDOW_LENGTH, PROT_READ | PROT_WRITE, MAP_SHARED, mappedFile, offset);
+    if (window == MAP_FAILED) {
+        error("Unable to map the trace file at %" PRIu64 " (%s)\n", (uint64_t) offset, strerror(errno))
+        return false;
+    }
+
+    memoryBarrier();
+
+    mappedWindows[index] = window;
+
+    if (index >= mappedWindowCount) {
+        mappedWindowCount = index + 1;
+    }
+
+    return true;
+
+}
+
+
+static uint8_t* lookupWindow(uint32_t index) {
+
+    if (index >= OUTPUT_MAP_WINDOWS) {
+        return NULL;
+    }
+
+    uint8_t *window = mappedWindows[index];
+
+    if (window == NULL) {
+
+        // The window after the one being entered is mapped ahead, so writers rarely get here
+
+        lock(&mapLock, false);
+
+        if (mapWindow(index) && index + 1 < OUTPUT_MAP_WINDOWS) {
+            mapWindow(index + 1);
+        }
+
+        unlock(&mapLock, false);
+
+        window = mappedWindows[index];
+    }
+
+    return window;
+
+}
+
+
+static size_t writeMapped(const void *data, size_t length) {
+
+    uint64_t offset;
+
+    while (true) {
+
+        // While the trace file rolls the writers wait for the next one, once output stops their data is dropped
+
+        if (mappedOffset & OUTPUT_MAP_CLOSED) {
+
+            if (mappedStopped) {
+                __sync_fetch_and_add(&mappedDropped, length);
+                return 0;
+            }
+
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 10000;
+            nanosleep(&ts, NULL);
+            continue;
+        }
+
+        offset = __sync_fetch_and_add(&mappedOffset, length);
+
+        if ((offset & OUTPUT_MAP_CLOSED) == 0) {
+            break;
+        }
+    }
+
+    const uint8_t *from = data;
+    size_t remaining = length;
+
+    while (remaining) {
+
+        uint8_t *window = lookupWindow((uint32_t) (offset >> OUTPUT_MAP_WINDOW_BITS));
+
+        if (window == NULL) {
+            break;
+        }
+
+        uint64_t within = offset & (OUTPUT_MAP_WINDOW_LENGTH - 1);
+        size_t chunk = OUTPUT_MAP_WINDOW_LENGTH - within;
+
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+
+        memcpy(window + within, from, chunk);
+
+        from += chunk;
+        offset += chunk;
+        remaining -= chunk;
+    }
+
+    memoryBarrier();
+
+    // Count the whole reservation even on failure, so closing the file does not wait for it forever
+
+    __sync_fetch_and_add(&mappedCompleted, length);
+
+    return length - remaining;
+
+}
+
+
+static bool openMapped(const char *fileName) {
+
+    mappedFile = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if (mappedFile < 0) {
+        error("Unable to open trace file (%s) (%s)\n", fileName, strerror(errno))
+        mappedStopped = true;
+        return false;
+    }
+
+    lock(&mapLock, false);
+    bool mapped = mapWindow(0) && mapWindow(1);
+    unlock(&mapLock, false);
+
+    if (!mapped) {
+        close(mappedFile);
+        mappedFile = -1;
+        mappedStopped = true;
+        return false;
+    }
+
+    mappedCompleted = 0;
+    mappedStopped = false;
+
+    memoryBarrier();
+
+    mappedOffset = 0;
+
+    return true;
+
+}
+
+
+static void closeMapped() {
+
+    uint64_t end = __sync_fetch_and_or(&mappedOffset, OUTPUT_MAP_CLOSED) & ~OUTPUT_MAP_CLOSED;
+
+    while (mappedCompleted != end) {
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = 10000;
+        nanosleep(&ts, NULL);
+    }
+
+    memoryBarrier();
+
+    lock(&mapLock, false);
+
+    for (uint32_t i = 0; i < mappedWindowCount; i++) {
+        if (mappedWindows[i]) {
+            munmap(mappedWindows[i], OUTPUT_MAP_WINDOW_LENGTH);
+            mappedWindows[i] = NULL;
+        }
+    }
+
+    mappedWindowCount = 0;
+
+    unlock(&mapLock, false);
+
+    if (ftruncate(mappedFile, (off_t) end)) {
+        error("Unable to truncate the trace file to %" PRIu64 " (%s)\n", end, strerror(errno))
+    }
+
+    close(mappedFile);
+    mappedFile = -1;
+
+    bytesIn += end;
+
+}
+
+#endif
+
+
+#ifdef HAVE_IO_URING
+
+static bool setupUring() {
+
+    if (uringRing >= 0) {
+        return true;
+    }
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int ring = (int) syscall(__NR_io_uring_setup, OUTPUT_URING_BUFFERS, &params);
+    if (ring < 0) {
+        warn("io_uring unavailable (%s)\n", strerror(errno))
+        return false;
+    }
+
+    size_t submissionLength = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    size_t completionLength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (completionLength > submissionLength) {
+            submissionLength = completionLength;
+        }
+    }
+
+    uint8_t *submissionRing = mmap(NULL, submissionLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    uint8_t *completionRing = submissionRing;
+
+    if (submissionRing != MAP_FAILED && !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        completionRing = mmap(NULL, completionLength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+    }
+
+    void *entries = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+
+    if (submissionRing == MAP_FAILED || completionRing == MAP_FAILED || entries == MAP_FAILED) {
+        error("Unable to map the io_uring queues (%s)\n", strerror(errno))
+        close(ring);
+        return false;
+    }
+
+    submissionHead = (volatile uint32_t*) (submissionRing + params.sq_off.head);
+    submissionTail = (volatile uint32_t*) (submissionRing + params.sq_off.tail);
+    submissionArray = (uint32_t*) (submissionRing + params.sq_off.array);
+    submissionMask = *(uint32_t*) (submissionRing + params.sq_off.ring_mask);
+    submissionEntries = entries;
+
+    completionHead = (volatile uint32_t*) (completionRing + params.cq_off.head);
+    completionTail = (volatile uint32_t*) (completionRing + params.cq_off.tail);
+    completionMask = *(uint32_t*) (completionRing + params.cq_off.ring_mask);
+    completionEntries = (struct io_uring_cqe*) (completionRing + params.cq_off.cqes);
+
+    if (posix_memalign((void**) &uringBuffers, 4096, (size_t) OUTPUT_URING_BUFFERS * OUTPUT_URING_BUFFER_LENGTH)) {
+        error("Unable to allocate the io_uring buffers\n")
+        close(ring);
+        return false;
+    }
+
+    struct iovec vectors[OUTPUT_URING_BUFFERS];
+
+    for (int i = 0; i < OUTPUT_URING_BUFFERS; i++) {
+        vectors[i].iov_base = uringBuffers + (size_t) i * OUTPUT_URING_BUFFER_LENGTH;
+        vectors[i].iov_len = OUTPUT_URING_BUFFER_LENGTH;
+    }
+
+    // Without registered buffers, for instance under a small RLIMIT_MEMLOCK, plain writes are submitted instead
+
+    uringRegistered = syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS, vectors, OUTPUT_URING_BUFFERS) == 0;
+    if (!uringRegistered) {
+        warn("Unable to register the io_uring buffers (%s)\n", strerror(errno))
+    }
+
+    uringRing = ring;
+
+    return true;
+
+}
+
+
+static void reapCompletions(bool wait) {
+
+    if (wait && *completionHead == *completionTail) {
+        while (syscall(__NR_io_uring_enter, uringRing, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno == EINTR);
+    }
+
+    uint32_t head = *completionHead;
+
+    memoryBarrier();
+
+    while (head != *completionTail) {
+
+        struct io_uring_cqe *completion = &completionEntries[head & completionMask];
+        uint32_t slot = (uint32_t) completion->user_data;
+
+        if (completion->res < 0) {
+            error("io_uring write failed (%s)\n", strerror(-completion->res))
+            uringErrors++;
+        } else if ((uint32_t) completion->res < uringLengths[slot]) {
+
+            // Short write, the rest is written synchronously
+
+            uint8_t *buffer = uringBuffers + (size_t) slot * OUTPUT_URING_BUFFER_LENGTH;
+            uint32_t done = (uint32_t) completion->res;
+
+            if (pwrite(uringFile, buffer + done, uringLengths[slot] - done, (off_t) (uringOffsets[slot] + done)) != (ssize_t) (uringLengths[slot] - done)) {
+                error("Unable to complete a short write (%s)\n", strerror(errno))
+                uringErrors++;
+            }
+        }
+
+        uringBusy[slot] = false;
+        uringInFlight--;
+        head++;
+    }
+
+    memoryBarrier();
+
+    *completionHead = head;
+
+}
+
+
+static void submitSlot(uint32_t slot, uint32_t length) {
+
+    uint32_t tail = *submissionTail;
+    uint32_t index = tail & submissionMask;
+    struct io_uring_sqe *entry = &submissionEntries[index];
+
+    memset(entry, 0, sizeof(struct io_uring_sqe));
+    entry->opcode = uringRegistered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    entry->fd = uringFile;
+    entry->addr = (uint64_t) (uintptr_t) (uringBuffers + (size_t) slot * OUTPUT_URING_BUFFER_LENGTH);
+    entry->len = length;
+    entry->off = uringOffset;
+    entry->buf_index = (uint16_t) slot;
+    entry->user_data = slot;
+
+    submissionArray[index] = index;
+
+    uringBusy[slot] = true;
+    uringLengths[slot] = length;
+    uringOffsets[slot] = uringOffset;
+    uringInFlight++;
+    uringOffset += length;
+
+    memoryBarrier();
+
+    *submissionTail = tail + 1;
+
+    while (syscall(__NR_io_uring_enter, uringRing, 1, 0, 0, NULL, 0) < 0) {
+
+        if (errno == EINTR) {
+            continue;
+        }
+
+        error("io_uring submit failed (%s)\n", strerror(errno))
+        uringErrors++;
+        break;
+    }
+
+    uringWrites++;
+
+}
+
+
+static size_t writeUring(const void *data, size_t length) {
+
+    const uint8_t *from = data;
+    size_t remaining = length;
+
+    reapCompletions(false);
+
+    while (remaining) {
+
+        uint32_t slot = uringNext;
+
+        while (uringBusy[slot]) {
+            uringWaits++;
+            reapCompletions(true);
+        }
+
+        uint32_t chunk = remaining < OUTPUT_URING_BUFFER_LENGTH ? (uint32_t) remaining : OUTPUT_URING_BUFFER_LENGTH;
+
+        memcpy(uringBuffers + (size_t) slot * OUTPUT_URING_BUFFER_LENGTH, from, chunk);
+
+        submitSlot(slot, chunk);
+
+        uringNext = (slot + 1) % OUTPUT_URING_BUFFERS;
+        from += chunk;
+        remaining -= chunk;
+    }
+
+    return length;
+
+}
+
+
+static bool openUring(const char *fileName) {
+
+    uringFile = open(fileName, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    if (uringFile < 0) {
+        error("Unable to open trace file (%s) (%s)\n", fileName, strerror(errno))
+        return false;
+    }
+
+    uringOffset = 0;
+
+    return true;
+
+}
+
+
+static void closeUring() {
+
+    while (uringInFlight) {
+        reapCompletions(true);
+    }
+
+    bytesIn += uringOffset;
+    uringOffset = 0;
+
+    close(uringFile);
+    uringFile = -1;
+
+}
+
+#endif
+
+
+bool configureUringOutput() {
+
+#ifdef HAVE_IO_URING
+    if (framedOutput || mappedOutput) {
+        warn("io=uring is not used with compression or mapTraceFile\n")
+        return false;
+    }
+
+    if (!setupUring()) {
+        warn("Writing the trace file with stdio\n")
+        return false;
+    }
+
+    uringOutput = true;
+
+    warn("io_uring trace file, %d x %d KB buffers%s\n", OUTPUT_URING_BUFFERS, OUTPUT_URING_BUFFER_LENGTH >> 10, uringRegistered ? ", registered" : "")
+
+    return true;
+#else
+    warn("io_uring is only supported on Linux\n")
+    return false;
+#endif
+
+}
+
+
+bool configureMappedOutput() {
+
+#ifdef __linux
+    if (framedOutput) {
+        warn("The trace file is not mapped when it is compressed\n")
+        return false;
+    }
+
+    registerLock("mapLock", &mapLock);
+
+    mappedOutput = true;
+
+    warn("Mapped trace file, %" PRIu64 " MB windows\n", OUTPUT_MAP_WINDOW_LENGTH >> 20)
+
+    return true;
+#else
+    warn("Mapped trace files are only supported on Linux\n")
+    return false;
+#endif
+
+}
+
+
+bool configureOutput(const char *codecName, uint32_t numberOfThreads) {
+
+    if (codecName == NULL || strcasecmp(codecName, "none") == 0) {
+        framedOutput = false;
+        return true;
+    }
+
+    if (strcasecmp(codecName, "zstd") == 0) {
+#ifdef HAVE_ZSTD
+        outputCodec = OUTPUT_CODEC_ZSTD;
+#else
+        warn("Built without zstd, using lz4\n")
+        outputCodec = OUTPUT_CODEC_LZ4;
+#endif
+    } else if (strcasecmp(codecName, "lz4") == 0) {
+        outputCodec = OUTPUT_CODEC_LZ4;
+    } else if (strcasecmp(codecName, "auto") == 0) {
+#ifdef HAVE_ZSTD
+        outputCodec = OUTPUT_CODEC_ZSTD;
+#else
+        outputCodec = OUTPUT_CODEC_LZ4;
+#endif
+    } else {
+        warn("Unknown compression %s, writing uncompressed\n", codecName)
+        return false;
+    }
+
+    outputCapacity = compressBound(outputCodec, OUTPUT_FRAME_LENGTH);
+
+    for (int i = 0; i < OUTPUT_FRAME_SLOTS; i++) {
+
+        frames[i].input = malloc(OUTPUT_FRAME_LENGTH);
+        frames[i].output = malloc(outputCapacity);
+
+        if (frames[i].input <= 0 || frames[i].output <= 0) {
+            error("Unable to allocate output frames\n")
+            return false;
+        }
+    }
+
+    if (!initCompressorState(&producerState)) {
+        return false;
+    }
+
+    if (numberOfThreads > OUTPUT_MAX_COMPRESSION_THREADS) {
+        numberOfThreads = OUTPUT_MAX_COMPRESSION_THREADS;
+    }
+
+    compressorsRunning = true;
+
+    for (uint32_t i = 0; i < numberOfThreads; i++) {
+
+        if (pthread_create(&compressorThreads[numberOfCompressors], NULL, compressor, NULL)) {
+            error("Unable to start a compressor thread (%s)\n", strerror(errno))
+            break;
+        }
+
+        numberOfCompressors++;
+    }
+
+    framedOutput = true;
+
+    warn("Compression: %s, %d compressor threads\n", outputCodec == OUTPUT_CODEC_ZSTD ? "zstd" : "lz4", numberOfCompressors)
+
+    return true;
+
+}
+
+
+#if defined __linux || defined __MVS__
+static void* collectorSender(void *arg) {
+
+    pthread_mutex_lock(&collectorMutex);
+
+    while (collectorRunning) {
+
+        if (collectorSocket < 0 || collectorHead == collectorTail) {
+            pthread_cond_wait(&collectorQueued, &collectorMutex);
+            continue;
+        }
+
+        uint64_t offset = collectorTail % collectorCapacity;
+        uint64_t queued = collectorHead - collectorTail;
+        size_t length = (size_t) (queued < collectorCapacity - offset ? queued : collectorCapacity - offset);
+        int socket = collectorSocket;
+
+        // The producers only copy into the free part of the ring, so the queued part is sent without the mutex
+
+        pthread_mutex_unlock(&collectorMutex);
+
+#ifdef MSG_NOSIGNAL
+        ssize_t sent = send(socket, collectorRing + offset, length, MSG_NOSIGNAL);
+#else
+        ssize_t sent = send(socket, collectorRing + offset, length, 0);
+#endif
+
+        pthread_mutex_lock(&collectorMutex);
+
+        if (sent == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (sent <= 0) {
+            info("Collector disconnected\n")
+            close(collectorSocket);
+            collectorSocket = -1;
+            collectorWaiting = false;
+            collectorActive = false;
+            collectorHead = collectorTail = 0;
+            pthread_cond_broadcast(&collectorDrained);
+            continue;
+        }
+
+        collectorTail += sent;
+        collectorSent += sent;
+
+        pthread_cond_broadcast(&collectorDrained);
+    }
+
+    pthread_mutex_unlock(&collectorMutex);
+
+    return NULL;
+
+}
+#endif
+
+
+bool configureCollector(uint64_t capacity, bool withoutFile) {
+
+#if defined __linux || defined __MVS__
+    collectorRing = malloc(capacity);
+
+    if (collectorRing <= 0) {
+        error("Unable to allocate the collector buffer\n")
+        collectorRing = NULL;
+        return false;
+    }
+
+    collectorCapacity = capacity;
+    collectorOnly = withoutFile;
+    collectorRunning = true;
+
+    if (pthread_create(&collectorThread, NULL, collectorSender, NULL)) {
+        error("Unable to start the collector thread (%s)\n", strerror(errno))
+        collectorRunning = false;
+        free(collectorRing);
+        collectorRing = NULL;
+        return false;
+    }
+
+    warn("Streaming to a collector, %" PRIu64 " KB buffer%s\n", capacity >> 10, withoutFile ? ", no trace file" : "")
+
+    return true;
+#else
+    warn("Streaming to a collector is only supported on Linux and z/OS\n")
+    return false;
+#endif
+
+}
+
+
+bool attachCollector(int socket) {
+
+    if (collectorRing == NULL) {
+        return false;
+    }
+
+    pthread_mutex_lock(&collectorMutex);
+
+    if (collectorSocket >= 0) {
+        pthread_mutex_unlock(&collectorMutex);
+        return false;
+    }
+
+    // Nothing is queued until the next trace file opens, so the collector starts with a header
+
+    collectorSocket = socket;
+    collectorWaiting = true;
+    collectorActive = false;
+    collectorHead = collectorTail = 0;
+
+    pthread_mutex_unlock(&collectorMutex);
+
+    info("Collector attached\n")
+
+    return true;
+
+}
+
+
+bool getCollectorCounters(uint64_t *sent, uint64_t *dropped) {
+
+    if (collectorRing == NULL) {
+        return false;
+    }
+
+    *sent = collectorSent;
+    *dropped = collectorDropped;
+
+    return true;
+
+}
+
+
+static void queueForCollector(const void *data, size_t length, bool droppable) {
+
+#if defined __linux || defined __MVS__
+    pthread_mutex_lock(&collectorMutex);
+
+    if (!collectorActive) {
+        pthread_mutex_unlock(&collectorMutex);
+        return;
+    }
+
+    if (length > collectorCapacity - (collectorHead - collectorTail)) {
+
+        if (droppable) {
+            collectorDropped += length;
+            collectorDroppedWrites++;
+        } else {
+            // Definitions are never dropped, a collector too slow to take them is disconnected instead
+            warn("The collector has fallen too far behind, disconnecting it\n")
+            shutdown(collectorSocket, SHUT_RDWR);
+            collectorActive = false;
+            collectorDisconnects++;
+        }
+
+        pthread_mutex_unlock(&collectorMutex);
+        return;
+    }
+
+    uint64_t offset = collectorHead % collectorCapacity;
+    size_t first = length < collectorCapacity - offset ? length : (size_t) (collectorCapacity - offset);
+
+    memcpy(collectorRing + offset, data, first);
+    memcpy(collectorRing, (const uint8_t*) data + first, length - first);
+
+    collectorHead += length;
+
+    pthread_cond_signal(&collectorQueued);
+    pthread_mutex_unlock(&collectorMutex);
+#endif
+
+}
+
+
+static void beginCollectorFile() {
+
+    pthread_mutex_lock(&collectorMutex);
+
+    if (collectorWaiting) {
+        collectorWaiting = false;
+        collectorActive = true;
+    }
+
+    pthread_mutex_unlock(&collectorMutex);
+
+}
+
+
+static void stopCollector() {
+
+#if defined __linux || defined __MVS__
+    if (!collectorRunning) {
+        return;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += OUTPUT_COLLECTOR_DRAIN_SECONDS;
+
+    pthread_mutex_lock(&collectorMutex);
+
+    // The collector gets a moment to take what is still queued, then it is cut off
+
+    while (collectorSocket >= 0 && collectorHead != collectorTail) {
+        if (pthread_cond_timedwait(&collectorDrained, &collectorMutex, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    collectorRunning = false;
+
+    if (collectorSocket >= 0) {
+        shutdown(collectorSocket, SHUT_RDWR);
+    }
+
+    pthread_cond_broadcast(&collectorQueued);
+    pthread_mutex_unlock(&collectorMutex);
+
+    pthread_join(collectorThread, NULL);
+
+    if (collectorSocket >= 0) {
+        close(collectorSocket);
+        collectorSocket = -1;
+    }
+#endif
+
+}
+
+
+bool openOutput(const char *fileName) {
+
+    if (collectorRing) {
+        beginCollectorFile();
+        if (collectorOnly) {
+            collectorFileOpen = true;
+            return true;
+        }
+    }
+
+#ifdef __linux
+    if (mappedOutput) {
+        return openMapped(fileName);
+    }
+#endif
+#ifdef HAVE_IO_URING
+    if (uringOutput) {
+        return openUring(fileName);
+    }
+#endif
+
+    outputFile = fopen(fileName, "wb");
+
+    if (outputFile <= 0) {
+        error("Unable to open trace file (%s) (%s)\n", fileName, strerror(errno))
+        outputFile = NULL;
+        return false;
+    }
+
+    if (framedOutput) {
+
+        uint8_t header[OUTPUT_FILE_HEADER_LENGTH];
+
+        memcpy(header, OUTPUT_FILE_MAGIC, 4);
+        putUint32(header + 4, OUTPUT_FORMAT_VERSION);
+        putUint32(header + 8, OUTPUT_FRAME_LENGTH);
+        putUint32(header + 12, outputCodec);
+
+        fwrite(header, 1, OUTPUT_FILE_HEADER_LENGTH, outputFile);
+
+        pthread_mutex_lock(&frameMutex);
+        fillSequence = queuedSequence = compressSequence = writeSequence = 0;
+        pthread_mutex_unlock(&frameMutex);
+
+        indexEntries = 0;
+        fileOffset = OUTPUT_FILE_HEADER_LENGTH;
+        streamOffset = 0;
+    }
+
+    return true;
+
+}
+
+
+bool isOutputOpen() {
+
+    if (collectorOnly) {
+        return collectorFileOpen;
+    }
+
+#ifdef HAVE_IO_URING
+    if (uringOutput) {
+        return uringFile >= 0;
+    }
+#endif
+
+    return outputFile != NULL || mappedFile >= 0;
+
+}
+
+
+bool isOutputLockFree() {
+
+    return mappedOutput;
+
+}
+
+
+static size_t writeFile(const void *data, size_t length) {
+
+#ifdef __linux
+    if (mappedOutput) {
+        return writeMapped(data, length);
+    }
+#endif
+#ifdef HAVE_IO_URING
+    if (uringOutput) {
+        return uringFile >= 0 ? writeUring(data, length) : 0;
+    }
+#endif
+
+    if (outputFile == NULL) {
+        return 0;
+    }
+
+    if (!framedOutput) {
+        return fwrite(data, 1, length, outputFile);
+    }
+
+    const uint8_t *from = data;
+    size_t remaining = length;
+
+    while (remaining) {
+
+        if (currentFrame == NULL) {
+            currentFrame = acquireFrame();
+        }
+
+        uint32_t space = OUTPUT_FRAME_LENGTH - currentFrame->inputLength;
+        uint32_t chunk = remaining < space ? (uint32_t) remaining : space;
+
+        memcpy(currentFrame->input + currentFrame->inputLength, from, chunk);
+        currentFrame->inputLength += chunk;
+        from += chunk;
+        remaining -= chunk;
+
+        if (currentFrame->inputLength == OUTPUT_FRAME_LENGTH) {
+            queueFrame();
+        }
+    }
+
+    return length;
+
+}
+
+
+static size_t writeCollected(const void *data, size_t length, bool droppable) {
+
+    if (collectorRing) {
+        queueForCollector(data, length, droppable);
+        if (collectorOnly) {
+            return collectorFileOpen ? length : 0;
+        }
+    }
+
+    return writeFile(data, length);
+
+}
+
+
+size_t writeOutput(const void *data, size_t length) {
+
+    return writeCollected(data, length, false);
+
+}
+
+
+size_t writeEventOutput(const void *data, size_t length) {
+
+    // Event blocks may be dropped from the collector stream, the definitions they refer to are never dropped
+
+    return writeCollected(data, length, true);
+
+}
+
+
+static void writeFrameIndex() {
+
+    uint8_t record[24];
+
+    uint64_t indexOffset = fileOffset;
+
+    memcpy(record, OUTPUT_INDEX_MAGIC, 4);
+    putUint32(record + 4, indexEntries);
+    fwrite(record, 1, 8, outputFile);
+
+    for (uint32_t i = 0; i < indexEntries; i++) {
+        putUint64(record, frameIndex[i].fileOffset);
+        putUint64(record + 8, frameIndex[i].streamOffset);
+        putUint32(record + 16, frameIndex[i].storedLength);
+        putUint32(record + 20, frameIndex[i].inputLength);
+        fwrite(record, 1, 24, outputFile);
+    }
+
+    putUint64(record, indexOffset);
+    memcpy(record + 8, OUTPUT_END_MAGIC, 4);
+    fwrite(record, 1, 12, outputFile);
+
+}
+
+
+void closeOutput() {
+
+    if (collectorOnly) {
+        collectorFileOpen = false;
+        return;
+    }
+
+#ifdef __linux
+    if (mappedOutput) {
+        if (mappedFile >= 0) {
+            closeMapped();
+        }
+        return;
+    }
+#endif
+#ifdef HAVE_IO_URING
+    if (uringOutput) {
+        if (uringFile >= 0) {
+            closeUring();
+        }
+        return;
+    }
+#endif
+
+    if (outputFile == NULL) {
+        return;
+    }
+
+    if (framedOutput) {
+
+        if (currentFrame) {
+            if (currentFrame->inputLength) {
+                queueFrame();
+            } else {
+                pthread_mutex_lock(&frameMutex);
+                currentFrame->state = FRAME_FREE;
+                currentFrame = NULL;
+                pthread_mutex_unlock(&frameMutex);
+            }
+        }
+
+        pthread_mutex_lock(&frameMutex);
+
+        while (writeSequence != queuedSequence) {
+            if (!compressNextFrame(&producerState)) {
+                pthread_cond_wait(&frameWritten, &frameMutex);
+            }
+        }
+
+        pthread_mutex_unlock(&frameMutex);
+
+        writeFrameIndex();
+    }
+
+    fclose(outputFile);
+    outputFile = NULL;
+
+}
+
+
+void stopOutput() {
+
+    stopCollector();
+
+    mappedStopped = true;
+
+    if (numberOfCompressors == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&frameMutex);
+    compressorsRunning = false;
+    pthread_cond_broadcast(&frameQueued);
+    pthread_mutex_unlock(&frameMutex);
+
+    for (uint32_t i = 0; i < numberOfCompressors; i++) {
+        pthread_join(compressorThreads[i], NULL);
+    }
+
+    numberOfCompressors = 0;
+
+}
+
+
+void reportOutputStatistics() {
+
+    if (collectorRing) {
+        info("Collector:\n")
+        info("\tSent Bytes: %" PRIu64 ", Dropped Bytes: %" PRIu64 " in %" PRIu64 " writes, Disconnects: %d\n", collectorSent, collectorDropped, collectorDroppedWrites, collectorDisconnects)
+        info("\n")
+    }
+
+    if (mappedOutput) {
+        uint64_t offset = mappedOffset;
+        info("Output:\n")
+        info("\tMapped Bytes: %" PRIu64 ", Mapped Windows: %d, Dropped Bytes: %" PRIu64 "\n", bytesIn + ((offset & OUTPUT_MAP_CLOSED) ? 0 : offset), mappedWindowCount, mappedDropped)
+        info("\n")
+        return;
+    }
+
+#ifdef HAVE_IO_URING
+    if (uringOutput) {
+        info("Output:\n")
+        info("\tio_uring Bytes: %" PRIu64 ", Writes: %" PRIu64 ", Buffer Waits: %" PRIu64 ", Errors: %" PRIu64 "\n", bytesIn + uringOffset, uringWrites, uringWaits, uringErrors)
+        info("\n")
+        return;
+    }
+#endif
+
+    if (!framedOutput) {
+        return;
+    }
+
+    info("Output:\n")
+    info("\tFrames: %" PRIu64 ", Bytes In: %" PRIu64 ", Bytes Out: %" PRIu64 ", Ratio: %" PRIu64 "%%, Producer Waits: %" PRIu64 "\n",
+            framesWritten, bytesIn, bytesOut, bytesIn ? (bytesOut * 100) / bytesIn : 0, producerWaits)
+    info("\n")
+
+}
+
+
+#ifdef __linux
+
+static uint64_t benchmarkNanos() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+}
+
+
+static int compareLatencies(const void *a, const void *b) {
+
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+
+    return x < y ? -1 : x > y;
+
+}
+
+#endif
+
+
+void benchmarkOutput(const char *directory) {
+
+#ifdef __linux
+    const char *names[] = { "stdio", "mmap", "io_uring" };
+
+    char fileName[512];
+    snprintf(fileName, sizeof(fileName), "%s/benchmark-%d.trc", directory, getpid());
+
+    uint8_t *data = malloc(OUTPUT_BENCHMARK_BUFFER_LENGTH);
+    uint64_t *latencies = calloc(OUTPUT_BENCHMARK_BUFFERS, sizeof(uint64_t));
+
+    if (data <= 0 || latencies <= 0) {
+        error("Unable to allocate the output benchmark buffers\n")
+        free(data);
+        free(latencies);
+        return;
+    }
+
+    for (uint32_t i = 0; i < OUTPUT_BENCHMARK_BUFFER_LENGTH; i++) {
+        data[i] = (uint8_t) (i * 31 + (i >> 12));
+    }
+
+    bool wasFramed = framedOutput;
+    bool wasMapped = mappedOutput;
+    bool wasUring = uringOutput;
+    uint64_t wasBytesIn = bytesIn;
+
+    for (int backend = 0; backend < 3; backend++) {
+
+        framedOutput = false;
+        mappedOutput = backend == 1;
+        uringOutput = backend == 2;
+
+#ifdef HAVE_IO_URING
+        if (uringOutput && !setupUring()) {
+            continue;
+        }
+#else
+        if (uringOutput) {
+            continue;
+        }
+#endif
+
+        if (!openOutput(fileName)) {
+            continue;
+        }
+
+        uint64_t start = benchmarkNanos();
+
+        for (int i = 0; i < OUTPUT_BENCHMARK_BUFFERS; i++) {
+            uint64_t flushStart = benchmarkNanos();
+            writeOutput(data, OUTPUT_BENCHMARK_BUFFER_LENGTH);
+            latencies[i] = benchmarkNanos() - flushStart;
+        }
+
+        closeOutput();
+
+        uint64_t elapsed = benchmarkNanos() - start;
+
+        unlink(fileName);
+
+        uint64_t total = 0;
+
+        for (int i = 0; i < OUTPUT_BENCHMARK_BUFFERS; i++) {
+            total += latencies[i];
+        }
+
+        qsort(latencies, OUTPUT_BENCHMARK_BUFFERS, sizeof(uint64_t), compareLatencies);
+
+        info("Benchmark, %s output: %.1f MB/s, flush mean %.1f us, p99 %.1f us, max %.1f us\n", names[backend],
+                ((double) OUTPUT_BENCHMARK_BUFFERS * OUTPUT_BENCHMARK_BUFFER_LENGTH / (1024 * 1024)) / (elapsed / 1e9),
+                total / 1000.0 / OUTPUT_BENCHMARK_BUFFERS,
+                latencies[(OUTPUT_BENCHMARK_BUFFERS * 99) / 100] / 1000.0,
+                latencies[OUTPUT_BENCHMARK_BUFFERS - 1] / 1000.0)
+    }
+
+    framedOutput = wasFramed;
+    mappedOutput = wasMapped;
+    uringOutput = wasUring;
+    bytesIn = wasBytesIn;
+
+    free(data);
+    free(latencies);
+#else
+    warn("The output benchmark is only available on Linux\n")
+#endif
+
+}
@@ -0,0 +1,70 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define OUTPUT_CODEC_STORED 0
+#define OUTPUT_CODEC_LZ4 1
+#define OUTPUT_CODEC_ZSTD 2
+
+#define OUTPUT_FRAME_LENGTH (1024 * 1024)
+#define OUTPUT_FRAME_SLOTS 8
+#define OUTPUT_COMPRESSION_THREADS 2
+#define OUTPUT_MAX_COMPRESSION_THREADS 16
+#define OUTPUT_ZSTD_LEVEL 3
+#define OUTPUT_INDEX_ENTRIES 1024
+
+#define OUTPUT_FILE_MAGIC "JPRZ"
+#define OUTPUT_FRAME_MAGIC "JFRM"
+#define OUTPUT_INDEX_MAGIC "JIDX"
+#define OUTPUT_END_MAGIC "JEND"
+#define OUTPUT_FORMAT_VERSION 1
+#define OUTPUT_FILE_HEADER_LENGTH 16
+#define OUTPUT_FRAME_HEADER_LENGTH 24
+
+#define OUTPUT_MAP_WINDOW_BITS 26
+#define OUTPUT_MAP_WINDOW_LENGTH ((uint64_t) 1 << OUTPUT_MAP_WINDOW_BITS)
+#define OUTPUT_MAP_WINDOWS 16384
+#define OUTPUT_MAP_CLOSED (1ULL << 63)
+
+#define OUTPUT_URING_BUFFERS 16
+#define OUTPUT_URING_BUFFER_LENGTH (1024 * 1024)
+
+#define OUTPUT_COLLECTOR_BUFFER_LENGTH (16 * 1024 * 1024)
+#define OUTPUT_COLLECTOR_DRAIN_SECONDS 1
+
+#define OUTPUT_BENCHMARK_BUFFER_LENGTH (1024 * 1024)
+#define OUTPUT_BENCHMARK_BUFFERS 256
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+
+bool configureOutput(const char *codecName, uint32_t numberOfThreads);
+bool configureMappedOutput();
+bool configureUringOutput();
+bool configureCollector(uint64_t capacity, bool withoutFile);
+bool attachCollector(int socket);
+bool getCollectorCounters(uint64_t *sent, uint64_t *dropped);
+bool openOutput(const char *fileName);
+bool isOutputOpen();
+bool isOutputLockFree();
+size_t writeOutput(const void *data, size_t length);
+size_t writeEventOutput(const void *data, size_t length);
+void closeOutput();
+void stopOutput();
+void reportOutputStatistics();
+void benchmarkOutput(const char *directory);
+
+
+#endif /* OUTPUT_H_ */
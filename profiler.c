@@ -14,6 +14,8 @@
 #include <pthread.h>
 #include <time.h>
 #include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
 #ifdef __WIN32__
 #include <malloc.h>
 #include <windows.h>
@@ -42,12 +44,17 @@
 #include "profiler.h"
 #include "util.h"
 #include "tables.h"
+#include "filter.h"
+#include "instrument.h"
+#include "intern.h"
+#include "output.h"
 
 
 uint32_t uniqueClassID = 1;
 uint32_t uniqueObjectID = 1;
 uint32_t uniqueThreadID = 1;
 uint32_t traceFileNumber = 0;
+volatile uint32_t traceEpoch = 1;
 
 #ifdef __WIN32__
 //
@@ -56,29 +63,148 @@ uint32_t traceFileNumber = 0;
 //
 #endif
 
-ClassNode* discoverClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jclass class, bool mustLock);
+ClassNode* discoverClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jclass class);
+ClassNode* reserveClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jclass class);
+void resolveClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, ClassNode *classNode);
+void awaitResolver();
+void ensureClassDefined(ClassNode *classNode);
+void startResolver();
+void stopResolver();
+void startRoller();
+void stopRoller();
+void startFlightRecorder();
+void stopFlightRecorder();
+void startTrigger();
+void stopTrigger();
+void switchTraceFile();
 void JNICALL MethodEntry(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method);
 void JNICALL MethodExit(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, jboolean was_popped_by_exception, jvalue return_value);
 ThreadNode* discoverThread(jvmtiEnv *jvmtiInterface, jthread jvmtiThread);
 void MethodEntryInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, Buffer *buffer);
 void MethodExitInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, jboolean was_popped_by_exception, jvalue return_value, Buffer *buffer);
+void JNICALL HookEnter(JNIEnv *jni_env, jclass hookClass, jint hookID);
+void JNICALL HookExit(JNIEnv *jni_env, jclass hookClass, jint hookID);
+void beginBlock(Buffer *buffer);
+bool sealBlock(Buffer *buffer);
+static inline ThreadNode* lookupThreadNode(jvmtiEnv *jvmtiInterface, jthread thread);
+static inline MethodIDNode* lookupMethodIDNode(jvmtiEnv *jvmtiInterface, JNIEnv* jni_env, ThreadNode *threadNode, jmethodID method, bool mayDefer);
+static uint64_t parseByteCount(const char *value);
 
 pid_t pid;
 
 pthread_t controllerThread;
+pthread_t networkThread;
 
 LockStructure fileLock = UNLOCKED;
 LockStructure classLock = UNLOCKED;
 
 jvmtiEnv *globalJVMTIInterface;
 static JavaVM *jvm;
-static FILE *traceFile;
 static bool tagObjects;
+static bool compactFormat;
+static bool internStrings;
+static ClassFilter *classFilter = NULL;
+static ClassFilter **retiredFilters = NULL;
+static uint32_t retiredFilterCount = 0;
 static char *traceDirectory;
+static uint32_t controlPort = 0;
+static char *controlAddress = CONTROL_ADDRESS;
+static bool streamTrace = false;
 Buffer *globalBuffer;
 
+static bool asyncWriter;
+static uint32_t writerLatency = WRITER_LATENCY_MS;
+static volatile bool writerRunning = false;
+static volatile bool writerNudged = false;
+pthread_t writerThread;
+LockStructure writerLock = UNLOCKED;
+
+static uint32_t profilingMode = MODE_TRACE;
+static uint64_t minDuration = 0;
+static uint64_t minDurationTicks = 0;
+static uint32_t sampleInterval = SAMPLE_INTERVAL_MS;
+static uint32_t sampleDepth = SAMPLE_MAX_DEPTH;
+static volatile bool samplerRunning = false;
+static ThreadNode *samplerNode = NULL;
+static MethodIDNode **sampleFrames = NULL;
+static Buffer *samplerBuffer = NULL;
+static uint32_t sampleCapacity = 0;
+static uint64_t samplesTaken = 0;
+pthread_t samplerThread;
+
+static uint64_t rollSize = 0;
+static uint32_t rollInterval = 0;
+static uint32_t keepFiles = 0;
+static char **keptFiles = NULL;
+static uint32_t keptFileCount = 0;
+static volatile uint64_t traceFileBytes = 0;
+static volatile time_t traceFileOpened = 0;
+static volatile bool rollRequested = false;
+static volatile bool rollerRunning = false;
+static volatile bool carryPending = false;
+static volatile uint32_t carryEpoch = 0;
+static Buffer *carryBuffer = NULL;
+static ClassNode *carryThreadClass = NULL;
+static volatile uint32_t flushesInProgress = 0;
+static uint32_t automaticRolls = 0;
+pthread_t rollerThread;
+
+static char currentTraceFile[512];
+static volatile uint64_t bytesFlushed = 0;
+static volatile uint64_t discoveryTicks = 0;
+static volatile uint64_t retiredEvents = 0;
+
+static uint64_t flightMemory = FLIGHT_MEMORY;
+static volatile uint64_t flightAllocated = 0;
+static volatile bool flightDumping = false;
+static volatile uint32_t flightPublishes = 0;
+static volatile uint32_t flightOverwrites = 0;
+static volatile uint32_t flightDiscards = 0;
+static volatile uint32_t flightEndings = 1;
+static volatile uint32_t flightReclaims = 0;
+static volatile bool flightStarved = false;
+static volatile sig_atomic_t flightDumpRequested = 0;
+static volatile bool flightRunning = false;
+static uint32_t flightDumps = 0;
+pthread_t flightThread;
+
+static char *triggerClass = NULL;
+static char *triggerMethod = NULL;
+static char *triggerSignature = NULL;
+static uint32_t triggerDuration = 0;
+static uint32_t triggerCount = 0;
+static bool triggerAllThreads = false;
+static volatile bool triggerOpen = false;
+static volatile bool triggerExpired = false;
+static volatile uint64_t triggerDeadline = 0;
+static uint32_t triggerStarted = 0;
+static uint32_t triggerFinished = 0;
+static jthread triggerThread = NULL;
+static uint32_t triggerWindows = 0;
+static volatile bool triggerRunning = false;
+pthread_t triggerWatcherThread;
+LockStructure triggerLock = UNLOCKED;
+
+static bool asyncResolver;
+
+static volatile uint32_t callTreeGeneration = 0;
+static LockStructure callTreeLock = UNLOCKED;
+static volatile bool resolverRunning = false;
+static volatile bool resolverNudged = false;
+static volatile uint32_t resolverQueued = 0;
+static volatile uint32_t resolverCompleted = 0;
+static ClassNode *pendingHead = NULL;
+static ClassNode *pendingTail = NULL;
+LockStructure resolverLock = UNLOCKED;
+LockStructure resolvingLock = UNLOCKED;
+pthread_t resolverThread;
+
+static volatile uint32_t threadEpoch = 1;
+static THREAD_LOCAL ThreadNode *cachedThreadNode = NULL;
+static THREAD_LOCAL uint32_t cachedThreadEpoch = 0;
+
 char *headerBinary = "b";
-uint32_t headerVersion = 8;
+uint32_t headerVersion = JINSIGHT_HEADER_VERSION;
 #ifdef __WIN32__
 uint32_t headerPlatform = 11;
 #elif __MVS__
@@ -91,6 +217,7 @@ uint32_t headerNumberOfEvents = 0;
 uint32_t headerMaxThreads = 1024;
 uint32_t headerMaxClasses = 16384;
 uint32_t headerTicksPerMicrosecond = 2400;
+uint64_t headerTicksPerSecond = 2400000000ULL;
 uint64_t headerStartTicks = 0;
 uint32_t headerVMStartTime = 0;
 uint32_t headerConnectionStartTime = 0;
@@ -255,1395 +382,4066 @@ Buffer *allocateBuffer(uint32_t bufferLength, bool shared) {
 }
 
 
-#if defined __linux || defined __MVS__
-void networkCleanup(void *arg) {
-    int *serverSocket = (int*) arg;
-    if(serverSocket) {
-        if(jvm) {
-            (*jvm)->DetachCurrentThread(jvm);
+Buffer *allocateRingBuffer(uint32_t chunkLength, uint32_t numberOfChunks, uint32_t maximumChunks) {
+
+    Buffer *buffer = calloc(1, sizeof(Buffer));
+    if (buffer <= 0) {
+        error("Unable to allocate buffer\n")
+        exit(-1);
+    }
+
+    ChunkRing *ring = calloc(1, sizeof(ChunkRing));
+    if (ring <= 0) {
+        error("Unable to allocate chunk ring\n")
+        exit(-1);
+    }
+
+    ring->chunks = calloc(maximumChunks, sizeof(Chunk));
+    if (ring->chunks <= 0) {
+        error("Unable to allocate chunks\n")
+        exit(-1);
+    }
+
+    for (int i = 0; i < numberOfChunks; i++) {
+        ring->chunks[i].data = calloc(1, chunkLength);
+        if (ring->chunks[i].data <= 0) {
+            error("Unable to allocate chunk\n")
+            exit(-1);
         }
-        close(*serverSocket);
-        *serverSocket=0;
     }
 
+    ring->numberOfChunks = numberOfChunks;
+    ring->chunkLength = chunkLength;
+
+    buffer->buffer = ring->chunks[0].data;
+    buffer->bufferOffset = 0;
+    buffer->bufferLength = chunkLength;
+    buffer->shared = false;
+    buffer->ring = ring;
+    return buffer;
+
 }
-#endif
 
 
-#if defined __linux || defined __MVS__
-void* networkController(void *arg) {
+void freeBuffer(Buffer *buffer) {
 
-    debug("Network Controller Thread\n")
+    if (buffer->ring) {
+        for (int i = 0; i < buffer->ring->numberOfChunks; i++) {
+            free(buffer->ring->chunks[i].data);
+        }
+        free(buffer->ring->chunks);
+        free(buffer->ring);
+    } else if (buffer->buffer) {
+        free(buffer->buffer);
+    }
 
-    int previousState = 0;
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &previousState);
+    free(buffer);
 
-    JavaVM *vm = (JavaVM*) arg;
+}
 
-    JNIEnv *JNIInterface;
 
-    jint jniReturnCode;
-    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
-    if (jniReturnCode != JNI_OK) {
-        error("Unable to attach to the JVM, network controller unavailable (%d)\n", jniReturnCode)
-        return NULL;
-    }
+/*
+ * Control commands arrive as frames on the control channel: a 0x7E marker, a little endian u16 length, then that many
+ * bytes of text, the command name followed by space separated key=value arguments. A single byte 1 to 4 is still read
+ * as the start, stop, roll and dump commands. Every command is answered with a frame of the same shape, its text an
+ * "ok <command>" or "error <reason>" line followed by the counters, one key=value per line.
+ */
 
-    jvmtiError returnCode;
-    jthread *currentThread = NULL;
+static void appendReply(char *reply, uint32_t replyLength, const char *format, ...) {
 
-    returnCode = (*globalJVMTIInterface)->GetCurrentThread(globalJVMTIInterface, currentThread);
-    if (jniReturnCode != JNI_OK) {
-        error("Error getting the current thread, network controller unavailable (%d)\n", returnCode)
-        return NULL;
+    size_t used = strlen(reply);
+
+    if (used + 1 >= replyLength) {
+        return;
     }
 
-    ThreadNode *threadNode = calloc(1, sizeof(ThreadNode));
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(reply + used, replyLength - used, format, arguments);
+    va_end(arguments);
 
-    threadNode->threadID = -1;
+}
 
-    returnCode = (*globalJVMTIInterface)->SetThreadLocalStorage(globalJVMTIInterface, *currentThread, threadNode);
-    if (jniReturnCode != JNI_OK) {
-        error("Error setting thread local storage, network controller unavailable (%d)\n", returnCode)
-        return NULL;
+
+static const char* getModeName() {
+
+    switch (profilingMode) {
+        case MODE_SAMPLE:
+            return "sample";
+        case MODE_INSTRUMENT:
+            return "instrument";
+        case MODE_CCT:
+            return "cct";
+        case MODE_FLIGHT:
+            return "flight";
+        default:
+            return "trace";
     }
 
-    int serverSocket;
-    int clientSocket;
+}
 
-    struct sockaddr_in serverAddress;
-    struct sockaddr_in clientAddress;
 
-    int ENABLE = 1;
-    int BUFFER_SIZE = 16;
+static void countThreadEvents(ThreadNode *threadNode, void *arg) {
 
-    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
+    ControlCounters *counters = (ControlCounters*) arg;
 
-    if (serverSocket == -1) {
-        error("Error creating server socket, network controller unavailable (%s)\n", strerror(errno))
-        return NULL;
+    if (threadNode->threadBuffer) {
+        counters->events += threadNode->threadBuffer->events;
     }
 
-    returnCode = setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char *) &ENABLE, sizeof(int));
+    counters->cacheHits += threadNode->cacheHits;
+    counters->cacheMisses += threadNode->cacheMisses;
+    counters->threads++;
 
-    if (returnCode == -1) {
-        error("Error creating server socket, network controller unavailable (%s)\n", strerror(errno))
-        return NULL;
-    }
+}
 
-    serverAddress.sin_family = AF_INET;
-    serverAddress.sin_port = htons(12345);
-    serverAddress.sin_addr.s_addr = INADDR_ANY;
-    memset(&(serverAddress.sin_zero), 0, 8);
 
-    debug("Binding Socket\n");
+static void retireThreadEvents(ThreadNode *threadNode, void *arg) {
 
-    returnCode = bind(serverSocket, (struct sockaddr*) &serverAddress, sizeof(serverAddress));
-    if (returnCode == -1) {
-        error("Error binding server socket, network controller unavailable (%s)\n", strerror(errno))
-        return NULL;
+    if (threadNode->threadBuffer) {
+        __sync_fetch_and_add(&retiredEvents, threadNode->threadBuffer->events);
     }
 
-    debug("Listening on Socket\n")
+}
 
-    returnCode = listen(serverSocket, 2);
 
-    if (returnCode == -1) {
-        error("Error listening on server socket, network controller unavailable (%s)\n", strerror(errno))
-        return NULL;
-    }
+static void appendCounters(char *reply, uint32_t replyLength) {
 
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &previousState);
+    ControlCounters counters;
+    memset(&counters, 0, sizeof(ControlCounters));
 
-    pthread_cleanup_push((networkCleanup), (void*) &serverSocket);
+    // Thread nodes and the global buffer are only released by a roll, which holds the writer lock
 
-    while (agentLoaded) {
+    lock(&writerLock, false);
 
-        uint32_t structSize = sizeof(struct sockaddr_in);
+    forEachThreadNode(countThreadEvents, &counters);
 
-        debug("Acceping Connection\n");
+    counters.events += retiredEvents + globalBuffer->events;
 
-        clientSocket = accept(serverSocket, (struct sockaddr*) &clientAddress, &structSize);
+    if (samplerBuffer) {
+        counters.events += samplerBuffer->events;
+    }
 
-        if (clientSocket != -1) {
+    unlock(&writerLock, false);
 
-            char *buffer = calloc(1, BUFFER_SIZE);
-            ssize_t bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE, 0);
-            if (bytesReceived != -1) {
+    uint64_t lookups = counters.cacheHits + counters.cacheMisses;
 
-                int command = (int) buffer[0];
+    uint64_t collectorSent = 0;
+    uint64_t collectorDropped = 0;
+    bool collecting = getCollectorCounters(&collectorSent, &collectorDropped);
 
-                switch (command) {
+    appendReply(reply, replyLength, "profiling=%d\n", isLocked(&profiling) ? 1 : 0);
+    appendReply(reply, replyLength, "mode=%s\n", getModeName());
+    appendReply(reply, replyLength, "traceFile=%s\n", currentTraceFile);
+    appendReply(reply, replyLength, "events=%" PRIu64 "\n", counters.events);
+    appendReply(reply, replyLength, "bytesFlushed=%" PRIu64 "\n", bytesFlushed);
+    appendReply(reply, replyLength, "cacheHits=%" PRIu64 "\n", counters.cacheHits);
+    appendReply(reply, replyLength, "cacheMisses=%" PRIu64 "\n", counters.cacheMisses);
+    appendReply(reply, replyLength, "cacheHitRate=%.4f\n", lookups ? (double) counters.cacheHits / lookups : 0.0);
+    appendReply(reply, replyLength, "classes=%d\n", uniqueClassID - 1);
+    appendReply(reply, replyLength, "discoveryMicros=%" PRIu64 "\n", (uint64_t) (discoveryTicks * 1000000.0 / headerTicksPerSecond));
+    appendReply(reply, replyLength, "threads=%d\n", counters.threads);
+    appendReply(reply, replyLength, "sampleInterval=%d\n", sampleInterval);
+    appendReply(reply, replyLength, "sampleDepth=%d\n", sampleDepth);
+    appendReply(reply, replyLength, "rollSize=%" PRIu64 "\n", rollSize);
+    appendReply(reply, replyLength, "rollInterval=%d\n", rollInterval);
+    appendReply(reply, replyLength, "rolls=%d\n", automaticRolls);
 
-                    case 1:
-                        startProfiling(globalJVMTIInterface, JNIInterface);
-                        break;
-                    case 2:
-                        stopProfiling(globalJVMTIInterface, JNIInterface);
-                        break;
-                    case 3:
-                        rollTraceFile(globalJVMTIInterface, JNIInterface);
-                        break;
-                    default:
-                        break;
-                }
+    if (collecting) {
+        appendReply(reply, replyLength, "collectorSent=%" PRIu64 "\n", collectorSent);
+        appendReply(reply, replyLength, "collectorDropped=%" PRIu64 "\n", collectorDropped);
+    }
 
-                char message[1];
-                message[0] = 9;
-                send(clientSocket, message, 1, 0);
-            } else {
-                error("Error receiving data from the client (%s)\n", strerror(errno))
-            }
+}
 
-            } else {
-                error("Error accepting connection from the client (%s)\n", strerror(errno))
-            }
 
-            pthread_testcancel();
+static const char* getCommandArgument(char **keys, char **values, uint32_t numberOfArguments, const char *key) {
+
+    for (uint32_t i = 0; i < numberOfArguments; i++) {
+        if (strcmp(keys[i], key) == 0) {
+            return values[i];
         }
-        pthread_cleanup_pop(1);
-        return 0;
     }
-#endif
 
+    return NULL;
 
-#ifdef __WIN32__
-void eventCleanup(void *arg) {
+}
 
-    EventCleanupStruct *eventCleanupStruct = arg;
 
-    if (eventCleanupStruct) {
+// A replaced filter may still be read by a thread discovering a class, so it is only freed at shutdown
 
-        (*jvm)->DetachCurrentThread(jvm);
-        CloseHandle(eventCleanupStruct->startEvent);
-        CloseHandle(eventCleanupStruct->stopEvent);
-        CloseHandle(eventCleanupStruct->rollEvent);
+static void retireClassFilter(ClassFilter *filter) {
+
+    if (filter == NULL) {
+        return;
     }
 
-}
-#endif
+    lock(&classLock, false);
 
+    ClassFilter **filters = realloc(retiredFilters, (retiredFilterCount + 1) * sizeof(ClassFilter*));
 
-#if defined __linux || defined __MVS__
-void pipeCleanup(void *arg) {
+    if (filters <= 0) {
+        error("Unable to retire the class filter\n")
+    } else {
+        retiredFilters = filters;
+        retiredFilters[retiredFilterCount++] = filter;
+    }
 
-    if(arg) {
+    unlock(&classLock, false);
 
-        int *pipe = (int*) arg;
+}
 
-        if(*pipe) {
-            close(*pipe);
-        }
 
-        char *pipeName = calloc(1, 128);
-        sprintf((char*) pipeName, "/tmp/prfctl-%d", pid);
-        unlink(pipeName);
+static void freeRetiredFilters() {
 
+    for (uint32_t i = 0; i < retiredFilterCount; i++) {
+        freeClassFilter(retiredFilters[i]);
     }
 
+    free(retiredFilters);
+    retiredFilters = NULL;
+    retiredFilterCount = 0;
+
 }
-#endif
 
 
-#if defined __linux || defined __MVS__
-void* pipeController(void *arg) {
+static void refilterClassNode(ClassNode *classNode, void *arg) {
 
-    info("Starting the Controller Thread\n")
+    classNode->filtered = !isClassIncluded(classFilter, classNode->profilerName);
 
-    int previousState = 0;
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &previousState);
+    if (classNode->methodIDNodes) {
+        for (uint32_t i = 0; i < classNode->numberOfMethods; i++) {
+            classNode->methodIDNodes[i].filtered = classNode->filtered;
+        }
+    }
 
-    JavaVM *vm = (JavaVM*) arg;
+}
 
-    JNIEnv *JNIInterface;
 
-    jint jniReturnCode;
-    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
-    if (jniReturnCode != JNI_OK) {
-        error("Unable to attach to the JVM, local controller unavailable (%d)\n", jniReturnCode)
-        return NULL;
-    }
+void executeCommand(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, char *command, char *reply, uint32_t replyLength) {
 
-    jvmtiError returnCode;
-    jthread currentThread = calloc(1, sizeof(jthread));;
+    char *keys[CONTROL_MAX_ARGUMENTS];
+    char *values[CONTROL_MAX_ARGUMENTS];
+    uint32_t numberOfArguments = 0;
 
-    returnCode = (*globalJVMTIInterface)->GetCurrentThread(globalJVMTIInterface, &currentThread);
-    if (jniReturnCode != JNI_OK) {
-        error("Error getting the current thread, local controller unavailable (%d)\n", returnCode)
-        return NULL;
+    char *position = NULL;
+    char *name = strtok_r(command, " \t\r\n", &position);
+
+    reply[0] = 0;
+
+    if (name == NULL) {
+        appendReply(reply, replyLength, "error empty command\n");
+        return;
     }
 
+    for (char *argument = strtok_r(NULL, " \t\r\n", &position); argument; argument = strtok_r(NULL, " \t\r\n", &position)) {
 
-    ThreadNode *threadNode = calloc(1, sizeof(ThreadNode));
+        char *separator = strchr(argument, '=');
 
-    threadNode->threadID = -1;
+        if (separator == NULL || numberOfArguments == CONTROL_MAX_ARGUMENTS) {
+            appendReply(reply, replyLength, "error bad argument %s\n", argument);
+            return;
+        }
+
+        *separator = 0;
+        keys[numberOfArguments] = argument;
+        values[numberOfArguments++] = separator + 1;
 
-    returnCode = (*globalJVMTIInterface)->SetThreadLocalStorage(globalJVMTIInterface, currentThread, threadNode);
-    if (jniReturnCode != JNI_OK) {
-        error("Error setting thread local storage, local controller unavailable (%d)\n", returnCode)
-        return NULL;
     }
 
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &previousState);
+    info("Control command %s\n", name)
 
-    char *pipeName = calloc(1, 128);
-    sprintf((char*) pipeName, "/tmp/prfctl-%d", pid);
+    if (strcmp(name, "start") == 0) {
 
-    int *pipe = calloc(1, sizeof(int));
+        startProfiling(jvmtiInterface, jni_env);
 
-    mkfifo(pipeName, 0666);
+    } else if (strcmp(name, "stop") == 0) {
 
-    pthread_cleanup_push((pipeCleanup), (void*) pipe);
+        stopProfiling(jvmtiInterface, jni_env);
 
-            while(agentLoaded) {
+    } else if (strcmp(name, "roll") == 0) {
 
-                *pipe = open(pipeName, O_RDONLY);
+        if (profilingMode == MODE_FLIGHT) {
+            appendReply(reply, replyLength, "error there is no trace file to roll in flight mode\n");
+            return;
+        }
 
-                char buf[1];
-                buf[0]=0;
+        rollTraceFile(jvmtiInterface, jni_env);
 
-                uint64_t ret = read(*pipe, &buf, 1);
+    } else if (strcmp(name, "dump") == 0) {
 
-                if(ret==1) {
-                    uint32_t command = (uint32_t)buf[0];
+        if (profilingMode != MODE_FLIGHT) {
+            appendReply(reply, replyLength, "error dump needs mode=flight\n");
+            return;
+        }
 
-                    debug("Recieved command %d\n", command)
+        dumpFlightRecorder();
 
-                    switch (command) {
-                        case 1:
-                            startProfiling(globalJVMTIInterface, JNIInterface);
-                            break;
-                        case 2:
-                            stopProfiling(globalJVMTIInterface, JNIInterface);
-                            break;
-                        case 3:
-                            rollTraceFile(globalJVMTIInterface, JNIInterface);
-                            break;
-                        default:
-                            break;
-                    }
-                }
-                close(*pipe);
-                *pipe = 0;
-                pthread_testcancel();
-            }
+    } else if (strcmp(name, "stats") == 0) {
 
-    pthread_cleanup_pop(1);
-    return 0;
-}
-#endif
+        reportStatistics();
 
+    } else if (strcmp(name, "filter") == 0) {
 
-#ifdef __WIN32__
-void* eventController(void *arg) {
+        if (profilingMode == MODE_INSTRUMENT) {
+            appendReply(reply, replyLength, "error instrumented classes are filtered when they are loaded\n");
+            return;
+        }
 
-    debug("Starting the Controller Thread\n")
+        if (triggerOpen) {
+            appendReply(reply, replyLength, "error a trigger window is open\n");
+            return;
+        }
 
-    int previousState = 0;
-    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &previousState);
+        // Entries and exits must pair up within a burst, so the filter changes between two bursts
 
-    JavaVM *vm = (JavaVM*) arg;
+        bool wasProfiling = isLocked(&profiling);
 
-    JNIEnv *JNIInterface;
+        if (wasProfiling) {
+            stopProfiling(jvmtiInterface, jni_env);
+        }
 
-    jint jniReturnCode;
-    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
-    if (jniReturnCode != JNI_OK) {
-        error("Unable to attach to the JVM, network controller unavailable (%d)\n", (uint32_t )jniReturnCode)
-        return NULL;
-    }
+        ClassFilter *previousFilter = classFilter;
 
-    jvmtiError returnCode;
-    jthread currentThread;
+        classFilter = createClassFilter(getCommandArgument(keys, values, numberOfArguments, "include"),
+                                        getCommandArgument(keys, values, numberOfArguments, "exclude"));
 
-    returnCode = (*globalJVMTIInterface)->GetCurrentThread(globalJVMTIInterface, &currentThread);
-    if (jniReturnCode != JNI_OK) {
-        error("Error getting the current thread, network controller unavailable (%d)\n", returnCode)
-        return NULL;
-    }
+        retireClassFilter(previousFilter);
 
-    ThreadNode *threadNode = calloc(1, sizeof(ThreadNode));
-    if (threadNode <= 0) {
-        error("Unable to allocate ThreadNode\n")
-        exit(-1);
-    }
+        forEachClassNode(refilterClassNode, NULL);
 
-    threadNode->threadID = -1;
+        if (wasProfiling) {
+            startProfiling(jvmtiInterface, jni_env);
+        }
 
-    returnCode = (*globalJVMTIInterface)->SetThreadLocalStorage(globalJVMTIInterface, currentThread, threadNode);
-    if (jniReturnCode != JNI_OK) {
-        error("Error setting thread local storage, network controller unavailable (%d)\n", returnCode)
-        return NULL;
-    }
+    } else if (strcmp(name, "sample") == 0) {
 
-    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &previousState);
+        if (profilingMode != MODE_SAMPLE) {
+            appendReply(reply, replyLength, "error sample needs mode=sample\n");
+            return;
+        }
 
-    char *startEventName = calloc(1, 128);
-    char *stopEventName = calloc(1, 128);
-    char *rollEventName = calloc(1, 128);
-    if (startEventName <= 0 || stopEventName <= 0|| rollEventName <= 0) {
-        error("Unable to allocate EventNames\n")
-        exit(-1);
-    }
+        const char *interval = getCommandArgument(keys, values, numberOfArguments, "interval");
+        const char *depth = getCommandArgument(keys, values, numberOfArguments, "depth");
 
-    sprintf((char*) startEventName, "Global\\profilerStart-%d", (uint32_t) pid);
-    sprintf((char*) stopEventName, "Global\\profilerStop-%d", (uint32_t) pid);
-    sprintf((char*) rollEventName, "Global\\profilerRoll-%d", (uint32_t) pid);
+        uint32_t newInterval = interval ? (uint32_t) strtoul(interval, NULL, 10) : sampleInterval;
+        uint32_t newDepth = depth ? (uint32_t) strtoul(depth, NULL, 10) : sampleDepth;
 
-    debug("%s\n", startEventName)
-    debug("%s\n", stopEventName)
-    debug("%s\n", rollEventName)
+        // The frames array is sized once, when the sampler starts
 
-    HANDLE startEvent = CreateEvent(NULL, TRUE, FALSE, startEventName);
+        uint32_t maximumDepth = sampleFrames ? sampleCapacity : UINT16_MAX;
 
-    HANDLE stopEvent = CreateEvent(NULL, TRUE, FALSE, stopEventName);
+        if (newInterval == 0 || newDepth == 0 || newDepth > maximumDepth) {
+            appendReply(reply, replyLength, "error interval must be at least 1 and depth between 1 and %d\n", maximumDepth);
+            return;
+        }
 
-    HANDLE rollEvent = CreateEvent(NULL, TRUE, FALSE, rollEventName);
+        sampleInterval = newInterval;
+        sampleDepth = newDepth;
 
-    EventCleanupStruct eventCleanupStruct;
+    } else if (strcmp(name, "rollPolicy") == 0) {
 
-    eventCleanupStruct.startEvent = startEvent;
-    eventCleanupStruct.stopEvent = stopEvent;
-    eventCleanupStruct.rollEvent = rollEvent;
+        if (profilingMode == MODE_FLIGHT) {
+            appendReply(reply, replyLength, "error flight mode does not roll\n");
+            return;
+        }
 
-    pthread_cleanup_push((eventCleanup), (void*) &eventCleanupStruct);
+        const char *size = getCommandArgument(keys, values, numberOfArguments, "size");
+        const char *interval = getCommandArgument(keys, values, numberOfArguments, "interval");
+        const char *directory = getCommandArgument(keys, values, numberOfArguments, "directory");
 
-//		bool profiling = false;
+        if (size) {
+            rollSize = parseByteCount(size);
+        }
 
-        HANDLE events[3] = {startEvent, stopEvent, rollEvent};
+        if (interval) {
+            rollInterval = (uint32_t) strtoul(interval, NULL, 10);
+        }
 
-        while (1) {
+        if (directory && *directory) {
 
-            DWORD dwEvent;
+            // The roller names the next file under the file lock, so the old directory is freed once it is swapped
 
-            dwEvent  = WaitForMultipleObjects(3, events, FALSE, INFINITE);
+            char *newDirectory = strdup(directory);
+            char *oldDirectory;
 
-            switch (dwEvent)
-            {
-                case WAIT_OBJECT_0 + 0:
-                    ResetEvent(startEvent);
-                    startProfiling(globalJVMTIInterface, JNIInterface);
-                    break;
-
-                case WAIT_OBJECT_0 + 1:
-                    ResetEvent(stopEvent);
-                    stopProfiling(globalJVMTIInterface, JNIInterface);
-                    break;
-
-                case WAIT_OBJECT_0 + 2:
-                    ResetEvent(rollEvent);
-                    rollTraceFile(globalJVMTIInterface, JNIInterface);
-                    break;
+            lock(&fileLock, false);
+            oldDirectory = traceDirectory;
+            traceDirectory = newDirectory;
+            unlock(&fileLock, false);
 
-                default:
-                    error("Wait error: %ld\n", GetLastError())
-            }
+            free(oldDirectory);
 
+        }
 
-            pthread_testcancel();
+        if ((rollSize || rollInterval) && !rollerRunning) {
+            startRoller();
         }
 
-    pthread_cleanup_pop(1);
-}
-#endif
+    } else if (strcmp(name, "status") != 0) {
 
-void getAllThreads(jvmtiEnv *jvmtiInterface, jint *numberOfThreads, jthread **threads) {
-    jvmtiError returnCode;
+        appendReply(reply, replyLength, "error unknown command %s\n", name);
+        return;
 
-    returnCode = (*jvmtiInterface)->GetAllThreads(jvmtiInterface, numberOfThreads, threads);
-    if (returnCode != JNI_OK) {
-        error("Error in GetAllThreads (%d)\n", returnCode)
     }
-}
 
+    appendReply(reply, replyLength, "ok %s\n", name);
+    appendCounters(reply, replyLength);
 
-void reportThreadStatistics(jvmtiEnv *jvmtiInterface, jint numberOfThreads, jthread *threads) {
+}
 
-    uint64_t cacheHits = 0;
-    uint64_t cacheMisses = 0;
 
-    for (int i = 0; i < numberOfThreads; i++) {
+#if defined __linux || defined __MVS__
+static bool readFully(int descriptor, void *data, size_t length) {
 
-        jvmtiError returnCode;
-        ThreadNode *threadNode;
+    uint8_t *position = (uint8_t*) data;
 
-        returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, threads[i], (void **) &threadNode);
-        if (returnCode != JNI_OK) {
-            warn("Unable to GetThreadLocalStorage (%d)\n", returnCode)
-        }
+    while (length) {
 
-        if (threadNode) {
+        ssize_t bytesRead = read(descriptor, position, length);
 
-            cacheHits += threadNode->cacheHits;
-            cacheMisses += threadNode->cacheMisses;
+        if (bytesRead == -1 && errno == EINTR) {
+            continue;
+        }
 
+        if (bytesRead <= 0) {
+            return false;
         }
 
+        position += bytesRead;
+        length -= bytesRead;
     }
 
-    info("Threads: %d, Cache Hits: %" PRIu64 ", Cache Misses: %" PRIu64 "\n", (uint32_t )numberOfThreads, cacheHits, cacheMisses)
+    return true;
 
 }
 
 
-void openTraceFile(const char *fileName) {
+static bool writeFully(int descriptor, const void *data, size_t length) {
 
-    traceFile = fopen(fileName, "wb");
+    const uint8_t *position = (const uint8_t*) data;
 
-    if (traceFile <= 0) {
-        error("Unable to open trace file (%s) (%s)\n", fileName, strerror(errno))
-    }
+    while (length) {
 
-}
+        ssize_t bytesWritten = write(descriptor, position, length);
 
+        if (bytesWritten == -1 && errno == EINTR) {
+            continue;
+        }
 
-void flushGlobalBuffer(bool mustLock) {
+        if (bytesWritten <= 0) {
+            return false;
+        }
 
-    debug("Flushing global buffer, mustLock %d\n", mustLock)
+        position += bytesWritten;
+        length -= bytesWritten;
+    }
 
-    if (mustLock)
-        lock(&globalBuffer->lock, false);
+    return true;
 
-    if (globalBuffer->buffer) {
+}
 
-        debug("Flushing global buffer from 0 to %d\n", mustLock)
 
-        uint32_t returnCode;
+static bool readCommand(int descriptor, char *command, bool network) {
 
-        lock(&fileLock, false);
+    uint8_t marker;
 
-        size_t written = fwrite(globalBuffer->buffer, 1, globalBuffer->bufferOffset, traceFile);
+    command[0] = 0;
 
-        if (written != globalBuffer->bufferOffset) {
-            warn("Mismatch between written bytes (%d) and bytes in buffer (%d)\n", written, globalBuffer->bufferOffset)
-        } else {
-            debug("Written %d bytes\n", written)
-        }
+    if (!readFully(descriptor, &marker, 1)) {
+        return false;
+    }
 
-        globalBuffer->bufferOffset = 0;
+    static const char *legacyCommands[] = { "start", "stop", "roll", "dump" };
 
-        unlock(&fileLock, false);
+    if (marker >= 1 && marker <= 4) {
+        strcpy(command, legacyCommands[marker - 1]);
+        return true;
+    }
 
+    if (marker != CONTROL_FRAME_MARKER) {
+        warn("Unknown control command %d\n", marker)
+        return true;
     }
 
-    if (mustLock)
-        unlock(&globalBuffer->lock, false);
+    uint8_t header[2];
 
-    debug("Flushed global buffer now  %d\n", globalBuffer->bufferOffset)
+    if (!readFully(descriptor, header, 2)) {
+        return false;
+    }
 
-}
+    uint32_t length = header[0] | (header[1] << 8);
 
+    if (!readFully(descriptor, command, length)) {
+        return false;
+    }
 
-void flushBuffer(Buffer *buffer) {
+    command[length] = 0;
 
-    lock(&fileLock, false);
+    // TCP clients send ASCII text, which on z/OS is converted like the strings of the JVM, the legacy commands
+    // above being platform literals already
 
-    size_t written = fwrite(buffer->buffer, 1, buffer->bufferOffset, traceFile);
+#ifdef __MVS__
+    if (network) {
+        strcpy(command, JVMStringToPlatform(command));
+    }
+#endif
 
-    debug("buffer: %p written: %d\n", buffer, written)
+    return true;
 
-    if (written != buffer->bufferOffset) {
-        error("Mismatch between written and buffer length\n", written, buffer->bufferOffset)
-    } else {
-        debug("Written %d\n", written)
-    }
+}
 
-    buffer->bufferOffset = 0;
 
-    unlock(&fileLock, false);
+static bool writeReply(int descriptor, const char *reply) {
+
+    uint32_t length = (uint32_t) strlen(reply);
+
+    uint8_t header[3];
+    header[0] = CONTROL_FRAME_MARKER;
+    header[1] = length & 0xff;
+    header[2] = (length >> 8) & 0xff;
+
+    return writeFully(descriptor, header, 3) && writeFully(descriptor, reply, length);
 
 }
 
 
-void flushBuffers(jvmtiEnv *jvmtiInterface, jint numberOfThreads, jthread *threads) {
+// TCP clients send and expect ASCII text, which on z/OS is converted like the strings of the JVM
 
-    //flushBuffer(globalBuffer);
+static bool readNetworkCommand(int descriptor, char *command) {
 
-    debug("Number of threads: %d\n", numberOfThreads)
+    return readCommand(descriptor, command, true);
 
-    for (int i = 0; i < numberOfThreads; i++) {
+}
 
-        debug("Thread: %d\n", i)
 
-        jvmtiError returnCode;
-        ThreadNode *threadNode;
+static bool writeNetworkReply(int descriptor, const char *reply) {
 
-        returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, threads[i], (void **) &threadNode);
-        if (returnCode != JNI_OK) {
-            error("Unable to GetThreadLocalStorage (%d)\n", returnCode)
-        }
+    return writeReply(descriptor, platformStringToJVM((char*) reply));
 
-        if (threadNode) {
-            if (threadNode->threadBuffer) {
-                flushBuffer(threadNode->threadBuffer);
-            } else {
-                debug("No buffer\n")
-            }
+}
+#endif
 
-        } else {
-            debug("No threadNode\n")
+
+#if defined __linux || defined __MVS__
+void networkCleanup(void *arg) {
+    int *serverSocket = (int*) arg;
+    if(serverSocket) {
+        if(jvm) {
+            (*jvm)->DetachCurrentThread(jvm);
         }
+        close(*serverSocket);
+        *serverSocket=0;
     }
 
 }
+#endif
 
 
-void writeUint8_t(Buffer *buffer, uint8_t value) {
+#if defined __linux || defined __MVS__
+static bool streamToCollector(int clientSocket, char *reply, uint32_t replyLength) {
 
-    buffer->buffer[buffer->bufferOffset++] = value;
+    reply[0] = 0;
 
-}
+    if (!streamTrace) {
+        appendReply(reply, replyLength, "error streaming needs the streamTrace option\n");
+        return false;
+    }
 
+    if (!attachCollector(clientSocket)) {
+        appendReply(reply, replyLength, "error a collector is already attached\n");
+        return false;
+    }
 
-void writeUint16_t(Buffer *buffer, uint16_t value) {
+    // The reply goes out before the trace, which starts with the next trace file, in flight mode the next dump
 
-    uint16_t* castBuffer = (uint16_t*)(buffer->buffer+buffer->bufferOffset);
+    appendReply(reply, replyLength, "ok stream\n");
+    appendCounters(reply, replyLength);
+    writeNetworkReply(clientSocket, reply);
 
-    *castBuffer = value;
-    buffer->bufferOffset+=sizeof(uint16_t);
+    if (profilingMode != MODE_FLIGHT) {
+        switchTraceFile();
+    }
+
+    return true;
 
 }
 
 
-void writeUint32_tLittleEndian(Buffer *buffer, uint32_t value) {
+void* networkController(void *arg) {
 
-    uint8_t *pointer = (buffer->buffer+buffer->bufferOffset);
+    debug("Network Controller Thread\n")
 
-    *(pointer++) = (value)&0xff;
-    *(pointer++) = (value>>8)&0xff;
-    *(pointer++) = (value>>16)&0xff;
-    *(pointer) = (value>>24)&0xff;
+    int previousState = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &previousState);
 
-    buffer->bufferOffset+=sizeof(uint32_t);
+    JavaVM *vm = (JavaVM*) arg;
 
-}
+    JNIEnv *JNIInterface;
 
+    jint jniReturnCode;
+    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
+    if (jniReturnCode != JNI_OK) {
+        error("Unable to attach to the JVM, network controller unavailable (%d)\n", jniReturnCode)
+        return NULL;
+    }
 
-void writeUint16_tLittleEndian(Buffer *buffer, uint16_t value) {
+    jvmtiError returnCode;
+    jthread currentThread;
 
-    uint8_t *pointer = (buffer->buffer+buffer->bufferOffset);
+    returnCode = (*globalJVMTIInterface)->GetCurrentThread(globalJVMTIInterface, &currentThread);
+    if (returnCode != JVMTI_ERROR_NONE) {
+        error("Error getting the current thread, network controller unavailable (%d)\n", returnCode)
+        return NULL;
+    }
 
-    *(pointer++) = (value)&0xff;
-    *(pointer) = (value>>8)&0xff;
+    ThreadNode *threadNode = calloc(1, sizeof(ThreadNode));
 
-    buffer->bufferOffset+=sizeof(uint16_t);
+    threadNode->threadID = -1;
 
-}
+    returnCode = (*globalJVMTIInterface)->SetThreadLocalStorage(globalJVMTIInterface, currentThread, threadNode);
+    if (returnCode != JVMTI_ERROR_NONE) {
+        error("Error setting thread local storage, network controller unavailable (%d)\n", returnCode)
+        return NULL;
+    }
 
+    int serverSocket;
+    int clientSocket;
 
-void writeUint64_tLittleEndian(Buffer *buffer, uint64_t value) {
+    struct sockaddr_in serverAddress;
+    struct sockaddr_in clientAddress;
 
-    uint8_t *pointer = (buffer->buffer+buffer->bufferOffset);
+    int ENABLE = 1;
 
-    *(pointer++) = (value)&0xff;
-    *(pointer++) = (value>>8)&0xff;
-    *(pointer++) = (value>>16)&0xff;
-    *(pointer++) = (value>>24)&0xff;
-    *(pointer++) = (value>>32)&0xff;
-    *(pointer++) = (value>>40)&0xff;
-    *(pointer++) = (value>>48)&0xff;
-    *(pointer) = (value>>56)&0xff;
+    serverSocket = socket(AF_INET, SOCK_STREAM, 0);
 
-    buffer->bufferOffset+=sizeof(uint64_t);
+    if (serverSocket == -1) {
+        error("Error creating server socket, network controller unavailable (%s)\n", strerror(errno))
+        return NULL;
+    }
 
-}
+    if (setsockopt(serverSocket, SOL_SOCKET, SO_REUSEADDR, (char *) &ENABLE, sizeof(int)) == -1) {
+        error("Error creating server socket, network controller unavailable (%s)\n", strerror(errno))
+        close(serverSocket);
+        return NULL;
+    }
 
+    memset(&serverAddress, 0, sizeof(serverAddress));
+    serverAddress.sin_family = AF_INET;
+    serverAddress.sin_port = htons(controlPort);
 
-void writeUint32_t(Buffer *buffer, uint32_t value) {
+    if (inet_pton(AF_INET, controlAddress, &serverAddress.sin_addr) != 1) {
+        error("Invalid control address %s, network controller unavailable\n", controlAddress)
+        close(serverSocket);
+        return NULL;
+    }
 
-    uint32_t* castBuffer = (uint32_t*)(buffer->buffer+buffer->bufferOffset);
+    debug("Binding Socket\n");
 
-    *castBuffer = value;
+    if (bind(serverSocket, (struct sockaddr*) &serverAddress, sizeof(serverAddress)) == -1) {
+        error("Error binding server socket, network controller unavailable (%s)\n", strerror(errno))
+        close(serverSocket);
+        return NULL;
+    }
 
-    buffer->bufferOffset+=sizeof(uint32_t);
-}
+    debug("Listening on Socket\n")
 
+    if (listen(serverSocket, 2) == -1) {
+        error("Error listening on server socket, network controller unavailable (%s)\n", strerror(errno))
+        close(serverSocket);
+        return NULL;
+    }
 
-void writeUint64_t(Buffer *buffer, uint64_t value) {
+    info("Network controller listening on %s:%d\n", controlAddress, controlPort)
 
-    uint64_t* castBuffer = (uint64_t*)(buffer->buffer+buffer->bufferOffset);
+    char *command = calloc(1, CONTROL_COMMAND_LENGTH);
+    char *reply = calloc(1, CONTROL_REPLY_LENGTH);
 
-    *castBuffer = value;
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &previousState);
 
-    buffer->bufferOffset+=sizeof(uint64_t);
+    pthread_cleanup_push((networkCleanup), (void*) &serverSocket);
 
-}
+    while (agentLoaded) {
 
+        socklen_t structSize = sizeof(struct sockaddr_in);
 
-void writeString(Buffer *buffer, char *string) {
+        debug("Accepting Connection\n");
 
-    if (string) {
-        char *platformString = JVMStringToPlatform(string);
-        uint32_t length= strlen(string);
-        uint32_t _length = strlen(platformString);
-        if(_length != length) {
-            warn("Length mismatch\n")
-        }
+        clientSocket = accept(serverSocket, (struct sockaddr*) &clientAddress, &structSize);
 
-        writeUint16_t(buffer, (uint16_t) length);
-        if (length) {
-            memcpy(buffer->buffer + buffer->bufferOffset, string, length);
-            buffer->bufferOffset += length;
+        if (clientSocket == -1) {
+            error("Error accepting connection from the client (%s)\n", strerror(errno))
+            pthread_testcancel();
+            continue;
         }
-    }
-
-}
 
+        // Connections are served one at a time, so a client that sends nothing for a while is dropped to let the
+        // next one in. Commands are read until then, until the client closes the connection, or hands it over
+        // to the trace with stream.
 
-void writeDefaultHeader(Buffer *buffer) {
+        struct timeval idle;
+        idle.tv_sec = CONTROL_IDLE_SECONDS;
+        idle.tv_usec = 0;
 
-    if (buffer->shared) {
-        lock(&buffer->lock, false);
-    }
+        if (setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char *) &idle, sizeof(idle)) == -1) {
+            warn("Unable to set a receive timeout on the client connection (%s)\n", strerror(errno))
+        }
 
-    writeUint8_t(buffer, platformStringToJVM(headerBinary)[0]);
-    writeUint32_tLittleEndian(buffer, headerVersion);
-    writeUint32_tLittleEndian(buffer, headerPlatform);
-    writeUint32_tLittleEndian(buffer, headerNumberOfEvents);
-    writeUint32_tLittleEndian(buffer, headerMaxThreads);
-    writeUint32_tLittleEndian(buffer, headerMaxClasses);
-    writeUint32_tLittleEndian(buffer, headerTicksPerMicrosecond);
-    writeUint64_tLittleEndian(buffer, getTicks());
-    writeUint32_tLittleEndian(buffer, time(NULL));
-    writeUint32_tLittleEndian(buffer, time(NULL));
-    writeUint32_tLittleEndian(buffer, 0);
+        bool streaming = false;
 
-    if (buffer->shared) {
-        unlock(&buffer->lock, false);
-    }
+        while (!streaming && readNetworkCommand(clientSocket, command)) {
 
-}
+            if (command[0] == 0) {
+                continue;
+            }
+
+            debug("Received command %s\n", command)
+
+            if (strcmp(command, "stream") == 0) {
+                streaming = streamToCollector(clientSocket, reply, CONTROL_REPLY_LENGTH);
+            } else {
+                executeCommand(globalJVMTIInterface, JNIInterface, command, reply, CONTROL_REPLY_LENGTH);
+            }
+
+            if (!streaming && !writeNetworkReply(clientSocket, reply)) {
+                break;
+            }
+        }
+
+        if (!streaming) {
+            close(clientSocket);
+        }
+
+        pthread_testcancel();
+    }
+
+    pthread_cleanup_pop(1);
+    return 0;
+}
+#endif
+
+
+#ifdef __WIN32__
+void eventCleanup(void *arg) {
+
+    EventCleanupStruct *eventCleanupStruct = arg;
+
+    if (eventCleanupStruct) {
+
+        (*jvm)->DetachCurrentThread(jvm);
+        CloseHandle(eventCleanupStruct->startEvent);
+        CloseHandle(eventCleanupStruct->stopEvent);
+        CloseHandle(eventCleanupStruct->rollEvent);
+        CloseHandle(eventCleanupStruct->dumpEvent);
+    }
+
+}
+#endif
+
+
+#if defined __linux || defined __MVS__
+void pipeCleanup(void *arg) {
+
+    if(arg) {
+
+        int *pipe = (int*) arg;
+
+        if(*pipe) {
+            close(*pipe);
+        }
+
+        char *pipeName = calloc(1, 128);
+        sprintf((char*) pipeName, "/tmp/prfctl-%d", pid);
+        unlink(pipeName);
+
+        sprintf((char*) pipeName, "/tmp/prfctl-%d.reply", pid);
+        unlink(pipeName);
+
+    }
+
+}
+#endif
+
+
+#if defined __linux || defined __MVS__
+void* pipeController(void *arg) {
+
+    info("Starting the Controller Thread\n")
+
+    int previousState = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &previousState);
+
+    JavaVM *vm = (JavaVM*) arg;
+
+    JNIEnv *JNIInterface;
+
+    jint jniReturnCode;
+    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
+    if (jniReturnCode != JNI_OK) {
+        error("Unable to attach to the JVM, local controller unavailable (%d)\n", jniReturnCode)
+        return NULL;
+    }
+
+    jvmtiError returnCode;
+    jthread currentThread = calloc(1, sizeof(jthread));;
+
+    returnCode = (*globalJVMTIInterface)->GetCurrentThread(globalJVMTIInterface, &currentThread);
+    if (jniReturnCode != JNI_OK) {
+        error("Error getting the current thread, local controller unavailable (%d)\n", returnCode)
+        return NULL;
+    }
+
+
+    ThreadNode *threadNode = calloc(1, sizeof(ThreadNode));
+
+    threadNode->threadID = -1;
+
+    returnCode = (*globalJVMTIInterface)->SetThreadLocalStorage(globalJVMTIInterface, currentThread, threadNode);
+    if (jniReturnCode != JNI_OK) {
+        error("Error setting thread local storage, local controller unavailable (%d)\n", returnCode)
+        return NULL;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &previousState);
+
+    char *pipeName = calloc(1, 128);
+    sprintf((char*) pipeName, "/tmp/prfctl-%d", pid);
+
+    char *replyName = calloc(1, 128);
+    sprintf((char*) replyName, "/tmp/prfctl-%d.reply", pid);
+
+    char *command = calloc(1, CONTROL_COMMAND_LENGTH);
+    char *reply = calloc(1, CONTROL_REPLY_LENGTH);
+
+    int *pipe = calloc(1, sizeof(int));
+
+    mkfifo(pipeName, 0666);
+    mkfifo(replyName, 0666);
+
+    pthread_cleanup_push((pipeCleanup), (void*) pipe);
+
+            while(agentLoaded) {
+
+                *pipe = open(pipeName, O_RDONLY);
+
+                while (readCommand(*pipe, command, false)) {
+
+                    if (command[0] == 0) {
+                        continue;
+                    }
+
+                    debug("Recieved command %s\n", command)
+
+                    executeCommand(globalJVMTIInterface, JNIInterface, command, reply, CONTROL_REPLY_LENGTH);
+
+                    // The reply is dropped unless something has the reply pipe open for reading
+
+                    int replyPipe = open(replyName, O_WRONLY | O_NONBLOCK);
+
+                    if (replyPipe != -1) {
+                        fcntl(replyPipe, F_SETFL, 0);
+                        if (!writeReply(replyPipe, reply)) {
+                            warn("Unable to write the control reply (%s)\n", strerror(errno))
+                        }
+                        close(replyPipe);
+                    }
+                }
+                close(*pipe);
+                *pipe = 0;
+                pthread_testcancel();
+            }
+
+    pthread_cleanup_pop(1);
+    return 0;
+}
+#endif
+
+
+#ifdef __WIN32__
+void* eventController(void *arg) {
+
+    debug("Starting the Controller Thread\n")
+
+    int previousState = 0;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &previousState);
+
+    JavaVM *vm = (JavaVM*) arg;
+
+    JNIEnv *JNIInterface;
+
+    jint jniReturnCode;
+    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
+    if (jniReturnCode != JNI_OK) {
+        error("Unable to attach to the JVM, network controller unavailable (%d)\n", (uint32_t )jniReturnCode)
+        return NULL;
+    }
+
+    jvmtiError returnCode;
+    jthread currentThread;
+
+    returnCode = (*globalJVMTIInterface)->GetCurrentThread(globalJVMTIInterface, &currentThread);
+    if (jniReturnCode != JNI_OK) {
+        error("Error getting the current thread, network controller unavailable (%d)\n", returnCode)
+        return NULL;
+    }
+
+    ThreadNode *threadNode = calloc(1, sizeof(ThreadNode));
+    if (threadNode <= 0) {
+        error("Unable to allocate ThreadNode\n")
+        exit(-1);
+    }
+
+    threadNode->threadID = -1;
+
+    returnCode = (*globalJVMTIInterface)->SetThreadLocalStorage(globalJVMTIInterface, currentThread, threadNode);
+    if (jniReturnCode != JNI_OK) {
+        error("Error setting thread local storage, network controller unavailable (%d)\n", returnCode)
+        return NULL;
+    }
+
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &previousState);
+
+    char *startEventName = calloc(1, 128);
+    char *stopEventName = calloc(1, 128);
+    char *rollEventName = calloc(1, 128);
+    char *dumpEventName = calloc(1, 128);
+    if (startEventName <= 0 || stopEventName <= 0|| rollEventName <= 0 || dumpEventName <= 0) {
+        error("Unable to allocate EventNames\n")
+        exit(-1);
+    }
+
+    sprintf((char*) startEventName, "Global\\profilerStart-%d", (uint32_t) pid);
+    sprintf((char*) stopEventName, "Global\\profilerStop-%d", (uint32_t) pid);
+    sprintf((char*) rollEventName, "Global\\profilerRoll-%d", (uint32_t) pid);
+    sprintf((char*) dumpEventName, "Global\\profilerDump-%d", (uint32_t) pid);
+
+    debug("%s\n", startEventName)
+    debug("%s\n", stopEventName)
+    debug("%s\n", rollEventName)
+    debug("%s\n", dumpEventName)
+
+    HANDLE startEvent = CreateEvent(NULL, TRUE, FALSE, startEventName);
+
+    HANDLE stopEvent = CreateEvent(NULL, TRUE, FALSE, stopEventName);
+
+    HANDLE rollEvent = CreateEvent(NULL, TRUE, FALSE, rollEventName);
+
+    HANDLE dumpEvent = CreateEvent(NULL, TRUE, FALSE, dumpEventName);
+
+    EventCleanupStruct eventCleanupStruct;
+
+    eventCleanupStruct.startEvent = startEvent;
+    eventCleanupStruct.stopEvent = stopEvent;
+    eventCleanupStruct.rollEvent = rollEvent;
+    eventCleanupStruct.dumpEvent = dumpEvent;
+
+    pthread_cleanup_push((eventCleanup), (void*) &eventCleanupStruct);
+
+//		bool profiling = false;
+
+        HANDLE events[4] = {startEvent, stopEvent, rollEvent, dumpEvent};
+
+        while (1) {
+
+            DWORD dwEvent;
+
+            dwEvent  = WaitForMultipleObjects(4, events, FALSE, INFINITE);
+
+            switch (dwEvent)
+            {
+                case WAIT_OBJECT_0 + 0:
+                    ResetEvent(startEvent);
+                    startProfiling(globalJVMTIInterface, JNIInterface);
+                    break;
+
+                case WAIT_OBJECT_0 + 1:
+                    ResetEvent(stopEvent);
+                    stopProfiling(globalJVMTIInterface, JNIInterface);
+                    break;
+
+                case WAIT_OBJECT_0 + 2:
+                    ResetEvent(rollEvent);
+                    rollTraceFile(globalJVMTIInterface, JNIInterface);
+                    break;
+
+                case WAIT_OBJECT_0 + 3:
+                    ResetEvent(dumpEvent);
+                    dumpFlightRecorder();
+                    break;
+
+                default:
+                    error("Wait error: %ld\n", GetLastError())
+            }
+
+
+            pthread_testcancel();
+        }
+
+    pthread_cleanup_pop(1);
+}
+#endif
+
+void getAllThreads(jvmtiEnv *jvmtiInterface, jint *numberOfThreads, jthread **threads) {
+    jvmtiError returnCode;
+
+    returnCode = (*jvmtiInterface)->GetAllThreads(jvmtiInterface, numberOfThreads, threads);
+    if (returnCode != JNI_OK) {
+        error("Error in GetAllThreads (%d)\n", returnCode)
+    }
+}
+
+
+void reportThreadStatistics(jvmtiEnv *jvmtiInterface, jint numberOfThreads, jthread *threads) {
+
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    uint64_t suppressed = 0;
+
+    for (int i = 0; i < numberOfThreads; i++) {
+
+        jvmtiError returnCode;
+        ThreadNode *threadNode;
+
+        returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, threads[i], (void **) &threadNode);
+        if (returnCode != JNI_OK) {
+            warn("Unable to GetThreadLocalStorage (%d)\n", returnCode)
+        }
+
+        if (threadNode) {
+
+            cacheHits += threadNode->cacheHits;
+            cacheMisses += threadNode->cacheMisses;
+            suppressed += threadNode->shadowSuppressed;
+
+        }
+
+    }
+
+    info("Threads: %d, Cache Hits: %" PRIu64 ", Cache Misses: %" PRIu64 "\n", (uint32_t )numberOfThreads, cacheHits, cacheMisses)
+
+    if (minDurationTicks) {
+        info("Calls under %" PRIu64 " ns suppressed: %" PRIu64 "\n", minDuration, suppressed)
+    }
+
+}
+
+
+static void retainTraceFile(const char *fileName) {
+
+    if (keepFiles == 0) {
+        return;
+    }
+
+    uint32_t slot = keptFileCount++ % keepFiles;
+
+    if (keptFiles[slot]) {
+
+        if (unlink(keptFiles[slot])) {
+            warn("Unable to remove trace file %s (%s)\n", keptFiles[slot], strerror(errno))
+        } else {
+            info("Removed Trace File: %s\n", keptFiles[slot])
+        }
+
+        free(keptFiles[slot]);
+    }
+
+    keptFiles[slot] = strdup(fileName);
+
+}
+
+
+void openTraceFile(const char *fileName) {
+
+    openOutput(fileName);
+
+    snprintf(currentTraceFile, sizeof(currentTraceFile), "%s", fileName);
+
+    traceFileBytes = 0;
+    traceFileOpened = time(NULL);
+
+    retainTraceFile(fileName);
+
+}
+
+
+static inline void lockFile() {
+
+    if (!isOutputLockFree()) {
+        lock(&fileLock, false);
+    }
+
+}
+
+
+static inline void unlockFile() {
+
+    if (!isOutputLockFree()) {
+        unlock(&fileLock, false);
+    }
+
+}
+
+
+static inline void countTraceBytes(size_t written) {
+
+    __sync_fetch_and_add(&bytesFlushed, written);
+
+    if (rollSize && __sync_add_and_fetch(&traceFileBytes, written) >= rollSize) {
+        rollRequested = true;
+    }
+
+    if (rollInterval && time(NULL) - traceFileOpened >= rollInterval) {
+        rollRequested = true;
+    }
+
+}
+
+
+static inline bool beginFlush() {
+
+    // While a roll defines the classes and threads again in the new file, buffers that may refer to them wait
+
+    if (rollSize == 0 && rollInterval == 0 && !streamTrace) {
+        return false;
+    }
+
+    while (true) {
+
+        __sync_fetch_and_add(&flushesInProgress, 1);
+
+        if (!carryPending) {
+            return true;
+        }
+
+        __sync_fetch_and_sub(&flushesInProgress, 1);
+
+        while (carryPending) {
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 10000;
+            nanosleep(&ts, NULL);
+        }
+    }
+
+}
+
+
+static inline void endFlush() {
+
+    __sync_fetch_and_sub(&flushesInProgress, 1);
+
+}
+
+
+void flushGlobalBuffer(bool mustLock) {
+
+    debug("Flushing global buffer, mustLock %d\n", mustLock)
+
+    if (mustLock)
+        lock(&globalBuffer->lock, false);
+
+    if (globalBuffer->buffer) {
+
+        debug("Flushing global buffer from 0 to %d\n", mustLock)
+
+        uint32_t returnCode;
+
+        lock(&fileLock, false);
+
+        // Between flight recorder dumps there is no trace file, and each dump defines again what it refers to
+
+        if (profilingMode != MODE_FLIGHT || isOutputOpen()) {
+
+            size_t written = writeOutput(globalBuffer->buffer, globalBuffer->bufferOffset);
+
+            countTraceBytes(written);
+
+            if (written != globalBuffer->bufferOffset) {
+                warn("Mismatch between written bytes (%d) and bytes in buffer (%d)\n", written, globalBuffer->bufferOffset)
+            } else {
+                debug("Written %d bytes\n", written)
+            }
+
+        }
+
+        globalBuffer->bufferOffset = 0;
+
+        unlock(&fileLock, false);
+
+    }
+
+    if (mustLock)
+        unlock(&globalBuffer->lock, false);
+
+    debug("Flushed global buffer now  %d\n", globalBuffer->bufferOffset)
+
+}
+
+
+void drainRings();
+void flushSamples(bool mustLock);
+
+
+static bool reserveFlightMemory(uint64_t length) {
+
+    uint64_t allocated = __sync_add_and_fetch(&flightAllocated, length);
+
+    if (allocated <= flightMemory) {
+        return true;
+    }
+
+    __sync_fetch_and_sub(&flightAllocated, length);
+
+    return false;
+
+}
+
+
+static void findEndedRing(ThreadNode *threadNode, void *arg) {
+
+    ChunkRing *ring = threadNode->threadBuffer ? threadNode->threadBuffer->ring : NULL;
+    ChunkRing **oldest = (ChunkRing**) arg;
+
+    if (ring && ring->ended && ring->numberOfChunks && (*oldest == NULL || ring->ended < (*oldest)->ended)) {
+        *oldest = ring;
+    }
+
+}
+
+
+/*
+ * Frees the ring of the thread that ended first, its events being the oldest in any dump, and returns its chunks
+ * to the flightMemory budget. Dumps read the rings under the writer lock, so it is held while the ring goes.
+ */
+static bool reclaimFlightRing() {
+
+    ChunkRing *oldest = NULL;
+
+    lock(&writerLock, false);
+
+    forEachThreadNode(findEndedRing, &oldest);
+
+    if (oldest) {
+
+        // A ring below FLIGHT_MIN_CHUNKS was given its chunk outside the budget
+
+        if (oldest->numberOfChunks >= FLIGHT_MIN_CHUNKS) {
+            __sync_fetch_and_sub(&flightAllocated, (uint64_t) oldest->numberOfChunks * oldest->chunkLength);
+        }
+
+        for (int i = 0; i < oldest->numberOfChunks; i++) {
+            free(oldest->chunks[i].data);
+            oldest->chunks[i].data = NULL;
+        }
+
+        oldest->head = oldest->tail;
+        oldest->numberOfChunks = 0;
+
+        flightReclaims++;
+
+    }
+
+    unlock(&writerLock, false);
+
+    return oldest != NULL;
+
+}
+
+
+static bool growFlightRing(ChunkRing *ring) {
+
+    // Rings grow while the flightMemory budget lasts, so it goes to the threads that record the most. A ring only
+    // grows before it first overwrites, so the chunk order is unchanged. A ring that started with a single chunk,
+    // outside the budget, is charged for it as well once it grows.
+
+    if (ring->head || ring->numberOfChunks == FLIGHT_THREAD_CHUNKS) {
+        return false;
+    }
+
+    uint64_t length = ring->numberOfChunks < FLIGHT_MIN_CHUNKS ? (uint64_t) FLIGHT_MIN_CHUNKS * ring->chunkLength : ring->chunkLength;
+
+    if (!reserveFlightMemory(length)) {
+        flightStarved = true;
+        return false;
+    }
+
+    uint8_t *data = calloc(1, ring->chunkLength);
+    if (data <= 0) {
+        __sync_fetch_and_sub(&flightAllocated, length);
+        return false;
+    }
+
+    ring->chunks[ring->numberOfChunks++].data = data;
+
+    return true;
+
+}
+
+
+static void recycleChunk(Buffer *buffer) {
+
+    // A flight ring keeps its newest chunks, with the one being filled never among them. While a dump reads
+    // the ring nothing moves, and the filled chunk is discarded instead.
+
+    ChunkRing *ring = buffer->ring;
+
+    __sync_fetch_and_add(&flightPublishes, 1);
+
+    if (ring->numberOfChunks < FLIGHT_MIN_CHUNKS && !growFlightRing(ring)) {
+
+        // Without a second chunk the one being filled would be the only one kept, so its events are dropped
+
+        __sync_fetch_and_add(&flightDiscards, 1);
+
+    } else if (!flightDumping) {
+
+        uint32_t tail = ring->tail;
+
+        ring->chunks[tail % ring->numberOfChunks].length = buffer->bufferOffset;
+
+        if (tail + 1 - ring->head >= ring->numberOfChunks && !growFlightRing(ring)) {
+            ring->head++;
+            __sync_fetch_and_add(&flightOverwrites, 1);
+        }
+
+        memoryBarrier();
+
+        ring->tail = ++tail;
+
+        buffer->buffer = ring->chunks[tail % ring->numberOfChunks].data;
+
+    } else {
+        __sync_fetch_and_add(&flightDiscards, 1);
+    }
+
+    __sync_fetch_and_sub(&flightPublishes, 1);
+
+    buffer->bufferOffset = 0;
+
+    beginBlock(buffer);
+
+}
+
+
+void publishChunk(Buffer *buffer) {
+
+    if (!sealBlock(buffer)) {
+        return;
+    }
+
+    if (profilingMode == MODE_FLIGHT) {
+        recycleChunk(buffer);
+        return;
+    }
+
+    ChunkRing *ring = buffer->ring;
+
+    uint32_t tail = ring->tail;
+
+    ring->chunks[tail % ring->numberOfChunks].length = buffer->bufferOffset;
+
+    memoryBarrier();
+
+    ring->tail = ++tail;
+
+    while ((tail - ring->head) >= ring->numberOfChunks) {
+
+        ring->stalls++;
+        writerNudged = true;
+
+        if (!writerRunning) {
+            drainRings();
+        } else {
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 10000;
+            nanosleep(&ts, NULL);
+        }
+
+    }
+
+    buffer->buffer = ring->chunks[tail % ring->numberOfChunks].data;
+    buffer->bufferOffset = 0;
+
+    beginBlock(buffer);
+
+}
+
+
+void flushBuffer(Buffer *buffer) {
+
+    if (buffer->ring) {
+        publishChunk(buffer);
+        return;
+    }
+
+    if (!sealBlock(buffer)) {
+        return;
+    }
+
+    // The roll policy can change while a flush is under way, so only a flush that was counted is uncounted
+
+    bool gated = buffer != globalBuffer && beginFlush();
+
+    lockFile();
+
+    size_t written = buffer != globalBuffer ? writeEventOutput(buffer->buffer, buffer->bufferOffset) : writeOutput(buffer->buffer, buffer->bufferOffset);
+
+    countTraceBytes(written);
+
+    debug("buffer: %p written: %d\n", buffer, written)
+
+    if (written != buffer->bufferOffset) {
+        error("Mismatch between written and buffer length\n", written, buffer->bufferOffset)
+    } else {
+        debug("Written %d\n", written)
+    }
+
+    buffer->bufferOffset = 0;
+
+    beginBlock(buffer);
+
+    unlockFile();
+
+    if (gated) {
+        endFlush();
+    }
+
+}
+
+
+void flushFullBuffer(Buffer *buffer) {
+
+    if (buffer->ring) {
+        publishChunk(buffer);
+        return;
+    }
+
+    if (!buffer->shared) {
+        awaitResolver();
+    }
+
+    flushGlobalBuffer(false);
+    flushBuffer(buffer);
+
+}
+
+
+void snapshotRing(ThreadNode *threadNode, void *arg) {
+
+    ChunkRing *ring = threadNode->threadBuffer ? threadNode->threadBuffer->ring : NULL;
+
+    if (ring) {
+        ring->snapshot = ring->tail;
+    }
+
+}
+
+
+void drainRing(ThreadNode *threadNode, void *arg) {
+
+    ChunkRing *ring = threadNode->threadBuffer ? threadNode->threadBuffer->ring : NULL;
+
+    if (ring == NULL || ring->head == ring->snapshot) {
+        return;
+    }
+
+    memoryBarrier();
+
+    lockFile();
+
+    for (uint32_t i = ring->head; i != ring->snapshot; i++) {
+
+        Chunk *chunk = &ring->chunks[i % ring->numberOfChunks];
+
+        size_t written = writeEventOutput(chunk->data, chunk->length);
+
+        countTraceBytes(written);
+
+        if (written != chunk->length) {
+            error("Mismatch between written (%d) and chunk length (%d)\n", (uint32_t) written, chunk->length)
+        }
+
+    }
+
+    unlockFile();
+
+    memoryBarrier();
+
+    ring->head = ring->snapshot;
+
+}
+
+
+void drainRings() {
+
+    if (profilingMode == MODE_FLIGHT) {
+        return;
+    }
+
+    lock(&writerLock, false);
+
+    forEachThreadNode(snapshotRing, NULL);
+
+    awaitResolver();
+
+    flushGlobalBuffer(true);
+
+    forEachThreadNode(drainRing, NULL);
+
+    unlock(&writerLock, false);
+
+}
+
+
+void* backgroundWriter(void *arg) {
+
+    info("Starting the Writer Thread, latency %d ms\n", writerLatency)
+
+    while (writerRunning) {
+
+        uint32_t waited = 0;
+
+        while (writerRunning && !writerNudged && waited < writerLatency) {
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 1000000;
+            nanosleep(&ts, NULL);
+            waited++;
+        }
+
+        writerNudged = false;
+
+        drainRings();
+    }
+
+    return NULL;
+
+}
+
+
+void startWriter() {
+
+    writerRunning = true;
+
+    if (pthread_create(&writerThread, NULL, backgroundWriter, NULL)) {
+        error("Unable to start the writer thread (%s)\n", strerror(errno))
+        writerRunning = false;
+    }
+
+}
+
+
+void stopWriter() {
+
+    if (writerRunning) {
+        writerRunning = false;
+        pthread_join(writerThread, NULL);
+    }
+
+    drainRings();
+
+}
+
+
+void flushBuffers(jvmtiEnv *jvmtiInterface, jint numberOfThreads, jthread *threads) {
+
+    //flushBuffer(globalBuffer);
+
+    awaitResolver();
+
+    debug("Number of threads: %d\n", numberOfThreads)
+
+    for (int i = 0; i < numberOfThreads; i++) {
+
+        debug("Thread: %d\n", i)
+
+        jvmtiError returnCode;
+        ThreadNode *threadNode;
+
+        returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, threads[i], (void **) &threadNode);
+        if (returnCode != JNI_OK) {
+            error("Unable to GetThreadLocalStorage (%d)\n", returnCode)
+        }
+
+        if (threadNode) {
+            if (threadNode->threadBuffer) {
+                flushBuffer(threadNode->threadBuffer);
+            } else {
+                debug("No buffer\n")
+            }
+
+        } else {
+            debug("No threadNode\n")
+        }
+    }
+
+    if (asyncWriter) {
+        drainRings();
+    }
+
+    flushSamples(true);
+
+}
+
+
+void writeUint8_t(Buffer *buffer, uint8_t value) {
+
+    buffer->buffer[buffer->bufferOffset++] = value;
+
+}
+
+
+void writeUint16_t(Buffer *buffer, uint16_t value) {
+
+    uint16_t* castBuffer = (uint16_t*)(buffer->buffer+buffer->bufferOffset);
+
+    *castBuffer = value;
+    buffer->bufferOffset+=sizeof(uint16_t);
+
+}
+
+
+void writeUint32_tLittleEndian(Buffer *buffer, uint32_t value) {
+
+    uint8_t *pointer = (buffer->buffer+buffer->bufferOffset);
+
+    *(pointer++) = (value)&0xff;
+    *(pointer++) = (value>>8)&0xff;
+    *(pointer++) = (value>>16)&0xff;
+    *(pointer) = (value>>24)&0xff;
+
+    buffer->bufferOffset+=sizeof(uint32_t);
+
+}
+
+
+void writeUint16_tLittleEndian(Buffer *buffer, uint16_t value) {
+
+    uint8_t *pointer = (buffer->buffer+buffer->bufferOffset);
+
+    *(pointer++) = (value)&0xff;
+    *(pointer) = (value>>8)&0xff;
+
+    buffer->bufferOffset+=sizeof(uint16_t);
+
+}
+
+
+void writeUint64_tLittleEndian(Buffer *buffer, uint64_t value) {
+
+    uint8_t *pointer = (buffer->buffer+buffer->bufferOffset);
+
+    *(pointer++) = (value)&0xff;
+    *(pointer++) = (value>>8)&0xff;
+    *(pointer++) = (value>>16)&0xff;
+    *(pointer++) = (value>>24)&0xff;
+    *(pointer++) = (value>>32)&0xff;
+    *(pointer++) = (value>>40)&0xff;
+    *(pointer++) = (value>>48)&0xff;
+    *(pointer) = (value>>56)&0xff;
+
+    buffer->bufferOffset+=sizeof(uint64_t);
+
+}
+
+
+void writeUint32_t(Buffer *buffer, uint32_t value) {
+
+    uint32_t* castBuffer = (uint32_t*)(buffer->buffer+buffer->bufferOffset);
+
+    *castBuffer = value;
+
+    buffer->bufferOffset+=sizeof(uint32_t);
+}
+
+
+void writeUint64_t(Buffer *buffer, uint64_t value) {
+
+    uint64_t* castBuffer = (uint64_t*)(buffer->buffer+buffer->bufferOffset);
+
+    *castBuffer = value;
+
+    buffer->bufferOffset+=sizeof(uint64_t);
+
+}
+
+
+void writeVarint(Buffer *buffer, uint64_t value) {
+
+    while (value >= 0x80) {
+        buffer->buffer[buffer->bufferOffset++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+
+    buffer->buffer[buffer->bufferOffset++] = (uint8_t) value;
+
+}
+
+
+void writeTicksDelta(Buffer *buffer, uint64_t ticks) {
+
+    writeVarint(buffer, zigzagEncode((int64_t) (ticks - buffer->lastTicks)));
+    buffer->lastTicks = ticks;
+
+}
+
+
+void beginBlock(Buffer *buffer) {
+
+    if (compactFormat && !buffer->shared) {
+        writeUint8_t(buffer, EVENT_THREAD_BLOCK);
+        writeUint32_t(buffer, buffer->threadID);
+        writeUint32_t(buffer, 0);
+        buffer->lastTicks = 0;
+    }
+
+}
+
+
+bool sealBlock(Buffer *buffer) {
+
+    if (compactFormat && !buffer->shared) {
+
+        if (buffer->bufferOffset <= BLOCK_HEADER_LENGTH) {
+            return false;
+        }
+
+        uint32_t* blockLength = (uint32_t*)(buffer->buffer + sizeof(uint8_t) + sizeof(uint32_t));
+        *blockLength = buffer->bufferOffset - BLOCK_HEADER_LENGTH;
+
+    }
+
+    return true;
+
+}
+
+
+void writeString(Buffer *buffer, char *string) {
+
+    if (string) {
+        char *platformString = JVMStringToPlatform(string);
+        uint32_t length= strlen(string);
+        uint32_t _length = strlen(platformString);
+        if(_length != length) {
+            warn("Length mismatch\n")
+        }
+
+        writeUint16_t(buffer, (uint16_t) length);
+        if (length) {
+            memcpy(buffer->buffer + buffer->bufferOffset, string, length);
+            buffer->bufferOffset += length;
+        }
+    }
+
+}
+
+
+void writeDefaultHeader(Buffer *buffer) {
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    writeUint8_t(buffer, platformStringToJVM(headerBinary)[0]);
+    writeUint32_tLittleEndian(buffer, headerVersion);
+    writeUint32_tLittleEndian(buffer, headerPlatform);
+    writeUint32_tLittleEndian(buffer, headerNumberOfEvents);
+    writeUint32_tLittleEndian(buffer, headerMaxThreads);
+    writeUint32_tLittleEndian(buffer, headerMaxClasses);
+    writeUint32_tLittleEndian(buffer, headerTicksPerMicrosecond);
+    writeUint64_tLittleEndian(buffer, getTicks());
+    writeUint32_tLittleEndian(buffer, time(NULL));
+    writeUint32_tLittleEndian(buffer, time(NULL));
+    writeUint32_tLittleEndian(buffer, headerOverhead);
+
+    if (compactFormat) {
+        writeUint32_tLittleEndian(buffer, tickSource);
+        writeUint64_tLittleEndian(buffer, headerTicksPerSecond);
+    }
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
 
 
 void writeBeginBurst(Buffer *buffer) {
 
-    debug("Write Begin Burst\n")
+    debug("Write Begin Burst\n")
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint32_t);
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        flushFullBuffer(buffer);
+    }
+
+    writeUint8_t(buffer, EVENT_BEGIN_BURST);
+    writeUint64_t(buffer, getTicks());
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+    debug("Begin Burst written\n")
+
+}
+
+
+void writeEndBurst(Buffer *buffer) {
+
+    debug("Write End Burst\n")
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint32_t);
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        flushFullBuffer(buffer);
+    }
+
+    writeUint8_t(buffer, EVENT_END_BURST);
+    writeUint64_t(buffer, getTicks());
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
+
+
+void writeEndFile(Buffer *buffer) {
+
+    debug("Write End File\n")
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    uint32_t length = sizeof(uint8_t);
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        flushFullBuffer(buffer);
+    }
+
+    writeUint8_t(buffer, EVENT_END_FILE);
+    writeUint32_t(buffer, 5705);
+    writeUint32_t(buffer, 0xadde0000);
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
+
+
+void writeObject(Buffer *buffer, uint32_t objectID, uint16_t classID) {
+
+    debug("Write Object\n")
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t);
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        flushGlobalBuffer(false);
+    }
+
+    writeUint8_t(buffer, EVENT_OBJECT_DEFINE);
+    writeUint64_t(buffer, getTicks());
+    writeUint32_t(buffer, objectID);
+    writeUint16_t(buffer, classID);
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
+
+
+/*
+ * While a roll builds its carry buffer, whatever has been carried into the next file stays defined in the
+ * current one, so it is neither claimed nor written again there.
+ */
+static inline bool isDefined(volatile uint32_t *epochFlag, uint32_t epoch) {
+
+    uint32_t flag = *epochFlag;
+    uint32_t carrying = carryEpoch;
+
+    return flag == epoch || (carrying != 0 && flag == carrying);
+
+}
+
+
+static inline bool claimDefinition(volatile uint32_t *epochFlag, uint32_t epoch) {
+
+    uint32_t carrying = carryEpoch;
+
+    if (carrying != 0 && carrying != epoch && *epochFlag == carrying) {
+        return false;
+    }
+
+    return claimEpoch(epochFlag, epoch);
+
+}
+
+
+static void makeRoom(Buffer *buffer, uint32_t length) {
+
+    // The carry buffer must hold every definition of a roll, so it grows rather than being flushed
+
+    if (buffer != carryBuffer) {
+        flushGlobalBuffer(false);
+        return;
+    }
+
+    uint32_t bufferLength = buffer->bufferLength;
+
+    while (buffer->bufferOffset + length >= bufferLength) {
+        bufferLength *= 2;
+    }
+
+    uint8_t *grown = realloc(buffer->buffer, bufferLength);
+    if (grown <= 0) {
+        error("Unable to allocate buffer\n")
+        exit(-1);
+    }
+
+    buffer->buffer = grown;
+    buffer->bufferLength = bufferLength;
+
+}
+
+
+static void writeThreadRecord(Buffer *buffer, ThreadNode *threadNode, ClassNode *threadClassNode) {
+
+   if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    uint8_t *platformThreadName = JVMStringToPlatform(threadNode->name);
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t) + strlen((const char*) platformThreadName);
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        makeRoom(buffer, length);
+    }
+
+    writeUint8_t(buffer, EVENT_THREAD_DEFINE);
+    writeUint64_t(buffer, getTicks());
+    writeUint32_t(buffer, threadNode->threadID);
+    writeUint32_t(buffer, 0);
+    writeUint16_t(buffer, threadClassNode->classID);
+    writeString(buffer, (char*) threadNode->name);
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
+
+
+void writeThreadDefine(Buffer *buffer, ThreadNode *threadNode) {
+
+    debug("Write Thread\n")
+
+    if (isDefined(&threadNode->epoch, traceEpoch)) {
+        return;
+    }
+
+    ClassNode *threadClassNode = getClassNode(platformStringToJVM("Ljava/lang/Thread;"));
+
+    ensureClassDefined(threadClassNode);
+
+    if (!claimDefinition(&threadNode->epoch, traceEpoch)) {
+        return;
+    }
+
+    writeThreadRecord(buffer, threadNode, threadClassNode);
+
+}
+
+
+void writeThreadExit(Buffer *buffer, uint32_t threadID, uint64_t ticks) {
+
+    debug("Write Thread Exit\n")
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t);
+
+    writeUint8_t(buffer, EVENT_THREAD_EXIT);
+    writeUint64_t(buffer, ticks);
+    writeUint32_t(buffer, threadID);
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        if (!asyncWriter) {
+            awaitResolver();
+            flushGlobalBuffer(true);
+        }
+        flushBuffer(buffer);
+    }
+
+    debug("Written Thread Exit\n")
+
+}
+
+
+void writeCompactMethodEntry(Buffer *buffer, uint32_t threadID, uint16_t classID, uint16_t methodID, uint32_t objectID, uint64_t ticks) {
+
+    if (buffer->shared) {
+       lock(&buffer->lock, false);
+    }
+
+    if (buffer->bufferOffset + COMPACT_MAX_RECORD_LENGTH >= buffer->bufferLength) {
+        flushFullBuffer(buffer);
+    }
+
+    bool hasObject = (objectID != (uint32_t) -1);
+
+    if (buffer->shared) {
+        writeUint8_t(buffer, hasObject ? EVENT_COMPACT_THREAD_METHOD_ENTER_OBJECT : EVENT_COMPACT_THREAD_METHOD_ENTER);
+        writeVarint(buffer, threadID);
+        writeVarint(buffer, ticks);
+    } else {
+        writeUint8_t(buffer, hasObject ? EVENT_COMPACT_METHOD_ENTER_OBJECT : EVENT_COMPACT_METHOD_ENTER);
+        writeTicksDelta(buffer, ticks);
+    }
+
+    writeVarint(buffer, classID);
+    writeVarint(buffer, methodID);
+
+    if (hasObject) {
+        writeVarint(buffer, objectID);
+    }
+
+    buffer->events++;
+
+    if (buffer->shared) {
+       unlock(&buffer->lock, false);
+    }
+
+}
+
+
+void writeCompactMethodExit(Buffer *buffer, uint32_t threadID, uint64_t exitStart, uint64_t entryOverhead) {
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    if (buffer->bufferOffset + COMPACT_MAX_RECORD_LENGTH >= buffer->bufferLength) {
+        flushFullBuffer(buffer);
+    }
+
+    if (buffer->shared) {
+        writeUint8_t(buffer, EVENT_COMPACT_THREAD_METHOD_LEAVE);
+        writeVarint(buffer, threadID);
+        writeVarint(buffer, exitStart);
+    } else {
+        writeUint8_t(buffer, EVENT_COMPACT_METHOD_LEAVE);
+        writeTicksDelta(buffer, exitStart);
+    }
+
+    writeVarint(buffer, (getTicks() - exitStart) + entryOverhead);
+
+    buffer->events++;
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
+
+
+void writeMethodEntry(Buffer *buffer, uint32_t threadID, uint16_t classID, uint16_t methodID, uint32_t objectID, uint64_t ticks) {
+
+    debug("Write Method Entry\n")
+
+    if (compactFormat) {
+        writeCompactMethodEntry(buffer, threadID, classID, methodID, objectID, ticks);
+        return;
+    }
+
+    if (buffer->shared) {
+       lock(&buffer->lock, false);
+    }
+
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t);
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        flushFullBuffer(buffer);
+    }
+
+    debug("Write Method Entry length: %d, from %d, to %d \n", length, buffer->bufferOffset, buffer->bufferOffset+length)
+
+    writeUint8_t(buffer, EVENT_WIDE_METHOD_ENTER);
+    writeUint64_t(buffer, ticks);
+    writeUint32_t(buffer, threadID);
+    writeUint16_t(buffer, classID);
+    writeUint16_t(buffer, methodID);
+    writeUint32_t(buffer, objectID);
+    writeUint16_t(buffer, 0);
+
+    buffer->events++;
+
+    if (buffer->shared) {
+       unlock(&buffer->lock, false);
+    }
+
+
+}
+
+void writeMethodExit(Buffer *buffer, uint32_t threadID, uint64_t exitStart, uint64_t entryOverhead) {
+
+    if (compactFormat) {
+        writeCompactMethodExit(buffer, threadID, exitStart, entryOverhead);
+        return;
+    }
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint32_t);
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        flushFullBuffer(buffer);
+    }
+
+    debug("Write Method Exit length: %d, from %d, to %d \n", length, buffer->bufferOffset, buffer->bufferOffset+length)
+
+    writeUint8_t(buffer, EVENT_METHOD_LEAVE);
+    writeUint64_t(buffer, exitStart);
+    writeUint64_t(buffer, ((getTicks() - exitStart) + entryOverhead));
+    writeUint32_t(buffer, threadID);
+
+    buffer->events++;
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
+
+
+void emitShadowFrames(Buffer *buffer, ThreadNode *threadNode, uint32_t depth) {
+
+    for (uint32_t i = threadNode->shadowEmitted; i < depth; i++) {
+        ShadowFrame *frame = &threadNode->shadowStack[i];
+        writeMethodEntry(buffer, threadNode->threadID, frame->classID, frame->methodID, frame->objectID, frame->ticks);
+    }
+
+    if (depth > threadNode->shadowEmitted) {
+        threadNode->shadowEmitted = depth;
+    }
+
+}
+
+
+void deferMethodEntry(Buffer *buffer, ThreadNode *threadNode, uint16_t classID, uint16_t methodID, uint32_t objectID, uint64_t ticks) {
+
+    uint32_t shadowPointer = threadNode->shadowPointer++;
+
+    if (shadowPointer >= SHADOW_STACK_DEPTH) {
+#ifdef __MVS__
+#pragma execution_frequency(very_low)
+#endif
+        emitShadowFrames(buffer, threadNode, SHADOW_STACK_DEPTH);
+        writeMethodEntry(buffer, threadNode->threadID, classID, methodID, objectID, ticks);
+        return;
+    }
+
+    ShadowFrame *frame = &threadNode->shadowStack[shadowPointer];
+    frame->ticks = ticks;
+    frame->objectID = objectID;
+    frame->classID = classID;
+    frame->methodID = methodID;
+
+}
+
+
+bool completeMethodExit(Buffer *buffer, ThreadNode *threadNode, uint64_t ticks) {
+
+    if (threadNode->shadowPointer == 0) {
+        return true;
+    }
+
+    uint32_t shadowPointer = --threadNode->shadowPointer;
+
+    if (shadowPointer >= SHADOW_STACK_DEPTH) {
+        return true;
+    }
+
+    if (shadowPointer < threadNode->shadowEmitted) {
+        threadNode->shadowEmitted = shadowPointer;
+        return true;
+    }
+
+    if (ticks - threadNode->shadowStack[shadowPointer].ticks < minDurationTicks) {
+        threadNode->shadowSuppressed++;
+        return false;
+    }
+
+    emitShadowFrames(buffer, threadNode, shadowPointer + 1);
+    threadNode->shadowEmitted = shadowPointer;
+
+    return true;
+
+}
+
+
+void writeStackSample(Buffer *buffer, uint32_t threadID, uint64_t ticks, uint32_t threadState, uint16_t depth, MethodIDNode **frames) {
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t) + depth * (sizeof(uint16_t) + sizeof(uint16_t));
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        flushGlobalBuffer(true);
+        flushBuffer(buffer);
+    }
+
+    writeUint8_t(buffer, EVENT_STACK_SAMPLE);
+    writeUint32_t(buffer, threadID);
+    writeUint64_t(buffer, ticks);
+    writeUint32_t(buffer, threadState);
+    writeUint16_t(buffer, depth);
+
+    for (int i = 0; i < depth; i++) {
+        writeUint16_t(buffer, frames[i]->classID);
+        writeUint16_t(buffer, frames[i]->methodID);
+    }
+
+    buffer->events++;
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
+
+
+void writeCallTree(Buffer *buffer, CallTree *callTree) {
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    if (buffer->bufferOffset + CALL_TREE_MAX_RECORD_LENGTH >= buffer->bufferLength) {
+        flushGlobalBuffer(false);
+    }
+
+    writeUint8_t(buffer, EVENT_CALL_TREE);
+    writeUint64_t(buffer, getTicks());
+    writeUint32_t(buffer, callTree->numberOfNodes);
+    writeVarint(buffer, callTree->root.numberOfChildren);
+
+    for (CallTreeNode *node = nextCallTreeNode(callTree, &callTree->root); node; node = nextCallTreeNode(callTree, node)) {
+
+        if (buffer->bufferOffset + CALL_TREE_MAX_RECORD_LENGTH >= buffer->bufferLength) {
+            flushGlobalBuffer(false);
+        }
+
+        writeVarint(buffer, node->classID);
+        writeVarint(buffer, node->methodID);
+        writeVarint(buffer, node->numberOfChildren);
+        writeVarint(buffer, node->calls);
+        writeVarint(buffer, node->inclusiveTicks);
+        writeVarint(buffer, (node->childTicks < node->inclusiveTicks) ? node->inclusiveTicks - node->childTicks : 0);
+
+    }
+
+    buffer->events++;
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+}
+
+
+void calibrateOverhead() {
+
+    Buffer *buffer = allocateBuffer(THREAD_BUFFER_LENGTH, false);
+
+    if (buffer <= 0) {
+        return;
+    }
+
+    uint64_t best = UINT64_MAX;
+
+    for (int round = 0; round < CALIBRATION_ROUNDS; round++) {
+
+        uint64_t roundStart = getTicks();
+
+        for (int i = 0; i < CALIBRATION_LOOPS; i++) {
+
+            buffer->bufferOffset = 0;
+
+            uint64_t start = getTicks();
+            writeMethodEntry(buffer, 1, 1, 1, (uint32_t) -1, start);
+            uint64_t entryOverhead = getTicks() - start;
+
+            writeMethodExit(buffer, 1, getTicks(), entryOverhead);
+
+        }
+
+        uint64_t roundTicks = (getTicks() - roundStart) / CALIBRATION_LOOPS;
+
+        if (roundTicks < best) {
+            best = roundTicks;
+        }
+
+    }
+
+    freeBuffer(buffer);
+
+    headerOverhead = (uint32_t) best;
+
+    info("Calibrated overhead: %d ticks per entry/exit pair\n", headerOverhead)
+
+}
+
+
+static inline uint32_t classStringLength(uint8_t *string, uint32_t epoch) {
+
+    if (!internStrings) {
+        return sizeof(uint16_t) + strlen((const char*) string);
+    }
+
+    uint32_t length = VARINT_MAX_LENGTH;
+
+    if (string && !isDefined(&getInternedString(string)->epoch, epoch)) {
+        length += sizeof(uint8_t) + sizeof(uint32_t) + sizeof(uint16_t) + getInternedString(string)->length;
+    }
+
+    return length;
+
+}
+
+
+static inline void writeStringDefine(Buffer *buffer, uint8_t *string, uint32_t epoch) {
+
+    if (string == NULL || !claimDefinition(&getInternedString(string)->epoch, epoch)) {
+        return;
+    }
+
+    writeUint8_t(buffer, EVENT_STRING_DEFINE);
+    writeUint32_t(buffer, getInternedString(string)->stringID);
+    writeString(buffer, (char*) string);
+
+}
+
+
+static inline void writeClassString(Buffer *buffer, uint8_t *string) {
+
+    if (internStrings) {
+        writeVarint(buffer, string ? getInternedString(string)->stringID : 0);
+    } else {
+        writeString(buffer, (char*) string);
+    }
+
+}
+
+
+static void writeClassDefine(Buffer *buffer, ClassNode *classNode, uint32_t epoch) {
+
+    if (classNode == NULL) {
+        return;
+    }
+
+    if (!claimDefinition(&classNode->epoch, epoch)) {
+        debug("already written\n")
+        return;
+    }
+
+    if (buffer->shared) {
+        lock(&buffer->lock, false);
+    }
+
+    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint16_t) + sizeof(uint32_t);
+    length += sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint16_t) + sizeof(uint16_t);
+    uint8_t *platformProfilerName = JVMStringToPlatform(classNode->profilerName);
+
+    debug("writeClass: platformProfilerName: %s\n", platformProfilerName)
+
+    length += sizeof(uint16_t) + strlen((const char*) classNode->profilerName);
+
+    length += sizeof(uint16_t);
+
+    for (int i = 0; i < classNode->numberOfMethods; i++) {
+
+        MethodInfo methodInfo = classNode->methods[i];
+        length += classStringLength(methodInfo.name, epoch);
+        length += classStringLength(methodInfo.signature, epoch);
+        length += sizeof(uint16_t);
+
+    }
+
+    length += sizeof(uint16_t);
+
+    for (int i = 0; i < classNode->numberOfFields; i++) {
+
+        FieldInfo fieldInfo = classNode->fields[i];
+        length += classStringLength(fieldInfo.name, epoch);
+        length += classStringLength(fieldInfo.signature, epoch);
+        length += sizeof(uint16_t);
+
+    }
+
+    length += sizeof(uint16_t);
+
+    length += sizeof(uint16_t) * classNode->numberOfInterfaces;
+
+    if (buffer->bufferOffset + length >= buffer->bufferLength) {
+        makeRoom(buffer, length);
+    }
+
+    bool hugeClass = false;
+
+    if (length > buffer->bufferLength)
+        hugeClass = true;
+
+    debug("Writing Class %s length: %d, from %d, to %d, on thread %d\n", JVMStringToPlatform(classNode->name), length, buffer->bufferOffset, buffer->bufferOffset+length, pthread_self())
+
+    uint32_t originalBufferOffset = buffer->bufferOffset;
+
+    if (internStrings) {
+
+        // Each string is defined once per trace file, ahead of the first class that refers to it
+
+        for (int i = 0; i < classNode->numberOfMethods; i++) {
+
+            writeStringDefine(buffer, classNode->methods[i].name, epoch);
+            writeStringDefine(buffer, classNode->methods[i].signature, epoch);
+
+            if (hugeClass) {
+                if (buffer->bufferOffset + 1024 >= buffer->bufferLength) {
+                    makeRoom(buffer, 1024);
+                }
+            }
+        }
+
+        for (int i = 0; i < classNode->numberOfFields; i++) {
+
+            writeStringDefine(buffer, classNode->fields[i].name, epoch);
+            writeStringDefine(buffer, classNode->fields[i].signature, epoch);
+
+            if (hugeClass) {
+                if (buffer->bufferOffset + 1024 >= buffer->bufferLength) {
+                    makeRoom(buffer, 1024);
+                }
+            }
+        }
+
+    }
+
+    uint64_t ticks = getTicks();
+
+    writeUint8_t(buffer, EVENT_CLASS_DEFINE);
+    writeUint64_t(buffer, ticks);
+    writeUint16_t(buffer, classNode->classID);
+    writeUint32_t(buffer, 0);
+
+    writeUint8_t(buffer, internStrings ? EVENT_INTERNED_CLASS_LOAD : EVENT_EXTENDED_EXTENSIVE_CLASS_LOAD);
+    writeUint64_t(buffer, ticks);
+    writeUint16_t(buffer, classNode->classID);
+    writeUint16_t(buffer, 0);
+
+    writeString(buffer, (char*) classNode->profilerName);
+
+    writeUint16_t(buffer, classNode->numberOfMethods);
+
+    for (int i = 0; i < classNode->numberOfMethods; i++) {
+
+        MethodInfo methodInfo = classNode->methods[i];
+        writeClassString(buffer, methodInfo.name);
+        writeClassString(buffer, methodInfo.signature);
+        writeUint16_t(buffer, methodInfo.modifiers);
+
+        if (hugeClass) {
+            if (buffer->bufferOffset + 1024 >= buffer->bufferLength) {
+                makeRoom(buffer, 1024);
+            }
+        }
+    }
+
+    writeUint16_t(buffer, classNode->numberOfFields);
+
+    for (int i = 0; i < classNode->numberOfFields; i++) {
+
+        FieldInfo fieldInfo = classNode->fields[i];
+        writeClassString(buffer, fieldInfo.name);
+        writeClassString(buffer, fieldInfo.signature);
+        writeUint16_t(buffer, fieldInfo.modifiers);
+
+        if (hugeClass) {
+            if (buffer->bufferOffset + 1024 >= buffer->bufferLength) {
+                makeRoom(buffer, 1024);
+            }
+        }
+
+    }
+
+    writeUint16_t(buffer, classNode->superClassID);
+
+    writeUint16_t(buffer, classNode->numberOfInterfaces);
+
+    for (int i = 0; i < classNode->numberOfInterfaces; i++) {
+
+        InterfaceInfo interfaceInfo = classNode->interfaces[i];
+        writeUint16_t(buffer, interfaceInfo.classID);
+
+    }
+
+    if (buffer->shared) {
+        unlock(&buffer->lock, false);
+    }
+
+    debug("Written Class %s length: %d, from %d, to %d, now %d, on thread %d\n", JVMStringToPlatform(classNode->name), length, originalBufferOffset, originalBufferOffset+length, buffer->bufferOffset, pthread_self())
+
+}
+
+
+void writeClass(Buffer *buffer, ClassNode *classNode) {
+
+    writeClassDefine(buffer, classNode, traceEpoch);
+
+}
+
+
+void ensureClassDefined(ClassNode *classNode) {
+
+    if (classNode <= 0 || isDefined(&classNode->epoch, traceEpoch) || !classNode->resolved) {
+        return;
+    }
+
+    ensureClassDefined(classNode->superClass);
+
+    for (int i = 0; i < classNode->numberOfInterfaces; i++) {
+        ensureClassDefined(classNode->interfaces[i].classNode);
+    }
+
+    writeClass(globalBuffer, classNode);
+
+}
+
+
+static inline bool usesMethodEvents() {
+
+    return profilingMode == MODE_TRACE || profilingMode == MODE_CCT || profilingMode == MODE_FLIGHT;
+
+}
+
+
+void enableMainProfilingEvents(jvmtiEnv *jvmtiInterface) {
+
+    jvmtiError returnCode;
+
+    if (usesMethodEvents()) {
+
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to enable event notification, JVMTI_EVENT_METHOD_ENTRY (%d)\n", returnCode)
+        }
+
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_METHOD_EXIT, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to enable event notification, JVMTI_EVENT_METHOD_EXIT (%d)\n", returnCode)
+        }
+
+    }
+
+
+    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL);
+    if (returnCode != JNI_OK) {
+        error("Unable to enable event notification, JVMTI_EVENT_THREAD_END (%d)\n", returnCode)
+    }
+
+}
+
+
+void disableMainProfilingEvents(jvmtiEnv *jvmtiInterface) {
+
+    jvmtiError returnCode;
+
+    if (usesMethodEvents()) {
+
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to disable event notification, JVMTI_EVENT_METHOD_ENTRY (%d)\n", returnCode)
+        }
+
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_METHOD_EXIT, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to disable event notification, JVMTI_EVENT_METHOD_EXIT (%d)\n", returnCode)
+        }
+
+    }
+
+    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL);
+    if (returnCode != JNI_OK) {
+        error("Unable to disable event notification, JVMTI_EVENT_THREAD_END (%d)\n", returnCode)
+    }
+
+}
+
+
+bool isInstrumentedFrame(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jmethodID method) {
+
+    MethodIDNode *methodIDNode = getMethodIDNode(method);
+
+    if (methodIDNode <= 0) {
+        jclass declaringClass;
+        (*jvmtiInterface)->GetMethodDeclaringClass(jvmtiInterface, method, &declaringClass);
+        discoverClass(jvmtiInterface, jni_env, declaringClass);
+        methodIDNode = getMethodIDNode(method);
+    }
+
+    return (methodIDNode > 0) && methodIDNode->instrumented;
+
+}
+
+
+void unwindStacks(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jint numberOfThreads, jthread *threads) {
+
+    // A call tree is only changed by its own thread, writeCallTrees counts the open frames instead
+
+    if (profilingMode == MODE_SAMPLE || profilingMode == MODE_CCT) {
+        return;
+    }
+
+    debug("Starting to unwind stacks\n")
+
+    jvmtiError returnCode;
+    jint maxNumberOfFrames = 2048;
+    jvmtiStackInfo *stackInfo = NULL;
+
+ //   lock(&globalBuffer->lock, false);
+
+    returnCode = (*jvmtiInterface)->GetThreadListStackTraces(jvmtiInterface, numberOfThreads, threads, maxNumberOfFrames, &stackInfo);
+    if (returnCode != JNI_OK) {
+        error("Unable to get Thread Stack traces (%d)\n", returnCode)
+    }
+
+    debug("Number of threads, %d\n", numberOfThreads)
+
+    for (int i = 0; i < numberOfThreads; i++) {
+
+        jthread thread = stackInfo[i].thread;
+        jint numberOfFrames = stackInfo[i].frame_count;
+        jvmtiFrameInfo *frameInfo = stackInfo[i].frame_buffer;
+
+        debug("Thread %d, Number of Frames, %d\n", i, numberOfFrames)
+
+        for (int j = 0; j < numberOfFrames; j++) {
+            jmethodID method = frameInfo[j].method;
+            jvalue value;
+            if (profilingMode == MODE_INSTRUMENT && !isInstrumentedFrame(jvmtiInterface, jni_env, method)) {
+                continue;
+            }
+            MethodExitInternal(jvmtiInterface, jni_env, thread, method, JNI_FALSE, value, globalBuffer);
+
+        }
+
+    }
+//    unlock(&globalBuffer->lock, false);
+
+    debug("Finished unwinding stacks\n")
+
+}
+
+
+void windStacks(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jint numberOfThreads, jthread *threads) {
+
+    // A call tree is only changed by its own thread, which winds its stack when it renews the tree
+
+    if (profilingMode == MODE_SAMPLE || profilingMode == MODE_CCT) {
+        return;
+    }
+
+    debug("Starting to wind stacks\n")
+
+    jvmtiError returnCode;
+    jint maxNumberOfFrames = 2048;
+    jvmtiStackInfo *stackInfo = NULL;
+
+    //lock(&globalBuffer->lock, false);
+
+    returnCode = (*jvmtiInterface)->GetThreadListStackTraces(jvmtiInterface, numberOfThreads, threads, maxNumberOfFrames, &stackInfo);
+
+    if (returnCode != JNI_OK) {
+        error("Unable to get Thread Stack traces (%d)\n", returnCode)
+    }
+
+    debug("Number of threads %d\n", numberOfThreads)
+
+    for (int i = 0; i < numberOfThreads; i++) {
+
+        jthread thread = stackInfo[i].thread;
+        jint numberOfFrames = stackInfo[i].frame_count;
+        jvmtiFrameInfo *frameInfo = stackInfo[i].frame_buffer;
+
+        debug("Thread %d, Number of Frames, %d\n", i, numberOfFrames)
+
+        for (int j = numberOfFrames - 1; j >= 0; j--) {
+            jmethodID method = frameInfo[j].method;
+            if (profilingMode == MODE_INSTRUMENT && !isInstrumentedFrame(jvmtiInterface, jni_env, method)) {
+                continue;
+            }
+            MethodEntryInternal(jvmtiInterface, jni_env, thread, method, globalBuffer);
+
+        }
+
+    }
+
+   // unlock(&globalBuffer->lock, false);
+
+    debug("Finished winding stacks\n")
+
+}
+
+
+void mergeThreadCallTree(ThreadNode *threadNode, void *arg) {
+
+    CallTreeMerge *merge = (CallTreeMerge*) arg;
+    CallTree *callTree = threadNode->callTree;
+
+    // A tree still of an earlier generation has recorded nothing since it was written, and its owner may be emptying it
+
+    if (callTree && callTree->generation == merge->generation) {
+        mergeCallTree(merge->target, callTree);
+        mergeOpenCallTreeFrames(merge->target, callTree, merge->ticks);
+    }
+
+}
+
+
+/*
+ * Writes the call trees of all threads merged into one, the frames still open counted up to now. Only the thread
+ * that owns a tree ever changes or frees its nodes, so a reset moves the generation on and each thread empties its
+ * own tree at its next event, and no stacks are wound or unwound into the trees from other threads.
+ */
+void writeCallTrees(bool reset) {
+
+    if (profilingMode != MODE_CCT) {
+        return;
+    }
+
+    awaitResolver();
+
+    CallTree *callTree = createCallTree();
+
+    if (callTree == NULL) {
+        return;
+    }
+
+    lock(&callTreeLock, false);
+
+    CallTreeMerge merge;
+    merge.target = callTree;
+    merge.generation = callTreeGeneration;
+    merge.ticks = getTicks();
+
+    forEachThreadNode(mergeThreadCallTree, &merge);
+
+    if (reset) {
+        memoryBarrier();
+        atomicIncrement(&callTreeGeneration);
+    }
+
+    unlock(&callTreeLock, false);
+
+    writeCallTree(globalBuffer, callTree);
+
+    info("Call Tree Nodes %d\n", callTree->numberOfNodes)
+
+    freeCallTree(callTree);
+
+}
+
+
+static void renewCallTree(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, ThreadNode *threadNode, uint32_t generation, jint depth, uint64_t ticks) {
+
+    CallTree *callTree = threadNode->callTree;
+
+    resetCallTree(callTree);
+
+    // The frames the thread is already in, below the one of the event, are entered again as windStacks would
+
+    jvmtiFrameInfo *frames = calloc(CALL_TREE_WIND_DEPTH, sizeof(jvmtiFrameInfo));
+    jint numberOfFrames = 0;
+
+    if (frames <= 0) {
+        error("Unable to allocate frames\n")
+    } else if ((*jvmtiInterface)->GetStackTrace(jvmtiInterface, NULL, depth, CALL_TREE_WIND_DEPTH, frames, &numberOfFrames) == JVMTI_ERROR_NONE) {
+
+        for (jint i = numberOfFrames - 1; i >= 0; i--) {
+
+            MethodIDNode *methodIDNode = lookupMethodIDNode(jvmtiInterface, jni_env, threadNode, frames[i].method, true);
+
+            if (methodIDNode > 0 && !methodIDNode->filtered) {
+                callTreeEnter(callTree, methodIDNode->classID, methodIDNode->methodID, ticks);
+            }
+
+        }
+
+    }
+
+    free(frames);
+
+    memoryBarrier();
+
+    callTree->generation = generation;
+
+}
+
+
+void sampleStacks(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env) {
+
+    jvmtiError returnCode;
+    jint numberOfThreads;
+    jthread *threads = NULL;
+    jvmtiStackInfo *stackInfo = NULL;
+
+    if ((*jni_env)->PushLocalFrame(jni_env, 64) != JNI_OK) {
+        error("Unable to push a local frame for sampling\n")
+        return;
+    }
+
+    lock(&writerLock, false);
+
+    if (isLocked(&profiling)) {
+
+        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
+
+        returnCode = (*jvmtiInterface)->GetThreadListStackTraces(jvmtiInterface, numberOfThreads, threads, sampleDepth, &stackInfo);
+
+        if (returnCode != JNI_OK) {
+            error("Unable to get Thread Stack traces (%d)\n", returnCode)
+        } else {
+
+            uint64_t ticks = getTicks();
+
+            for (int i = 0; i < numberOfThreads; i++) {
+
+                jint numberOfFrames = stackInfo[i].frame_count;
+                jvmtiFrameInfo *frameInfo = stackInfo[i].frame_buffer;
+
+                if (numberOfFrames <= 0) {
+                    continue;
+                }
+
+                ThreadNode *threadNode = NULL;
+
+                (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, stackInfo[i].thread, (void **) &threadNode);
+
+                if (threadNode == NULL) {
+                    threadNode = discoverThread(jvmtiInterface, stackInfo[i].thread);
+                }
+
+                if (threadNode == NULL || threadNode->threadID == -1) {
+                    continue;
+                }
+
+                writeThreadDefine(globalBuffer, threadNode);
+
+                uint16_t depth = 0;
+
+                for (int j = 0; j < numberOfFrames; j++) {
+
+                    MethodIDNode *methodIDNode = lookupMethodIDNode(jvmtiInterface, jni_env, samplerNode, frameInfo[j].method, false);
+
+                    if (methodIDNode > 0 && !methodIDNode->filtered) {
+                        sampleFrames[depth++] = methodIDNode;
+                    }
+
+                }
+
+                if (depth) {
+                    writeStackSample(samplerBuffer, threadNode->threadID, ticks, (uint32_t) stackInfo[i].state, depth, sampleFrames);
+                    samplesTaken++;
+                }
+
+            }
+
+            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) stackInfo);
+
+        }
+
+        if (threads) {
+            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) threads);
+        }
+
+    }
+
+    unlock(&writerLock, false);
+
+    (*jni_env)->PopLocalFrame(jni_env, NULL);
+
+}
+
+
+void flushSamples(bool mustLock) {
+
+    if (samplerBuffer == NULL) {
+        return;
+    }
+
+    if (mustLock)
+        lock(&writerLock, false);
+
+    flushGlobalBuffer(true);
+    flushBuffer(samplerBuffer);
+
+    if (mustLock)
+        unlock(&writerLock, false);
+
+}
+
+
+void* stackSampler(void *arg) {
+
+    JavaVM *vm = (JavaVM*) arg;
+
+    JNIEnv *JNIInterface;
+
+    jint jniReturnCode;
+    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
+    if (jniReturnCode != JNI_OK) {
+        error("Unable to attach to the JVM, sampler unavailable (%d)\n", (uint32_t) jniReturnCode)
+        return NULL;
+    }
+
+    jvmtiError returnCode;
+    jthread currentThread;
+
+    returnCode = (*globalJVMTIInterface)->GetCurrentThread(globalJVMTIInterface, &currentThread);
+    if (returnCode != JNI_OK) {
+        error("Error getting the current thread, sampler unavailable (%d)\n", returnCode)
+        return NULL;
+    }
+
+    returnCode = (*globalJVMTIInterface)->SetThreadLocalStorage(globalJVMTIInterface, currentThread, samplerNode);
+    if (returnCode != JNI_OK) {
+        error("Error setting thread local storage, sampler unavailable (%d)\n", returnCode)
+        return NULL;
+    }
+
+    info("Starting the Sampler Thread, interval %d ms, depth %d\n", sampleInterval, sampleDepth)
+
+    while (samplerRunning) {
+
+        struct timespec ts;
+        ts.tv_sec = sampleInterval / 1000;
+        ts.tv_nsec = (sampleInterval % 1000) * 1000000;
+        nanosleep(&ts, NULL);
+
+        if (samplerRunning && isLocked(&profiling)) {
+            sampleStacks(globalJVMTIInterface, JNIInterface);
+        }
+
+    }
+
+    (*vm)->DetachCurrentThread(vm);
+
+    return NULL;
+
+}
+
+
+void startSampler() {
+
+    samplerNode = calloc(1, sizeof(ThreadNode));
+    sampleCapacity = sampleDepth;
+    sampleFrames = calloc(sampleCapacity, sizeof(MethodIDNode*));
+    samplerBuffer = allocateBuffer(SAMPLER_BUFFER_LENGTH, true);
+
+    if (samplerNode <= 0 || sampleFrames <= 0 || samplerBuffer <= 0) {
+        error("Unable to allocate the sampler\n")
+        exit(-1);
+    }
+
+    samplerNode->threadID = -1;
+
+    registerLock("samplerBuffer", &samplerBuffer->lock);
+
+    samplerRunning = true;
+
+    if (pthread_create(&samplerThread, NULL, stackSampler, (void*) jvm)) {
+        error("Unable to start the sampler thread (%s)\n", strerror(errno))
+        samplerRunning = false;
+    }
+
+}
+
+
+void stopSampler() {
+
+    if (samplerRunning) {
+        samplerRunning = false;
+        pthread_join(samplerThread, NULL);
+    }
+
+    flushSamples(true);
+
+}
+
+
+uint8_t* generateTraceFileName() {
+
+    uint8_t *traceFileName = NULL;
+
+    Option *traceFileNameOption = getOption("traceFileName");
+
+    if (traceFileNameOption != NULL) {
+
+        if (traceFileNameOption->optionValue != NULL) {
+
+            traceFileName = calloc(1, 512);
+            sprintf((char*) traceFileName, "%s-%d.trc",
+                    traceFileNameOption->optionValue,
+                    atomicIncrement(&traceFileNumber));
+
+            traceFileName = traceFileNameOption->optionValue;
+
+        }
+    }
+
+    if (traceFileName == NULL) {
+
+        traceFileName = calloc(1, 512);
+
+        if (traceFileName <= 0) {
+            error("cannot allocate traceFileNAme")
+            return NULL;
+        }
+
+#ifdef __WIN32__
+
+        char cwd[MAX_PATH];
+        char tempPath[MAX_PATH];
+
+        getcwd(cwd, PATH_MAX);
+
+        DWORD dwRetVal = 0;
+        dwRetVal = GetTempPath(MAX_PATH, tempPath);
+
+        if (dwRetVal > MAX_PATH || (dwRetVal == 0)) {
+            error("unable to get temp path\n")
+            sprintf((char*) traceFileName, "%s\\trace-%d-%d.trc", cwd, getpid(), atomicIncrement(&traceFileNumber));
+        } else {
+            sprintf((char*) traceFileName, "%strace-%d-%d.trc", tempPath, getpid(), atomicIncrement(&traceFileNumber));
+        }
+
+#endif
+#if defined __linux || defined __MVS__
+        lock(&fileLock, false);
+        sprintf((char*) traceFileName, "%s/trace-%d-%d.trc", traceDirectory, getpid(), atomicIncrement(&traceFileNumber));
+        unlock(&fileLock, false);
+#endif
+
+    }
+
+    return traceFileName;
+
+}
+
+void clearThreadLocalStorage(jvmtiEnv *jvmtiInterface, jint numberOfThreads, jthread *threads) {
+
+    atomicIncrement(&threadEpoch);
+
+    for (int i = 0; i < numberOfThreads; i++) {
+
+        ThreadNode *threadNode;
+
+        (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, threads[i], (void **) &threadNode);
+
+        if(threadNode) {
+
+            if (threadNode->threadID != -1) {
+
+                (*jvmtiInterface)->SetThreadLocalStorage(jvmtiInterface, threads[i], (const void*) NULL);
+
+            }
+
+        }
+
+    }
+
+}
+
+
+void resetRegistry(jvmtiEnv *jvmtiInterface) {
+
+    jint numberOfThreads;
+    jthread *threads;
+
+    getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
+    clearThreadLocalStorage(jvmtiInterface, numberOfThreads, threads);
+
+    forEachThreadNode(retireThreadEvents, NULL);
+
+    clearMethodIDHashtable();
+    clearClassHashtable();
+    clearThreadHashtable();
+    clearInternTable();
+    resetArena(metadataArena);
+
+    uniqueClassID = 1;
+    uniqueThreadID = 1;
+
+}
+
+
+static void carryClass(ClassNode *classNode, uint32_t epoch) {
+
+    // Only what the old file defined is carried, with superclasses and interfaces ahead of the class
+
+    if (classNode <= 0 || classNode->epoch != epoch) {
+        return;
+    }
+
+    carryClass(classNode->superClass, epoch);
+
+    for (int i = 0; i < classNode->numberOfInterfaces; i++) {
+        carryClass(classNode->interfaces[i].classNode, epoch);
+    }
+
+    writeClassDefine(carryBuffer, classNode, epoch + 1);
+
+}
+
 
-    if (buffer->shared) {
-        lock(&buffer->lock, false);
-    }
+static void carryClassNode(ClassNode *classNode, void *arg) {
 
-    uint32_t length = sizeof(uint8_t) + sizeof(uint32_t);
+    carryClass(classNode, *(uint32_t*) arg);
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
-        flushGlobalBuffer(false);
-        flushBuffer(buffer);
-    }
+}
 
-    writeUint8_t(buffer, EVENT_BEGIN_BURST);
-    writeUint64_t(buffer, getTicks());
 
-    if (buffer->shared) {
-        unlock(&buffer->lock, false);
+static void carryThreadNode(ThreadNode *threadNode, void *arg) {
+
+    uint32_t epoch = *(uint32_t*) arg;
+
+    if (threadNode->epoch == epoch && claimEpoch(&threadNode->epoch, epoch + 1)) {
+        writeThreadRecord(carryBuffer, threadNode, carryThreadClass);
     }
-    debug("Begin Burst written\n")
 
 }
 
 
-void writeEndBurst(Buffer *buffer) {
+/*
+ * Rolls to a new trace file while profiling carries on. Thread buffers still hold events written against
+ * the old file, so the classes and threads defined in it are defined again at the start of the new one
+ * before any thread buffer is written there. The definitions are built in a private buffer while flushes
+ * carry on into the old file, and only what was defined meanwhile is added once the flushes are held.
+ */
+void switchTraceFile() {
 
-    debug("Write End Burst\n")
+    lock(&writerLock, false);
 
-    if (buffer->shared) {
-        lock(&buffer->lock, false);
+    awaitResolver();
+
+    uint32_t epoch = traceEpoch;
+
+    carryBuffer = allocateBuffer(GLOBAL_BUFFER_LENGTH, false);
+    carryThreadClass = getClassNode(platformStringToJVM("Ljava/lang/Thread;"));
+    carryEpoch = epoch + 1;
+    memoryBarrier();
+
+    forEachClassNode(carryClassNode, &epoch);
+    forEachThreadNode(carryThreadNode, &epoch);
+
+    carryPending = true;
+    memoryBarrier();
+
+    while (flushesInProgress) {
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = 10000;
+        nanosleep(&ts, NULL);
     }
 
-    uint32_t length = sizeof(uint8_t) + sizeof(uint32_t);
+    uint8_t *traceFileName = generateTraceFileName();
+    Buffer *marker = allocateBuffer(ROLL_MARKER_LENGTH, false);
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
-        flushGlobalBuffer(false);
-        flushBuffer(buffer);
+    lock(&globalBuffer->lock, false);
+    lock(&fileLock, false);
+
+    writeOutput(globalBuffer->buffer, globalBuffer->bufferOffset);
+    globalBuffer->bufferOffset = 0;
+
+    writeEndFile(marker);
+    writeOutput(marker->buffer, marker->bufferOffset);
+    marker->bufferOffset = 0;
+
+    closeOutput();
+
+    openTraceFile((char*) traceFileName);
+
+    // Anything first defined in the old file while the carry buffer was built is carried now
+
+    forEachClassNode(carryClassNode, &epoch);
+    forEachThreadNode(carryThreadNode, &epoch);
+
+    if (isOutputOpen()) {
+        writeDefaultHeader(marker);
+        writeOutput(marker->buffer, marker->bufferOffset);
+        writeOutput(carryBuffer->buffer, carryBuffer->bufferOffset);
+    } else {
+        error("Unable to open trace file %s\n", traceFileName)
     }
 
-    writeUint8_t(buffer, EVENT_END_BURST);
-    writeUint64_t(buffer, getTicks());
+    atomicIncrement(&traceEpoch);
+    carryEpoch = 0;
 
-    if (buffer->shared) {
-        unlock(&buffer->lock, false);
+    unlock(&fileLock, false);
+    unlock(&globalBuffer->lock, false);
+
+    if (samplerNode) {
+        memset(samplerNode->methodCache, 0, sizeof(samplerNode->methodCache));
     }
 
+    memoryBarrier();
+    carryPending = false;
+
+    freeBuffer(marker);
+    freeBuffer(carryBuffer);
+    carryBuffer = NULL;
+
+    automaticRolls++;
+
+    unlock(&writerLock, false);
+
+    info("New Trace File: %s\n", traceFileName)
+
 }
 
 
-void writeEndFile(Buffer *buffer) {
+void* traceRoller(void *arg) {
 
-    debug("Write End File\n")
+    JavaVM *vm = (JavaVM*) arg;
 
-    if (buffer->shared) {
-        lock(&buffer->lock, false);
+    JNIEnv *JNIInterface;
+
+    jint jniReturnCode;
+    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
+    if (jniReturnCode != JNI_OK) {
+        error("Unable to attach to the JVM, automatic rolling unavailable (%d)\n", (uint32_t) jniReturnCode)
+        rollerRunning = false;
+        return NULL;
     }
 
-    uint32_t length = sizeof(uint8_t);
+    info("Starting the Roller Thread\n")
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
-        flushGlobalBuffer(false);
-        flushBuffer(buffer);
-    }
+    while (rollerRunning) {
 
-    writeUint8_t(buffer, EVENT_END_FILE);
-    writeUint32_t(buffer, 5705);
-    writeUint32_t(buffer, 0xadde0000);
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = ROLL_CHECK_MS * 1000000;
+        nanosleep(&ts, NULL);
+
+        if (rollInterval && time(NULL) - traceFileOpened >= rollInterval) {
+            rollRequested = true;
+        }
+
+        if (!rollRequested || !isLocked(&profiling)) {
+            continue;
+        }
+
+        rollRequested = false;
+
+        if (uniqueClassID >= REGISTRY_CLASS_ID_LIMIT) {
+            rollTraceFile(globalJVMTIInterface, JNIInterface);
+        } else {
+            switchTraceFile();
+        }
 
-    if (buffer->shared) {
-        unlock(&buffer->lock, false);
     }
 
+    (*vm)->DetachCurrentThread(vm);
+
+    return NULL;
+
 }
 
 
-void writeObject(Buffer *buffer, uint32_t objectID, uint16_t classID) {
+void startRoller() {
 
-    debug("Write Object\n")
+    rollerRunning = true;
 
-    if (buffer->shared) {
-        lock(&buffer->lock, false);
+    if (pthread_create(&rollerThread, NULL, traceRoller, (void*) jvm)) {
+        error("Unable to start the roller thread (%s)\n", strerror(errno))
+        rollerRunning = false;
     }
 
-    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t);
+}
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
-        flushGlobalBuffer(false);
+
+void stopRoller() {
+
+    if (rollerRunning) {
+        rollerRunning = false;
+        pthread_join(rollerThread, NULL);
+        info("Automatic Rolls: %d\n", automaticRolls)
     }
 
-    writeUint8_t(buffer, EVENT_OBJECT_DEFINE);
-    writeUint64_t(buffer, getTicks());
-    writeUint32_t(buffer, objectID);
-    writeUint16_t(buffer, classID);
+}
 
-    if (buffer->shared) {
-        unlock(&buffer->lock, false);
+
+static void reviveClassNode(ClassNode *classNode, void *arg) {
+
+    if (classNode->epoch) {
+        ensureClassDefined(classNode);
     }
 
 }
 
 
-void writeThreadDefine(Buffer *buffer, ThreadNode *threadNode) {
+static void reviveThreadNode(ThreadNode *threadNode, void *arg) {
 
-    debug("Write Thread\n")
+    ChunkRing *ring = threadNode->threadBuffer ? threadNode->threadBuffer->ring : NULL;
 
-   if (buffer->shared) {
-        lock(&buffer->lock, false);
+    if (ring && ring->head != ring->tail) {
+        writeThreadDefine(globalBuffer, threadNode);
     }
 
-    ClassNode *threadClassNode = getClassNode(platformStringToJVM("Ljava/lang/Thread;"));
+}
 
-    uint8_t *platformThreadName = JVMStringToPlatform(threadNode->name);
 
-    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t) + strlen((const char*) platformThreadName);
+static void dumpFlightRing(ThreadNode *threadNode, void *arg) {
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
-        flushGlobalBuffer(false); //TODO FIX ME!
+    ChunkRing *ring = threadNode->threadBuffer ? threadNode->threadBuffer->ring : NULL;
+
+    if (ring == NULL || ring->head == ring->tail) {
+        return;
     }
 
-    writeUint8_t(buffer, EVENT_THREAD_DEFINE);
-    writeUint64_t(buffer, getTicks());
-    writeUint32_t(buffer, threadNode->threadID);
-    writeUint32_t(buffer, 0);
-    writeUint16_t(buffer, threadClassNode->classID);
-    writeString(buffer, (char*) threadNode->name);
+    memoryBarrier();
+
+    lockFile();
+
+    for (uint32_t i = ring->head; i != ring->tail; i++) {
+
+        Chunk *chunk = &ring->chunks[i % ring->numberOfChunks];
+
+        size_t written = writeEventOutput(chunk->data, chunk->length);
+
+        *(uint64_t*) arg += written;
+
+        if (written != chunk->length) {
+            error("Mismatch between written (%d) and chunk length (%d)\n", (uint32_t) written, chunk->length)
+        }
 
-    if (buffer->shared) {
-        unlock(&buffer->lock, false);
     }
 
+    unlockFile();
+
 }
 
 
-void writeThreadExit(Buffer *buffer, uint32_t threadID, uint64_t ticks) {
+/*
+ * Writes the flight recorder rings to a new trace file: the header, the classes defined so far and the threads
+ * that have events in their ring, then each thread's chunks oldest first. The rings stand still while they are
+ * written, so events recorded meanwhile, and the chunk each thread was filling, are not in the dump.
+ */
+void dumpFlightRecorder() {
 
-    debug("Write Thread Exit\n")
+    if (profilingMode != MODE_FLIGHT) {
+        warn("Nothing to dump, the flight recorder needs mode=flight\n")
+        return;
+    }
 
-    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    lock(&writerLock, false);
 
-    writeUint8_t(buffer, EVENT_THREAD_EXIT);
-    writeUint64_t(buffer, ticks);
-    writeUint32_t(buffer, threadID);
+    awaitResolver();
+
+    flightDumping = true;
+    memoryBarrier();
+
+    while (flightPublishes) {
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = 10000;
+        nanosleep(&ts, NULL);
+    }
+
+    uint8_t *traceFileName = generateTraceFileName();
+    Buffer *marker = allocateBuffer(ROLL_MARKER_LENGTH, false);
+    uint64_t recorded = 0;
+
+    lock(&globalBuffer->lock, false);
+    lock(&fileLock, false);
+
+    globalBuffer->bufferOffset = 0;
+
+    openTraceFile((char*) traceFileName);
+
+    if (isOutputOpen()) {
+        writeDefaultHeader(marker);
+        writeOutput(marker->buffer, marker->bufferOffset);
+        marker->bufferOffset = 0;
+    }
+
+    atomicIncrement(&traceEpoch);
+
+    unlock(&fileLock, false);
+    unlock(&globalBuffer->lock, false);
+
+    if (isOutputOpen()) {
+
+        forEachClassNode(reviveClassNode, NULL);
+        forEachThreadNode(reviveThreadNode, NULL);
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
         flushGlobalBuffer(true);
-        flushBuffer(buffer);
+
+        forEachThreadNode(dumpFlightRing, &recorded);
+
+        lock(&globalBuffer->lock, false);
+        lock(&fileLock, false);
+
+        writeOutput(globalBuffer->buffer, globalBuffer->bufferOffset);
+        globalBuffer->bufferOffset = 0;
+
+        writeEndFile(marker);
+        writeOutput(marker->buffer, marker->bufferOffset);
+
+        closeOutput();
+
+        unlock(&fileLock, false);
+        unlock(&globalBuffer->lock, false);
+
+        flightDumps++;
+
+        info("Flight Recording: %s, %" PRIu64 " bytes of events, %d chunks overwritten, %d discarded\n", traceFileName, recorded, flightOverwrites, flightDiscards)
+
+    } else {
+        error("Unable to open trace file %s\n", traceFileName)
     }
 
-    debug("Written Thread Exit\n")
+    freeBuffer(marker);
+
+    memoryBarrier();
+    flightDumping = false;
+
+    unlock(&writerLock, false);
 
 }
 
 
-void writeMethodEntry(Buffer *buffer, uint32_t threadID, uint16_t classID, uint16_t methodID, uint32_t objectID, uint64_t ticks) {
+#if defined __linux || defined __MVS__
+static void requestFlightDump(int signal) {
 
-    debug("Write Method Entry\n")
+    flightDumpRequested = 1;
 
-    if (buffer->shared) {
-       lock(&buffer->lock, false);
-    }
+}
+#endif
 
 
-    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t) + sizeof(uint16_t);
+void* flightRecorder(void *arg) {
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
-        flushGlobalBuffer(false);
-        flushBuffer(buffer);
-    }
+    info("Starting the Flight Recorder Thread\n")
 
-    debug("Write Method Entry length: %d, from %d, to %d \n", length, buffer->bufferOffset, buffer->bufferOffset+length)
+    while (flightRunning) {
 
-    writeUint8_t(buffer, EVENT_WIDE_METHOD_ENTER);
-    writeUint64_t(buffer, ticks);
-    writeUint32_t(buffer, threadID);
-    writeUint16_t(buffer, classID);
-    writeUint16_t(buffer, methodID);
-    writeUint32_t(buffer, objectID);
-    writeUint16_t(buffer, 0);
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = FLIGHT_CHECK_MS * 1000000;
+        nanosleep(&ts, NULL);
+
+        if (flightDumpRequested) {
+            flightDumpRequested = 0;
+            dumpFlightRecorder();
+        }
 
+        if (flightStarved) {
+            flightStarved = false;
+            reclaimFlightRing();
+        }
 
-    if (buffer->shared) {
-       unlock(&buffer->lock, false);
     }
 
+    return NULL;
 
 }
 
-void writeMethodExit(Buffer *buffer, uint32_t threadID, uint64_t exitStart, uint64_t entryOverhead) {
 
-    if (buffer->shared) {
-        lock(&buffer->lock, false);
+void startFlightRecorder() {
+
+#if defined __linux || defined __MVS__
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestFlightDump;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+
+    if (sigaction(SIGURG, &action, NULL)) {
+        warn("Unable to handle SIGURG, dump with controller command 4 (%s)\n", strerror(errno))
+        return;
     }
 
-    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint64_t) + sizeof(uint32_t);
+    flightRunning = true;
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
-        flushGlobalBuffer(false);
-        flushBuffer(buffer);
+    if (pthread_create(&flightThread, NULL, flightRecorder, NULL)) {
+        error("Unable to start the flight recorder thread (%s)\n", strerror(errno))
+        flightRunning = false;
     }
+#endif
 
-    debug("Write Method Exit length: %d, from %d, to %d \n", length, buffer->bufferOffset, buffer->bufferOffset+length)
+}
 
-    writeUint8_t(buffer, EVENT_METHOD_LEAVE);
-    writeUint64_t(buffer, exitStart);
-    writeUint64_t(buffer, ((getTicks() - exitStart) + entryOverhead));
-    writeUint32_t(buffer, threadID);
 
-    if (buffer->shared) {
-        unlock(&buffer->lock, false);
+void stopFlightRecorder() {
+
+    if (flightRunning) {
+        flightRunning = false;
+        pthread_join(flightThread, NULL);
     }
 
+    info("Flight Recorder Dumps: %d, Rings Reclaimed: %d\n", flightDumps, flightReclaims)
+
 }
 
 
-void writeClass(Buffer *buffer, ClassNode *classNode) {
+void rollTraceFile(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env) {
 
-    if (classNode == NULL) {
+    if (profilingMode == MODE_FLIGHT) {
+        warn("There is no trace file to roll in flight mode, use command 4 to dump\n")
         return;
     }
 
-    if (alreadyWritten(&classNode->written)) {
-        warn("already written\n")
-        return;
-    }
+    // if already profiling stop profiling
+    //if (__sync_bool_compare_and_swap(&profiling, LOCKED, UNLOCKED)) {
+    if (unlockIfLocked(&profiling)) {
+
+        info("Stopping Profiling\n")
+        jint numberOfThreads;
+        jthread *threads;
 
-    if (buffer->shared) {
-        lock(&buffer->lock, false);
-    }
+        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
 
-    uint32_t length = sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint16_t) + sizeof(uint32_t);
-    length += sizeof(uint8_t) + sizeof(uint64_t) + sizeof(uint16_t) + sizeof(uint16_t);
-    uint8_t *platformProfilerName = JVMStringToPlatform(classNode->profilerName);
+        unwindStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
 
-    debug("writeClass: platformProfilerName: %s\n", platformProfilerName)
+        flushBuffers(jvmtiInterface, numberOfThreads, threads);
 
-    length += sizeof(uint16_t) + strlen((const char*) classNode->profilerName);
+        writeCallTrees(true);
 
-    length += sizeof(uint16_t);
+        writeEndBurst(globalBuffer);
 
-    for (int i = 0; i < classNode->numberOfMethods; i++) {
+        flushBuffer(globalBuffer);
 
-        MethodInfo methodInfo = classNode->methods[i];
-        length += sizeof(uint16_t) + strlen((const char*) methodInfo.name);
-        length += sizeof(uint16_t) + strlen((const char*) methodInfo.signature);
-        length += sizeof(uint16_t);
+        reportStatistics();
+
+        reportThreadStatistics(jvmtiInterface, numberOfThreads, threads);
 
     }
 
-    length += sizeof(uint16_t);
+// make sure we are not profiling
 
-    for (int i = 0; i < classNode->numberOfFields; i++) {
+    if (isUnlocked(&profiling)) {
+        //if (__sync_bool_compare_and_swap(&profiling, UNLOCKED, UNLOCKED)) {
 
-        FieldInfo fieldInfo = classNode->fields[i];
-        length += sizeof(uint16_t) + strlen((const char*) fieldInfo.name);
-        length += sizeof(uint16_t) + strlen((const char*) fieldInfo.signature);
-        length += sizeof(uint16_t);
+        lock(&writerLock, false);
 
-    }
+        writeEndFile(globalBuffer);
+        flushBuffer(globalBuffer);
 
-    length += sizeof(uint16_t);
+        closeOutput();
 
-    length += sizeof(uint16_t) * classNode->numberOfInterfaces;
+        uint8_t *traceFileName = generateTraceFileName();
 
-    if (buffer->bufferOffset + length >= buffer->bufferLength) {
-        flushGlobalBuffer(false);
-    }
+        openTraceFile((char*) traceFileName);
 
-    bool hugeClass = false;
+        info("New Trace File: %s\n", traceFileName)
 
-    if (length > buffer->bufferLength)
-        hugeClass = true;
+        if (!isOutputOpen()) {
+            error("Unable to open trace file %s\n", traceFileName)
+            unlock(&writerLock, false);
+            return;
+        }
 
-    debug("Writing Class %s length: %d, from %d, to %d, on thread %d\n", JVMStringToPlatform(classNode->name), length, buffer->bufferOffset, buffer->bufferOffset+length, pthread_self())
+        awaitResolver();
 
-    uint32_t originalBufferOffset = buffer->bufferOffset;
+        // Classes, methods and threads survive the roll, and are defined again in the new file when first referenced
 
-    uint64_t ticks = getTicks();
+        if (uniqueClassID >= REGISTRY_CLASS_ID_LIMIT) {
+            warn("Class ids running out, discarding the class registry\n")
+            resetRegistry(jvmtiInterface);
+        }
 
-    writeUint8_t(buffer, EVENT_CLASS_DEFINE);
-    writeUint64_t(buffer, ticks);
-    writeUint16_t(buffer, classNode->classID);
-    writeUint32_t(buffer, 0);
+        retiredEvents += globalBuffer->events;
 
-    writeUint8_t(buffer, EVENT_EXTENDED_EXTENSIVE_CLASS_LOAD);
-    writeUint64_t(buffer, ticks);
-    writeUint16_t(buffer, classNode->classID);
-    writeUint16_t(buffer, 0);
+        // Classes queued since awaitResolver are resolved into the new buffer once it is installed
 
-    writeString(buffer, (char*) classNode->profilerName);
+        lock(&resolvingLock, false);
 
-    writeUint16_t(buffer, classNode->numberOfMethods);
+        freeBuffer(globalBuffer);
 
-    for (int i = 0; i < classNode->numberOfMethods; i++) {
+        globalBuffer = allocateBuffer(GLOBAL_BUFFER_LENGTH, true);
+        registerLock("globalBuffer", &globalBuffer->lock);
 
-        MethodInfo methodInfo = classNode->methods[i];
-        writeString(buffer, (char*) methodInfo.name);
-        writeString(buffer, (char*) methodInfo.signature);
-        writeUint16_t(buffer, methodInfo.modifiers);
+        unlock(&resolvingLock, false);
 
-        if (hugeClass) {
-            if (buffer->bufferOffset + 1024 >= buffer->bufferLength) {
-                flushGlobalBuffer(false);
-            }
+        writeDefaultHeader(globalBuffer);
+
+        if (samplerNode) {
+            memset(samplerNode->methodCache, 0, sizeof(samplerNode->methodCache));
         }
-    }
 
-    writeUint16_t(buffer, classNode->numberOfFields);
+        atomicIncrement(&traceEpoch);
 
-    for (int i = 0; i < classNode->numberOfFields; i++) {
+        unlock(&writerLock, false);
 
-        FieldInfo fieldInfo = classNode->fields[i];
-        writeString(buffer, (char*) fieldInfo.name);
-        writeString(buffer, (char*) fieldInfo.signature);
-        writeUint16_t(buffer, fieldInfo.modifiers);
+        if (getClassNode(platformStringToJVM("Ljava/lang/Thread;")) == NULL) {
+            discoverClass(jvmtiInterface, jni_env, (*jni_env)->FindClass(jni_env, platformStringToJVM("java/lang/Thread")));
 
-        if (hugeClass) {
-            if (buffer->bufferOffset + 1024 >= buffer->bufferLength) {
-                flushGlobalBuffer(false);
-            }
         }
 
     }
 
-    writeUint16_t(buffer, classNode->superClassID);
+    //if (__sync_bool_compare_and_swap(&profiling, UNLOCKED, LOCKED)) {
+    if (lockIfUnlocked(&profiling)) {
+        info("Starting Profiling\n")
 
-    writeUint16_t(buffer, classNode->numberOfInterfaces);
+        jint numberOfThreads;
+        jthread *threads;
 
-    for (int i = 0; i < classNode->numberOfInterfaces; i++) {
+        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
 
-        InterfaceInfo interfaceInfo = classNode->interfaces[i];
-        writeUint16_t(buffer, interfaceInfo.classID);
+        writeBeginBurst(globalBuffer);
 
-    }
+        windStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
 
-    if (buffer->shared) {
-        unlock(&buffer->lock, false);
     }
 
-    debug("Written Class %s length: %d, from %d, to %d, now %d, on thread %d\n", JVMStringToPlatform(classNode->name), length, originalBufferOffset, originalBufferOffset+length, buffer->bufferOffset, pthread_self())
-
 }
 
 
-void enableMainProfilingEvents(jvmtiEnv *jvmtiInterface) {
-
-    jvmtiError returnCode;
+void startProfiling(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env) {
 
-    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread) NULL);
-    if (returnCode != JNI_OK) {
-        error("Unable to enable event notification, JVMTI_EVENT_METHOD_ENTRY (%d)\n", returnCode)
-    }
+    info("Starting profiling\n")
 
-    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_METHOD_EXIT, (jthread) NULL);
-    if (returnCode != JNI_OK) {
-        error("Unable to enable event notification, JVMTI_EVENT_METHOD_EXIT (%d)\n", returnCode)
-    }
+    //   if (__sync_bool_compare_and_swap(&profiling, UNLOCKED, LOCKED)) {
+    if (lockIfUnlocked(&profiling)) {
 
+        info("Profiling was not active, really starting\n")
 
-    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL);
-    if (returnCode != JNI_OK) {
-        error("Unable to enable event notification, JVMTI_EVENT_THREAD_END (%d)\n", returnCode)
-    }
+        startProfilingTime = getTicks();
 
-}
+        writeBeginBurst(globalBuffer);
 
+        jint numberOfThreads;
+        jthread *threads;
 
-void disableMainProfilingEvents(jvmtiEnv *jvmtiInterface) {
+        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
 
-    jvmtiError returnCode;
+        windStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
 
-    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread) NULL);
-    if (returnCode != JNI_OK) {
-        error("Unable to disable event notification, JVMTI_EVENT_METHOD_ENTRY (%d)\n", returnCode)
-    }
+        flushGlobalBuffer(true);
 
-    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_METHOD_EXIT, (jthread) NULL);
-    if (returnCode != JNI_OK) {
-        error("Unable to disable event notification, JVMTI_EVENT_METHOD_EXIT (%d)\n", returnCode)
-    }
+        enableMainProfilingEvents(jvmtiInterface);
 
-    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL);
-    if (returnCode != JNI_OK) {
-        error("Unable to disable event notification, JVMTI_EVENT_THREAD_END (%d)\n", returnCode)
-    }
+        info("Started profiling\n")
 
-}
+    } else {
 
+        info("Already profiling\n")
 
-void unwindStacks(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jint numberOfThreads, jthread *threads) {
+    }
 
-    debug("Starting to unwind stacks\n")
+}
 
-    jvmtiError returnCode;
-    jint maxNumberOfFrames = 2048;
-    jvmtiStackInfo *stackInfo = NULL;
 
- //   lock(&globalBuffer->lock, false);
+void stopProfiling(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env) {
 
-    returnCode = (*jvmtiInterface)->GetThreadListStackTraces(jvmtiInterface, numberOfThreads, threads, maxNumberOfFrames, &stackInfo);
-    if (returnCode != JNI_OK) {
-        error("Unable to get Thread Stack traces (%d)\n", returnCode)
-    }
+    info("Stopping Profiling\n")
 
-    debug("Number of threads, %d\n", numberOfThreads)
+    //   if (__sync_bool_compare_and_swap(&profiling, LOCKED, UNLOCKED)) {
+    if (unlockIfLocked(&profiling)) {
 
-    for (int i = 0; i < numberOfThreads; i++) {
+        stopProfilingTime = getTicks();
 
-        jthread thread = stackInfo[i].thread;
-        jint numberOfFrames = stackInfo[i].frame_count;
-        jvmtiFrameInfo *frameInfo = stackInfo[i].frame_buffer;
+        disableMainProfilingEvents(jvmtiInterface);
 
-        debug("Thread %d, Number of Frames, %d\n", i, numberOfFrames)
+        flushGlobalBuffer(true);
 
-        for (int j = 0; j < numberOfFrames; j++) {
-            jmethodID method = frameInfo[j].method;
-            jvalue value;
-            MethodExitInternal(jvmtiInterface, jni_env, thread, method, JNI_FALSE, value, globalBuffer);
+        jint numberOfThreads;
+        jthread *threads;
 
-        }
+        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
 
-    }
-//    unlock(&globalBuffer->lock, false);
+        flushBuffers(jvmtiInterface, numberOfThreads, threads);
 
-    debug("Finished unwinding stacks\n")
+        unwindStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
 
-}
+        writeCallTrees(true);
 
+        writeEndBurst(globalBuffer);
 
-void windStacks(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jint numberOfThreads, jthread *threads) {
+        flushGlobalBuffer(true);
 
-    debug("Starting to wind stacks\n")
+        reportStatistics();
 
-    jvmtiError returnCode;
-    jint maxNumberOfFrames = 2048;
-    jvmtiStackInfo *stackInfo = NULL;
+        reportThreadStatistics(jvmtiInterface, numberOfThreads, threads);
 
-    //lock(&globalBuffer->lock, false);
+        uint64_t profilingTime = (stopProfilingTime-startProfilingTime);
 
-    returnCode = (*jvmtiInterface)->GetThreadListStackTraces(jvmtiInterface, numberOfThreads, threads, maxNumberOfFrames, &stackInfo);
+        uint64_t tagObjectsPercent = tagObjectsCost/(profilingTime/100);
 
-    if (returnCode != JNI_OK) {
-        error("Unable to get Thread Stack traces (%d)\n", returnCode)
-    }
+        info("Profiling Time %" PRIu64 "\n", profilingTime)
 
-    debug("Number of threads %d\n", numberOfThreads)
+        info("TagObjects Cost %" PRIu64 "\n", tagObjectsCost)
 
-    for (int i = 0; i < numberOfThreads; i++) {
+        info("TagObjects percent %" PRIu64 "\n", tagObjectsPercent)
 
-        jthread thread = stackInfo[i].thread;
-        jint numberOfFrames = stackInfo[i].frame_count;
-        jvmtiFrameInfo *frameInfo = stackInfo[i].frame_buffer;
+        if (profilingMode == MODE_SAMPLE) {
+            info("Stack Samples %" PRIu64 "\n", samplesTaken)
+        }
 
-        debug("Thread %d, Number of Frames, %d\n", i, numberOfFrames)
+        if (profilingMode == MODE_INSTRUMENT) {
+            info("Instrumented Methods %d\n", getNumberOfHooks())
+        }
 
-        for (int j = numberOfFrames - 1; j >= 0; j--) {
-            jmethodID method = frameInfo[j].method;
-            MethodEntryInternal(jvmtiInterface, jni_env, thread, method, globalBuffer);
+    } else {
 
-        }
+        info("Not currently profiling\n")
 
     }
 
-   // unlock(&globalBuffer->lock, false);
+}
 
-    debug("Finished winding stacks\n")
 
-}
+static void setTriggerEvents(jvmtiEnv *jvmtiInterface, jvmtiEventMode mode, jthread thread) {
 
+    jvmtiError returnCode;
 
-uint8_t* generateTraceFileName() {
+    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, mode, JVMTI_EVENT_METHOD_ENTRY, thread);
+    if (returnCode != JNI_OK) {
+        error("Unable to set event notification for the trigger thread, JVMTI_EVENT_METHOD_ENTRY (%d)\n", returnCode)
+    }
 
-    uint8_t *traceFileName = NULL;
+    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, mode, JVMTI_EVENT_METHOD_EXIT, thread);
+    if (returnCode != JNI_OK) {
+        error("Unable to set event notification for the trigger thread, JVMTI_EVENT_METHOD_EXIT (%d)\n", returnCode)
+    }
 
-    Option *traceFileNameOption = getOption("traceFileName");
+}
 
-    if (traceFileNameOption != NULL) {
 
-        if (traceFileNameOption->optionValue != NULL) {
+static void setTriggerPops(jvmtiEnv *jvmtiInterface, jvmtiEventMode mode) {
 
-            traceFileName = calloc(1, 512);
-            sprintf((char*) traceFileName, "%s-%d.trc",
-                    traceFileNameOption->optionValue,
-                    atomicIncrement(&traceFileNumber));
+    // FRAME_POP keeps a thread interpreted while it is enabled, so only the window's threads have it, and only while it is open
 
-            traceFileName = traceFileNameOption->optionValue;
+    jthread thread = triggerAllThreads ? (jthread) NULL : triggerThread;
 
-        }
+    jvmtiError returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, mode, JVMTI_EVENT_FRAME_POP, thread);
+    if (returnCode != JNI_OK) {
+        error("Unable to set event notification for the trigger window, JVMTI_EVENT_FRAME_POP (%d)\n", returnCode)
     }
 
-    if (traceFileName == NULL) {
-
-        traceFileName = calloc(1, 512);
+}
 
-        if (traceFileName <= 0) {
-            error("cannot allocate traceFileNAme")
-            return NULL;
-        }
 
-#ifdef __WIN32__
+static void countTriggerInvocation(jvmtiEnv *jvmtiInterface, jthread thread) {
 
-        char cwd[MAX_PATH];
-        char tempPath[MAX_PATH];
+    if (triggerStarted == triggerCount) {
+        return;
+    }
 
-        getcwd(cwd, PATH_MAX);
+    jvmtiError returnCode = (*jvmtiInterface)->NotifyFramePop(jvmtiInterface, thread, 0);
+    if (returnCode != JNI_OK) {
+        error("Unable to watch the trigger method return (%d)\n", returnCode)
+        return;
+    }
 
-        DWORD dwRetVal = 0;
-        dwRetVal = GetTempPath(MAX_PATH, tempPath);
+    ThreadNode *threadNode = lookupThreadNode(jvmtiInterface, thread);
 
-        if (dwRetVal > MAX_PATH || (dwRetVal == 0)) {
-            error("unable to get temp path\n")
-            sprintf((char*) traceFileName, "%s\\trace-%d-%d.trc", cwd, getpid(), atomicIncrement(&traceFileNumber));
-        } else {
-            sprintf((char*) traceFileName, "%strace-%d-%d.trc", tempPath, getpid(), atomicIncrement(&traceFileNumber));
+    if (threadNode > 0) {
+        if (threadNode->triggerWindow != triggerWindows) {
+            threadNode->triggerWindow = triggerWindows;
+            threadNode->triggerPending = 0;
         }
+        threadNode->triggerPending++;
+    }
 
-#endif
-#if defined __linux || defined __MVS__
-        sprintf((char*) traceFileName, "%s/trace-%d-%d.trc", traceDirectory, getpid(), atomicIncrement(&traceFileNumber));
-#endif
+    triggerStarted++;
+
+}
 
+
+/*
+ * Opens a capture window on the thread that entered the trigger method, or on every thread, much like startProfiling.
+ * Called with triggerLock held.
+ */
+static void openTriggerWindow(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jthread thread) {
+
+    if (!lockIfUnlocked(&profiling)) {
+        return;
     }
 
-    return traceFileName;
+    triggerWindows++;
+    triggerStarted = 0;
+    triggerFinished = 0;
+    triggerExpired = false;
 
-}
+    info("Trigger window %d opened\n", triggerWindows)
 
-void clearThreadLocalStorage(jvmtiEnv *jvmtiInterface, jint numberOfThreads, jthread *threads) {
+    startProfilingTime = getTicks();
 
-    for (int i = 0; i < numberOfThreads; i++) {
+    writeBeginBurst(globalBuffer);
 
-        ThreadNode *threadNode;
+    if (triggerAllThreads) {
 
-        (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, threads[i], (void **) &threadNode);
+        jint numberOfThreads;
+        jthread *threads;
 
-        if(threadNode) {
+        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
 
-            if (threadNode->threadID != -1) {
+        windStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
 
-                if(threadNode->name) free(threadNode->name);
-                if(threadNode->threadBuffer) free(threadNode->threadBuffer);
+        flushGlobalBuffer(true);
 
-                free(threadNode);
+        enableMainProfilingEvents(jvmtiInterface);
 
-                (*jvmtiInterface)->SetThreadLocalStorage(jvmtiInterface, threads[i], (const void*) NULL);
+    } else {
 
-            }
+        triggerThread = (*jni_env)->NewGlobalRef(jni_env, thread);
 
-        }
+        windStacks(jvmtiInterface, jni_env, 1, &triggerThread);
 
-    }
+        flushGlobalBuffer(true);
 
-}
+        setTriggerEvents(jvmtiInterface, JVMTI_ENABLE, triggerThread);
 
+    }
 
-void rollTraceFile(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env) {
+    if (triggerCount) {
+        setTriggerPops(jvmtiInterface, JVMTI_ENABLE);
+        countTriggerInvocation(jvmtiInterface, thread);
+    }
 
-    // if already profiling stop profiling
-    //if (__sync_bool_compare_and_swap(&profiling, LOCKED, UNLOCKED)) {
-    if (unlockIfLocked(&profiling)) {
+    if (triggerDuration) {
+        triggerDeadline = getTicks() + triggerDuration * headerTicksPerSecond / 1000;
+    }
 
-        info("Stopping Profiling\n")
-        jint numberOfThreads;
-        jthread *threads;
+    memoryBarrier();
+    triggerOpen = true;
 
-        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
+}
 
-        unwindStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
 
-        flushBuffers(jvmtiInterface, numberOfThreads, threads);
+static void closeTriggerWindow(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env) {
 
-        writeEndBurst(globalBuffer);
+    lock(&triggerLock, false);
 
-        flushBuffer(globalBuffer);
+    if (!triggerOpen) {
+        unlock(&triggerLock, false);
+        return;
+    }
 
-        reportStatistics();
+    jint numberOfThreads = 1;
+    jthread *threads = &triggerThread;
 
-        reportThreadStatistics(jvmtiInterface, numberOfThreads, threads);
+    if (triggerAllThreads) {
+        disableMainProfilingEvents(jvmtiInterface);
+        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
+    } else {
+        setTriggerEvents(jvmtiInterface, JVMTI_DISABLE, triggerThread);
+    }
 
+    if (triggerCount) {
+        setTriggerPops(jvmtiInterface, JVMTI_DISABLE);
     }
 
-// make sure we are not profiling
+    // The window may already have been closed by a stop command, which unwinds the stacks itself
 
-    if (isUnlocked(&profiling)) {
-        //if (__sync_bool_compare_and_swap(&profiling, UNLOCKED, UNLOCKED)) {
+    if (unlockIfLocked(&profiling)) {
 
-        writeEndFile(globalBuffer);
-        flushBuffer(globalBuffer);
+        stopProfilingTime = getTicks();
 
-        fclose(traceFile);
+        flushGlobalBuffer(true);
 
-        uint8_t *traceFileName = generateTraceFileName();
+        flushBuffers(jvmtiInterface, numberOfThreads, threads);
 
-        openTraceFile((char*) traceFileName);
+        unwindStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
 
-        info("New Trace File: %s\n", traceFileName)
+        writeCallTrees(true);
 
-        if (traceFile <= 0) {
-            error("Unable to open trace file %s\n", traceFileName)
-            return;
-        }
+        writeEndBurst(globalBuffer);
 
+        flushGlobalBuffer(true);
 
-        clearMethodIDHashtable();
-        clearClassHashtable();
-        clearThreadHashtable();
-        //clearThreadIDHashtable();
+    }
 
-        jint numberOfThreads;
-        jthread *threads;
+    if (triggerThread) {
+        (*jni_env)->DeleteGlobalRef(jni_env, triggerThread);
+        triggerThread = NULL;
+    }
 
-        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
-        clearThreadLocalStorage(jvmtiInterface, numberOfThreads, threads);
+    triggerDeadline = 0;
+    triggerOpen = false;
 
-        uniqueClassID = 1;
-        uniqueObjectID = 1;
-        uniqueThreadID = 1;
+    unlock(&triggerLock, false);
 
-        free(globalBuffer);
+    info("Trigger window %d closed, %" PRIu64 " ticks\n", triggerWindows, stopProfilingTime - startProfilingTime)
 
-        globalBuffer = allocateBuffer(GLOBAL_BUFFER_LENGTH, true);
+}
 
-        writeDefaultHeader(globalBuffer);
 
-        if (getClassNode(platformStringToJVM("java/lang/Thread")) == NULL) {
-            discoverClass(jvmtiInterface, jni_env, (*jni_env)->FindClass(jni_env, platformStringToJVM("java/lang/Thread")), true);
+static void armTrigger(jvmtiEnv *jvmtiInterface, jclass class) {
 
-        }
+    jvmtiError returnCode;
+    jint numberOfMethods;
+    jmethodID *methods;
 
+    returnCode = (*jvmtiInterface)->GetClassMethods(jvmtiInterface, class, &numberOfMethods, &methods);
+    if (returnCode != JNI_OK) {
+        error("Unable to get the methods of the trigger class (%d)\n", returnCode)
+        return;
     }
 
-    //if (__sync_bool_compare_and_swap(&profiling, UNLOCKED, LOCKED)) {
-    if (lockIfUnlocked(&profiling)) {
-        info("Starting Profiling\n")
+    for (int i = 0; i < numberOfMethods; i++) {
 
-        jint numberOfThreads;
-        jthread *threads;
+        char *methodName;
+        char *methodSignature;
 
-        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
+        returnCode = (*jvmtiInterface)->GetMethodName(jvmtiInterface, methods[i], &methodName, &methodSignature, NULL);
+        if (returnCode != JNI_OK) {
+            continue;
+        }
 
-        writeBeginBurst(globalBuffer);
+        if (strcmp(methodName, triggerMethod) == 0 && (triggerSignature == NULL || strcmp(methodSignature, triggerSignature) == 0)) {
 
-        windStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
+            returnCode = (*jvmtiInterface)->SetBreakpoint(jvmtiInterface, methods[i], 0);
+
+            if (returnCode == JNI_OK || returnCode == JVMTI_ERROR_DUPLICATE) {
+                info("Trigger armed on %s.%s%s\n", JVMStringToPlatform(triggerClass), JVMStringToPlatform(methodName), JVMStringToPlatform(methodSignature))
+            } else {
+                error("Unable to set the trigger breakpoint on %s%s (%d)\n", JVMStringToPlatform(methodName), JVMStringToPlatform(methodSignature), returnCode)
+            }
+
+        }
+
+        (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methodName);
+        (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methodSignature);
 
     }
 
+    (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methods);
+
 }
 
 
-void startProfiling(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env) {
+static bool isTriggerClass(jvmtiEnv *jvmtiInterface, jclass class) {
 
-    info("Starting profiling\n")
+    char *classSignature;
 
-    //   if (__sync_bool_compare_and_swap(&profiling, UNLOCKED, LOCKED)) {
-    if (lockIfUnlocked(&profiling)) {
+    if ((*jvmtiInterface)->GetClassSignature(jvmtiInterface, class, &classSignature, NULL) != JNI_OK) {
+        return false;
+    }
 
-        info("Profiling was not active, really starting\n")
+    bool matches = strcmp(classSignature, triggerClass) == 0;
 
-        startProfilingTime = getTicks();
+    (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) classSignature);
 
-        writeBeginBurst(globalBuffer);
+    return matches;
 
-        jint numberOfThreads;
-        jthread *threads;
+}
 
-        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
 
-        windStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
+void armLoadedTriggers(jvmtiEnv *jvmtiInterface) {
 
-        flushGlobalBuffer(true);
+    jint numberOfClasses;
+    jclass *classes;
 
-        enableMainProfilingEvents(jvmtiInterface);
+    if ((*jvmtiInterface)->GetLoadedClasses(jvmtiInterface, &numberOfClasses, &classes) != JNI_OK) {
+        error("Unable to get the loaded classes, the trigger is armed as classes are prepared\n")
+        return;
+    }
 
-        info("Started profiling\n")
+    for (int i = 0; i < numberOfClasses; i++) {
 
-    } else {
+        jint status;
 
-        info("Already profiling\n")
+        (*jvmtiInterface)->GetClassStatus(jvmtiInterface, classes[i], &status);
 
-    }
+        if ((status & JVMTI_CLASS_STATUS_PREPARED) && isTriggerClass(jvmtiInterface, classes[i])) {
+            armTrigger(jvmtiInterface, classes[i]);
+        }
 
-}
+    }
 
+    (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) classes);
 
-void stopProfiling(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env) {
+}
 
-    info("Stopping Profiling\n")
 
-    //   if (__sync_bool_compare_and_swap(&profiling, LOCKED, UNLOCKED)) {
-    if (unlockIfLocked(&profiling)) {
+void* triggerWatcher(void *arg) {
 
-        stopProfilingTime = getTicks();
+    JavaVM *vm = (JavaVM*) arg;
 
-        disableMainProfilingEvents(jvmtiInterface);
+    JNIEnv *JNIInterface;
 
-        flushGlobalBuffer(true);
+    jint jniReturnCode;
+    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
+    if (jniReturnCode != JNI_OK) {
+        error("Unable to attach to the JVM, trigger windows will not close (%d)\n", (uint32_t) jniReturnCode)
+        triggerRunning = false;
+        return NULL;
+    }
 
-        jint numberOfThreads;
-        jthread *threads;
+    info("Starting the Trigger Thread\n")
 
-        getAllThreads(jvmtiInterface, &numberOfThreads, &threads);
+    while (triggerRunning) {
 
-        flushBuffers(jvmtiInterface, numberOfThreads, threads);
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = TRIGGER_CHECK_MS * 1000000;
+        nanosleep(&ts, NULL);
 
-        unwindStacks(jvmtiInterface, jni_env, numberOfThreads, threads);
+        if (triggerOpen && (triggerExpired || (triggerDeadline && getTicks() >= triggerDeadline))) {
+            closeTriggerWindow(globalJVMTIInterface, JNIInterface);
+        }
 
-        writeEndBurst(globalBuffer);
+    }
 
-        flushGlobalBuffer(true);
+    (*vm)->DetachCurrentThread(vm);
 
-        reportStatistics();
+    return NULL;
 
-        reportThreadStatistics(jvmtiInterface, numberOfThreads, threads);
+}
 
-        uint64_t profilingTime = (stopProfilingTime-startProfilingTime);
 
-        uint64_t tagObjectsPercent = tagObjectsCost/(profilingTime/100);
+void startTrigger() {
 
-        info("Profiling Time %" PRIu64 "\n", profilingTime)
+    triggerRunning = true;
 
-        info("TagObjects Cost %" PRIu64 "\n", tagObjectsCost)
+    if (pthread_create(&triggerWatcherThread, NULL, triggerWatcher, (void*) jvm)) {
+        error("Unable to start the trigger thread (%s)\n", strerror(errno))
+        triggerRunning = false;
+    }
 
-        info("TagObjects percent %" PRIu64 "\n", tagObjectsPercent)
+}
 
-    } else {
 
-        info("Not currently profiling\n")
+void stopTrigger() {
 
+    if (triggerRunning) {
+        triggerRunning = false;
+        pthread_join(triggerWatcherThread, NULL);
+        info("Trigger Windows: %d\n", triggerWindows)
     }
 
 }
@@ -1671,13 +4469,49 @@ ThreadNode* discoverThread(jvmtiEnv *jvmtiInterface, jthread jvmtiThread) {
     }
 
     threadNode->threadID = atomicIncrement(&uniqueThreadID);
+    threadNode->cacheEpoch = traceEpoch;
     if(threadInfo.name) {
         threadNode->name = (uint8_t*) strdup((const char*) threadInfo.name);
     } else {
         threadNode->name = (uint8_t*) "Unknown";
     }
 
-    threadNode->threadBuffer = allocateBuffer(THREAD_BUFFER_LENGTH, false);
+    if (profilingMode == MODE_FLIGHT) {
+
+        // Once the budget is spent the rings of ended threads are given up, oldest first, and a thread that still
+        // finds none records nothing until its ring can grow
+
+        uint32_t numberOfChunks = FLIGHT_MIN_CHUNKS;
+
+        while (!reserveFlightMemory(FLIGHT_MIN_CHUNKS * FLIGHT_CHUNK_LENGTH)) {
+            if (!reclaimFlightRing()) {
+                numberOfChunks = 1;
+                break;
+            }
+        }
+
+        threadNode->threadBuffer = allocateRingBuffer(FLIGHT_CHUNK_LENGTH, numberOfChunks, FLIGHT_THREAD_CHUNKS);
+    } else if (asyncWriter) {
+        threadNode->threadBuffer = allocateRingBuffer(THREAD_CHUNK_LENGTH, THREAD_CHUNKS, THREAD_CHUNKS);
+    } else {
+        threadNode->threadBuffer = allocateBuffer(THREAD_BUFFER_LENGTH, false);
+    }
+
+    threadNode->threadBuffer->threadID = threadNode->threadID;
+    beginBlock(threadNode->threadBuffer);
+
+    if (profilingMode == MODE_CCT) {
+        threadNode->callTree = createCallTree();
+    }
+
+    if (minDurationTicks) {
+        threadNode->shadowStack = calloc(SHADOW_STACK_DEPTH, sizeof(ShadowFrame));
+        if (threadNode->shadowStack <= 0) {
+            error("Unable to allocate shadow stack\n")
+        }
+    }
+
+    addToThreadHashtable(threadNode);
 
     returnCode = (*jvmtiInterface)->SetThreadLocalStorage(jvmtiInterface, jvmtiThread, (const void*) threadNode);
 
@@ -1690,6 +4524,58 @@ ThreadNode* discoverThread(jvmtiEnv *jvmtiInterface, jthread jvmtiThread) {
 }
 
 
+void benchmarkEvents(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jthread thread) {
+
+    jclass threadClass = (*jni_env)->FindClass(jni_env, platformStringToJVM("java/lang/Thread"));
+    jmethodID method = threadClass ? (*jni_env)->GetMethodID(jni_env, threadClass, platformStringToJVM("run"), platformStringToJVM("()V")) : NULL;
+
+    if (method == NULL) {
+        (*jni_env)->ExceptionClear(jni_env);
+        error("Unable to find java/lang/Thread.run, benchmark unavailable\n")
+        return;
+    }
+
+    Buffer *buffer = allocateBuffer(THREAD_BUFFER_LENGTH, false);
+    jvalue value;
+
+    double lookupNanos[2];
+    double eventNanos[2];
+
+    for (int pass = 0; pass < 2; pass++) {
+
+        jthread eventThread = pass ? NULL : thread;
+
+        uint64_t start = getTicks();
+
+        for (int i = 0; i < BENCHMARK_LOOPS; i++) {
+            lookupThreadNode(jvmtiInterface, eventThread);
+        }
+
+        uint64_t lookupTicks = getTicks() - start;
+
+        start = getTicks();
+
+        for (int i = 0; i < BENCHMARK_LOOPS; i++) {
+            buffer->bufferOffset = 0;
+            MethodEntryInternal(jvmtiInterface, jni_env, eventThread, method, buffer);
+            MethodExitInternal(jvmtiInterface, jni_env, eventThread, method, JNI_FALSE, value, buffer);
+        }
+
+        uint64_t eventTicks = getTicks() - start;
+
+        lookupNanos[pass] = (lookupTicks * 1000.0) / headerTicksPerMicrosecond / BENCHMARK_LOOPS;
+        eventNanos[pass] = (eventTicks * 1000.0) / headerTicksPerMicrosecond / (2.0 * BENCHMARK_LOOPS);
+
+    }
+
+    info("Benchmark, ThreadNode lookup: JVMTI %.1f ns, native %.1f ns\n", lookupNanos[0], lookupNanos[1])
+    info("Benchmark, per event: JVMTI %.1f ns, native %.1f ns\n", eventNanos[0], eventNanos[1])
+
+    freeBuffer(buffer);
+
+}
+
+
 void JNICALL VMStart(jvmtiEnv *jvmti_env, JNIEnv *jni_env) {
     debug("VMStart\n")
 }
@@ -1700,18 +4586,69 @@ void JNICALL VMInit(jvmtiEnv *jvmti_env, JNIEnv *jni_env, jthread thread) {
     debug("VMInit\n")
 
     if (getClassNode(platformStringToJVM("java/lang/Thread")) == NULL) {
-        discoverClass(jvmti_env, jni_env, (*jni_env)->FindClass(jni_env, platformStringToJVM("java/lang/Thread")), true);
+        discoverClass(jvmti_env, jni_env, (*jni_env)->FindClass(jni_env, platformStringToJVM("java/lang/Thread")));
+    }
+
+    if (getOption("benchmark")) {
+        benchmarkEvents(jvmti_env, jni_env, thread);
+    }
+
+    if (profilingMode == MODE_SAMPLE) {
+        startSampler();
+    }
+
+    if (asyncResolver) {
+        startResolver();
+    }
+
+    if (rollSize || rollInterval) {
+        startRoller();
+    }
+
+    if (profilingMode == MODE_INSTRUMENT) {
+
+        JNINativeMethod natives[2];
+
+        natives[0].name = HOOK_ENTER_NAME;
+        natives[0].signature = HOOK_SIGNATURE;
+        natives[0].fnPtr = (void*) &HookEnter;
+        natives[1].name = HOOK_EXIT_NAME;
+        natives[1].signature = HOOK_SIGNATURE;
+        natives[1].fnPtr = (void*) &HookExit;
+
+#ifdef __MVS__
+        for (int i = 0; i < 2; i++) {
+            natives[i].name = strdup(platformStringToJVM(natives[i].name));
+            natives[i].signature = strdup(platformStringToJVM(natives[i].signature));
+        }
+#endif
+
+        if (defineHookClass(jni_env, natives, 2) == NULL) {
+            error("Instrumentation unavailable\n")
+        }
+
+    }
+
+    if (profilingMode == MODE_FLIGHT) {
+        startFlightRecorder();
+    }
+
+    if (triggerClass) {
+        armLoadedTriggers(jvmti_env);
+        startTrigger();
     }
 
     Option *startProfilingOption = getOption("startProfiling");
 
-    if (startProfilingOption) {
+    if (startProfilingOption || profilingMode == MODE_FLIGHT) {
         startProfiling(jvmti_env, jni_env);
     }
 
 
 #if defined __linux || defined __MVS__
-//pthread_create(&controllerThread, NULL, networkController, (void*) jvm);
+    if (controlPort) {
+        pthread_create(&networkThread, NULL, networkController, (void*) jvm);
+    }
     pthread_create(&controllerThread, NULL, pipeController, (void*) jvm);
 #endif
 #ifdef __WIN32__
@@ -1726,6 +4663,36 @@ void JNICALL VMDeath(jvmtiEnv *jvmti_env, JNIEnv *jni_env) {
 
     stopProfiling(jvmti_env, jni_env);
 
+    if (profilingMode == MODE_SAMPLE) {
+        debug("Stopping sampler thread\n")
+        stopSampler();
+    }
+
+    if (rollerRunning) {
+        debug("Stopping roller thread\n")
+        stopRoller();
+    }
+
+    if (profilingMode == MODE_FLIGHT) {
+        debug("Stopping flight recorder thread\n")
+        stopFlightRecorder();
+    }
+
+    if (triggerRunning) {
+        debug("Stopping trigger thread\n")
+        stopTrigger();
+    }
+
+    if (asyncResolver) {
+        debug("Stopping resolver thread\n")
+        stopResolver();
+    }
+
+    if (asyncWriter) {
+        debug("Stopping writer thread\n")
+        stopWriter();
+    }
+
     debug("Write end of file\n")
     writeEndFile(globalBuffer);
 
@@ -1733,43 +4700,34 @@ void JNICALL VMDeath(jvmtiEnv *jvmti_env, JNIEnv *jni_env) {
     flushGlobalBuffer(true);
 
     debug("Closing trace file\n")
-    fclose(traceFile);
+    closeOutput();
+    stopOutput();
 
     debug("Stopping controller thread\n")
     pthread_cancel(controllerThread);
 
+    if (controlPort) {
+        pthread_cancel(networkThread);
+    }
+
+    freeRetiredFilters();
+
     info("Exiting Profiler, pid: %d, end ticks: %" PRIu64 "\n", (uint32_t )pid, getTicks())
 
 }
 
-uint32_t discoverObject(Buffer *buffer, jvmtiEnv *jvmtiInterface, jobject object, uint16_t classID) {
+uint32_t discoverObject(Buffer *buffer, jvmtiEnv *jvmtiInterface, jobject object, uint16_t classID, jlong tag) {
 
     jvmtiError returnCode;
 
-    uint32_t tag = atomicIncrement(&uniqueObjectID);
-
-    returnCode = (*jvmtiInterface)->SetTag(jvmtiInterface, object, (jlong) tag);
-    if (returnCode == JNI_OK) {
-        writeObject(buffer, (uint32_t) tag, classID);
-        return tag;
-    } else {
-        warn("could not tag object (%d)\n", returnCode)
-        return -1;
-    }
-
-    returnCode = (*jvmtiInterface)->SetTag(jvmtiInterface, object, (jlong) tag);
-    if (returnCode == JNI_OK) {
-        writeObject(buffer, (uint32_t) tag, classID);
-        return tag;
-    } else {
-        warn("could not tag object (%d)\n", returnCode)
-        return -1;
-    }
+    // The low half of the tag is the object id, the high half the trace file it was last defined in
 
-    returnCode = (*jvmtiInterface)->SetTag(jvmtiInterface, object, (jlong) tag);
+    uint32_t objectID = tag ? (uint32_t) tag : atomicIncrement(&uniqueObjectID);
+
+    returnCode = (*jvmtiInterface)->SetTag(jvmtiInterface, object, (jlong) (((uint64_t) traceEpoch << 32) | objectID));
     if (returnCode == JNI_OK) {
-        writeObject(buffer, (uint32_t) tag, classID);
-        return tag;
+        writeObject(buffer, objectID, classID);
+        return objectID;
     } else {
         warn("could not tag object (%d)\n", returnCode)
         return -1;
@@ -1792,7 +4750,7 @@ static inline uint8_t* copyString(const char * original) {
     if (length == 0)
         return NULL;
 
-    uint8_t *copy = malloc(length + 1);
+    uint8_t *copy = arenaAllocate(metadataArena, length + 1);
 
     for (int i = 0; i < length; i++) {
         copy[i] = original[i];
@@ -1820,7 +4778,7 @@ uint8_t* fixClassName(uint8_t *name) {
 
         if (platformName[0] == 'L') {
 
-            newName = calloc(1, length);
+            newName = arenaAllocate(metadataArena, length);
 
             if (newName <= 0) {
                 error("Unable to allocate fixed class name\n")
@@ -1855,18 +4813,7 @@ uint8_t* fixClassName(uint8_t *name) {
 }
 
 
-  ClassNode* discoverClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jclass class, bool mustLock) {
-
-    debug("Discover Class")
-
-    if (class <= 0) {
-        debug("JClass is NULL")
-        return NULL;
-    }
-
-    if(mustLock) {
-        lock(&classLock, false);
-    }
+ClassNode* createClassNode(jvmtiEnv *jvmtiInterface, jclass class) {
 
     jvmtiError returnCode;
     char *classSignature;
@@ -1875,36 +4822,21 @@ uint8_t* fixClassName(uint8_t *name) {
     returnCode = (*jvmtiInterface)->GetClassSignature(jvmtiInterface, class, &classSignature, &classGeneric);
 
     if (returnCode != JNI_OK) {
-        if(mustLock) {
-            unlock(&classLock, false);
-        }
         return NULL;
     }
 
-    ClassNode *classNode = getClassNode(classSignature);
-
-    if(classNode!= NULL) {
-        warn("Already discovered %s\n", JVMStringToPlatform(classSignature))
-        if(mustLock) {
-            unlock(&classLock, false);
-        }
-    }
-
-   debug("Discovering Class: %s on %d hash: %d\n", JVMStringToPlatform(classSignature), pthread_self(), jenkins_one_at_a_time_hash(classSignature, strlen(classSignature)))
+    debug("Discovering Class: %s on %d hash: %d\n", JVMStringToPlatform(classSignature), pthread_self(), jenkins_one_at_a_time_hash(classSignature, strlen(classSignature)))
 
-    classNode = calloc(1, sizeof(ClassNode));
+    ClassNode *classNode = arenaAllocate(metadataArena, sizeof(ClassNode));
 
     if (classNode <= 0) {
         error("cannot allocate ClassNode")
-        if(mustLock) {
-            unlock(&classLock, false);
-        }
         return NULL;
     }
 
     classNode->name = copyString(classSignature);
     classNode->profilerName = fixClassName(copyString(classSignature));
-//    classNode->profilerName = fixClassName(classNode->profilerName);
+    classNode->filtered = !isClassIncluded(classFilter, classNode->profilerName);
 
     debug("Discovering Class %s\n", JVMStringToPlatform(classNode->name))
 
@@ -1915,6 +4847,14 @@ uint8_t* fixClassName(uint8_t *name) {
         (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) classGeneric);
     }
 
+    return classNode;
+
+}
+
+
+bool discoverMethods(jvmtiEnv *jvmtiInterface, jclass class, ClassNode *classNode) {
+
+    jvmtiError returnCode;
     jint methodCount;
     jmethodID *methods;
 
@@ -1922,315 +4862,608 @@ uint8_t* fixClassName(uint8_t *name) {
 
     if (returnCode != JNI_OK) {
         error("Failed getting Class methods (%d)\n", returnCode)
-        if(mustLock) {
-            unlock(&classLock, false);
-        }
-        return NULL;
+        return false;
     }
 
+    classNode->jvmtiMethods = methods;
+
     if (methodCount) {
 
-        MethodInfo *methodInfo = calloc(1, (sizeof(MethodInfo) * methodCount));
+        MethodInfo *methodInfo = arenaAllocate(metadataArena, sizeof(MethodInfo) * methodCount);
         if (methodInfo <= 0) {
             error("cannot allocate MethodInfo")
-            if(mustLock) {
-                unlock(&classLock, false);
+            return false;
+        }
+
+        classNode->numberOfMethods = methodCount;
+        classNode->methods = methodInfo;
+
+    }
+
+    return true;
+
+}
+
+
+bool discoverMethodInfo(jvmtiEnv *jvmtiInterface, ClassNode *classNode) {
+
+    jvmtiError returnCode;
+    MethodInfo *methodInfo = classNode->methods;
+    jmethodID *methods = classNode->jvmtiMethods;
+
+    for (int i = 0; i < classNode->numberOfMethods; i++) {
+
+        jint modifiers;
+        returnCode = (*jvmtiInterface)->GetMethodModifiers(jvmtiInterface, methods[i], &modifiers);
+        if (returnCode != JNI_OK) {
+            error("Failed getting method modifiers (%d)\n", returnCode)
+            return false;
+        }
+
+        methodInfo[i].modifiers = (uint16_t) modifiers;
+
+        char* methodName;
+        char* methodSignature;
+        char* methodGeneric;
+
+        returnCode = (*jvmtiInterface)->GetMethodName(jvmtiInterface, methods[i], &methodName, &methodSignature, &methodGeneric);
+        if (returnCode != JNI_OK) {
+            error("Failed getting method name (%d)\n", returnCode)
+            return false;
+        }
+
+        if (methodName)
+            methodInfo[i].name = internString(methodName);
+        if (methodSignature)
+            methodInfo[i].signature = internString(methodSignature);
+        if (methodGeneric)
+            methodInfo[i].generic = internString(methodGeneric);
+
+        if (methodName)
+            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methodName);
+        if (methodSignature)
+            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methodSignature);
+        if (methodGeneric)
+            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methodGeneric);
+
+    }
+
+    return true;
+
+}
+
+
+bool discoverFieldInfo(jvmtiEnv *jvmtiInterface, jclass class, ClassNode *classNode) {
+
+    jvmtiError returnCode;
+    jint fieldCount;
+    jfieldID *fields;
+
+    returnCode = (*jvmtiInterface)->GetClassFields(jvmtiInterface, class, &fieldCount, &fields);
+    if (returnCode != JNI_OK) {
+        error("Failed getting Class fields (%d)\n", returnCode)
+        return false;
+    }
+
+    if (fieldCount) {
+
+        FieldInfo *fieldInfo = arenaAllocate(metadataArena, sizeof(FieldInfo) * fieldCount);
+        if (fieldInfo <= 0) {
+            error("cannot allocate FieldInfo")
+            return false;
+        }
+
+        classNode->numberOfFields = fieldCount;
+        classNode->fields = fieldInfo;
+
+        for (int i = 0; i < fieldCount; ++i) {
+
+            jint modifiers;
+            returnCode = (*jvmtiInterface)->GetFieldModifiers(jvmtiInterface, class, fields[i], &modifiers);
+            if (returnCode != JNI_OK) {
+                error("Failed getting field modifiers (%d)\n", returnCode)
+                return false;
+            }
+
+            fieldInfo[i].modifiers = (uint16_t) modifiers;
+
+            char* name;
+            char* signature;
+            char* generic;
+
+            returnCode = (*jvmtiInterface)->GetFieldName(jvmtiInterface, class, fields[i], &name, &signature, &generic);
+            if (returnCode != JNI_OK) {
+                error("Failed getting field name (%d)\n", returnCode)
+                return false;
+            }
+
+            if (name)
+                fieldInfo[i].name = internString(name);
+            if (signature)
+                fieldInfo[i].signature = internString(signature);
+            if (generic)
+                fieldInfo[i].generic = internString(generic);
+
+            if (name)
+                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) name);
+            if (signature)
+                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) signature);
+            if (generic)
+                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) generic);
+
+        }
+
+        if (fields)
+            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) fields);
+
+    }
+
+    return true;
+
+}
+
+
+ClassNode* discoverRelatedClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jclass class, bool deferred) {
+
+    jvmtiError returnCode;
+    char *signature;
+    char *generic;
+
+    returnCode = (*jvmtiInterface)->GetClassSignature(jvmtiInterface, class, &signature, &generic);
+    if (returnCode != JNI_OK) {
+        error("Failed getting related class signature (%d)\n", returnCode)
+        return NULL;
+    }
+
+    if (deferred) {
+        lock(&classLock, false);
+    }
+
+    ClassNode *classNode = getClassNode(signature);
+
+    if (classNode <= 0) {
+        debug("Discovering related class %s on %d\n", JVMStringToPlatform(signature), pthread_self())
+        classNode = deferred ? reserveClass(jvmtiInterface, jni_env, class) : discoverClass(jvmtiInterface, jni_env, class);
+    }
+
+    if (deferred) {
+        unlock(&classLock, false);
+    }
+
+    if (classNode > 0 && isLocked(&classNode->lock)) {
+        waitForClassNode(classNode);
+        if (classNode->failed) {
+            classNode = NULL;
+        }
+    }
+
+    if (signature)
+        (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) signature);
+    if (generic)
+        (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) generic);
+
+    if (deferred && classNode > 0) {
+        resolveClass(jvmtiInterface, jni_env, classNode);
+    }
+
+    return classNode;
+
+}
+
+
+bool discoverHierarchy(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jclass class, ClassNode *classNode, bool deferred) {
+
+    jvmtiError returnCode;
+
+    jclass superClass = (*jni_env)->GetSuperclass(jni_env, class);
+
+    if (superClass) {
+
+        ClassNode *superClassNode = discoverRelatedClass(jvmtiInterface, jni_env, superClass, deferred);
+
+        if (superClassNode) {
+            classNode->superClassID = superClassNode->classID;
+            classNode->superClass = superClassNode;
+        }
+
+    }
+
+    jint interfaceCount;
+    jclass *interfaces;
+
+    returnCode = (*jvmtiInterface)->GetImplementedInterfaces(jvmtiInterface, class, &interfaceCount, &interfaces);
+    if (returnCode != JNI_OK) {
+        error("Failed getting Class interfaces (%d)\n", returnCode)
+        return false;
+    }
+
+    if (interfaceCount) {
+
+        InterfaceInfo *interfaceInfo = arenaAllocate(metadataArena, sizeof(InterfaceInfo) * interfaceCount);
+        if (interfaceInfo <= 0) {
+            error("cannot allocate InterfaceInfo")
+            return false;
+        }
+
+        classNode->numberOfInterfaces = interfaceCount;
+        classNode->interfaces = interfaceInfo;
+
+        for (int i = 0; i < interfaceCount; i++) {
+
+            ClassNode *interfaceClassNode = discoverRelatedClass(jvmtiInterface, jni_env, interfaces[i], deferred);
+
+            if (interfaceClassNode) {
+                interfaceInfo[i].classID = interfaceClassNode->classID;
+                interfaceInfo[i].classNode = interfaceClassNode;
+            }
+
+        }
+
+    }
+
+    if (interfaces)
+        (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) interfaces);
+
+    return true;
+
+}
+
+
+void addMethodIDNodes(jvmtiEnv *jvmtiInterface, jclass class, ClassNode *classNode) {
+
+    uint32_t numberOfMethods = classNode->numberOfMethods;
+
+    MethodIDNode *methodIDNodeList = arenaAllocate(metadataArena, sizeof(MethodIDNode) * numberOfMethods);
+    for (int i = 0; i < numberOfMethods; i++) {
+        methodIDNodeList[i].jvmtiMethodID = classNode->jvmtiMethods[i];
+        methodIDNodeList[i].jvmtiClass = class;
+        methodIDNodeList[i].classNode = classNode;
+        methodIDNodeList[i].classID = (uint16_t) classNode->classID;
+        methodIDNodeList[i].methodID = (uint16_t) i;
+        methodIDNodeList[i].filtered = classNode->filtered;
+        if (classNode->resolved) {
+            methodIDNodeList[i].staticMethod = (classNode->methods[i].modifiers&ACC_STATIC);
+            if (profilingMode == MODE_INSTRUMENT) {
+                methodIDNodeList[i].filtered |= isRenamedMethod(classNode->methods[i].name);
+                methodIDNodeList[i].instrumented = isWrapperMethod(classNode->methods, classNode->numberOfMethods, i);
+            }
+        }
+    }
+
+    classNode->methodIDNodes = methodIDNodeList;
+
+    addListToMethodIDHashtable(numberOfMethods, methodIDNodeList, jvmtiInterface);
+
+}
+
+
+void releaseClassMethods(jvmtiEnv *jvmtiInterface, ClassNode *classNode) {
+
+    if (classNode->jvmtiMethods) {
+        (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) classNode->jvmtiMethods);
+        classNode->jvmtiMethods = NULL;
+    }
+
+}
+
+
+ClassNode* discoverClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jclass class) {
+
+    debug("Discover Class")
+
+    if (class <= 0) {
+        debug("JClass is NULL")
+        return NULL;
+    }
+
+    ClassNode *classNode = createClassNode(jvmtiInterface, class);
+
+    if (classNode == NULL) {
+        return NULL;
+    }
+
+    ClassNode *claimedNode = claimClassNode(classNode);
+
+    if (claimedNode != classNode) {
+        if (claimedNode) {
+            debug("Waiting for the discovery of %s\n", JVMStringToPlatform(claimedNode->name))
+            waitForClassNode(claimedNode);
+            if (claimedNode->failed) {
+                return NULL;
             }
-            return NULL;
         }
+        return claimedNode;
+    }
+
+    uint64_t discoveryStart = getTicks();
+
+    if (discoverMethods(jvmtiInterface, class, classNode) && discoverMethodInfo(jvmtiInterface, classNode)
+            && discoverFieldInfo(jvmtiInterface, class, classNode) && discoverHierarchy(jvmtiInterface, jni_env, class, classNode, false)) {
+
+        classNode->classID = atomicIncrement(&uniqueClassID);
+        classNode->resolved = true;
+
+        addMethodIDNodes(jvmtiInterface, class, classNode);
+        releaseClassMethods(jvmtiInterface, classNode);
+
+        debug("Writing Class %s\n", JVMStringToPlatform(classNode->profilerName))
+
+        writeClass(globalBuffer, classNode);
+
+    } else {
+        error("Unable to discover class %s\n", JVMStringToPlatform(classNode->name))
+        classNode->failed = true;
+        removeClassNode(classNode);
+        classNode = NULL;
+    }
+
+    __sync_fetch_and_add(&discoveryTicks, getTicks() - discoveryStart);
+
+    memoryBarrier();
+
+    unlock(&claimedNode->lock, false);
+
+    return classNode;
+
+}
+
+
+ClassNode* reserveClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jclass class) {
+
+    if (class <= 0) {
+        return NULL;
+    }
+
+    ClassNode *classNode = createClassNode(jvmtiInterface, class);
+
+    if (classNode == NULL || !discoverMethods(jvmtiInterface, class, classNode)) {
+        return NULL;
+    }
 
-        classNode->numberOfMethods = methodCount;
-        classNode->methods = methodInfo;
+    classNode->classID = atomicIncrement(&uniqueClassID);
+    classNode->jvmtiClass = (*jni_env)->NewGlobalRef(jni_env, class);
 
-        for (int i = 0; i < methodCount; i++) {
+    addMethodIDNodes(jvmtiInterface, class, classNode);
+    addToClassHashtable(classNode);
 
-            jint modifiers;
-            returnCode = (*jvmtiInterface)->GetMethodModifiers(jvmtiInterface, methods[i], &modifiers);
-            if (returnCode != JNI_OK) {
-                error("Failed getting method modifiers (%d)\n", returnCode)
-                if(mustLock) {
-                    unlock(&classLock, false);
-                }
-                return NULL;
-            }
+    lock(&resolverLock, false);
 
-            methodInfo[i].modifiers = (uint16_t) modifiers;
+    if (pendingTail) {
+        pendingTail->pendingNext = classNode;
+    } else {
+        pendingHead = classNode;
+    }
+    pendingTail = classNode;
+    resolverQueued++;
 
-            char* methodName;
-            char* methodSignature;
-            char* methodGeneric;
+    unlock(&resolverLock, false);
 
-            returnCode = (*jvmtiInterface)->GetMethodName(jvmtiInterface, methods[i], &methodName, &methodSignature, &methodGeneric);
-            if (returnCode != JNI_OK) {
-                error("Failed getting method name (%d)\n", returnCode)
-                if(mustLock) {
-                    unlock(&classLock, false);
-                }
-                return NULL;
-            }
+    resolverNudged = true;
 
-            if (methodName)
-                methodInfo[i].name = copyString(methodName);
-            if (methodSignature)
-                methodInfo[i].signature = copyString(methodSignature);
-            if (methodGeneric)
-                methodInfo[i].generic = copyString(methodGeneric);
+    return classNode;
 
-            if (methodName)
-                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methodName);
-            if (methodSignature)
-                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methodSignature);
-            if (methodGeneric)
-                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methodGeneric);
+}
 
-        }
 
-    }
+MethodIDNode* reserveMethod(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, jmethodID method) {
 
-    jint fieldCount;
-    jfieldID *fields;
+    lock(&classLock, false);
 
-    returnCode = (*jvmtiInterface)->GetClassFields(jvmtiInterface, class, &fieldCount, &fields);
-    if (returnCode != JNI_OK) {
-        error("Failed getting Class fields (%d)\n", returnCode)
-        if(mustLock) {
-            unlock(&classLock, false);
+    MethodIDNode *methodIDNode = getMethodIDNode(method);
+
+    if (methodIDNode <= 0) {
+        jclass declaringClass;
+        (*jvmtiInterface)->GetMethodDeclaringClass(jvmtiInterface, method, &declaringClass);
+        if (reserveClass(jvmtiInterface, jni_env, declaringClass)) {
+            methodIDNode = getMethodIDNode(method);
         }
-        return NULL;
     }
 
-    if (fieldCount) {
-
-        FieldInfo *fieldInfo = calloc(fieldCount, sizeof(FieldInfo));
-        if (fieldInfo <= 0) {
-            error("cannot allocate FieldInfo")
-            if(mustLock) {
-                unlock(&classLock, false);
-            }
-            return NULL;
-        }
+    unlock(&classLock, false);
 
-        classNode->numberOfFields = fieldCount;
-        classNode->fields = fieldInfo;
+    return methodIDNode;
 
-        for (int i = 0; i < fieldCount; ++i) {
+}
 
-            jint modifiers;
-            returnCode = (*jvmtiInterface)->GetFieldModifiers(jvmtiInterface, class, fields[i], &modifiers);
-            if (returnCode != JNI_OK) {
-                error("Failed getting field modifiers (%d)\n", returnCode)
-                if(mustLock) {
-                    unlock(&classLock, false);
-                }
-                return NULL;
-            }
 
-            fieldInfo[i].modifiers = (uint16_t) modifiers;
+void resolveClass(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, ClassNode *classNode) {
 
-            char* name;
-            char* signature;
-            char* generic;
+    if (classNode->resolved) {
+        return;
+    }
 
-            returnCode = (*jvmtiInterface)->GetFieldName(jvmtiInterface, class, fields[i], &name, &signature, &generic);
-            if (returnCode != JNI_OK) {
-                error("Failed getting field name (%d)\n", returnCode)
-                if(mustLock) {
-                    unlock(&classLock, false);
-                }
-                return NULL;
-            }
+    jclass class = classNode->jvmtiClass;
 
-            if (name)
-                fieldInfo[i].name = copyString(name);
-            if (signature)
-                fieldInfo[i].signature = copyString(signature);
-            if (generic)
-                fieldInfo[i].generic = copyString(generic);
+    uint64_t discoveryStart = getTicks();
 
-            if (name)
-                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) name);
-            if (signature)
-                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) signature);
-            if (generic)
-                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) generic);
+    if (discoverMethodInfo(jvmtiInterface, classNode) && discoverFieldInfo(jvmtiInterface, class, classNode)
+            && discoverHierarchy(jvmtiInterface, jni_env, class, classNode, true)) {
 
+        for (int i = 0; i < classNode->numberOfMethods; i++) {
+            classNode->methodIDNodes[i].staticMethod = (classNode->methods[i].modifiers&ACC_STATIC);
         }
 
-        if (fields)
-            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) fields);
+        debug("Writing Class %s\n", JVMStringToPlatform(classNode->profilerName))
+
+        writeClass(globalBuffer, classNode);
 
+    } else {
+        error("Unable to resolve class %s\n", JVMStringToPlatform(classNode->name))
     }
 
-    jclass superClass = (*jni_env)->GetSuperclass(jni_env, class);
+    __sync_fetch_and_add(&discoveryTicks, getTicks() - discoveryStart);
 
-    if (superClass) {
+    releaseClassMethods(jvmtiInterface, classNode);
 
-        char *superClassSignature;
-        char *superClassGeneric;
+    (*jni_env)->DeleteGlobalRef(jni_env, class);
+    classNode->jvmtiClass = NULL;
 
-        returnCode = (*jvmtiInterface)->GetClassSignature(jvmtiInterface, superClass, &superClassSignature, &superClassGeneric);
-        if (returnCode != JNI_OK) {
-            error("Failed getting superclass signature (%d)\n", returnCode)
-            if(mustLock) {
-                unlock(&classLock, false);
-            }
-            return NULL;
-        }
+    memoryBarrier();
 
-        ClassNode *superClassNode = getClassNode(superClassSignature);
+    classNode->resolved = true;
 
-        if (superClassNode <= 0) {
-            superClassNode = discoverClass(jvmtiInterface, jni_env, superClass, false);
-        }
+}
 
-        if (superClassNode)
-            classNode->superClassID = superClassNode->classID;
 
-        if (superClassSignature)
-            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) superClassSignature);
-        if (superClassGeneric)
-            (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) superClassGeneric);
+void* classResolver(void *arg) {
 
-    }
+    JavaVM *vm = (JavaVM*) arg;
 
-    jint interfaceCount;
-    jclass *interfaces;
+    JNIEnv *JNIInterface;
 
-    returnCode = (*jvmtiInterface)->GetImplementedInterfaces(jvmtiInterface, class, &interfaceCount, &interfaces);
-    if (returnCode != JNI_OK) {
-        error("Failed getting Class interfaces (%d)\n", returnCode)
-        if(mustLock) {
-            unlock(&classLock, false);
-        }
+    jint jniReturnCode;
+    jniReturnCode = (*vm)->AttachCurrentThreadAsDaemon(vm, (void **) &JNIInterface, NULL);
+    if (jniReturnCode != JNI_OK) {
+        error("Unable to attach to the JVM, resolver unavailable (%d)\n", (uint32_t) jniReturnCode)
+        resolverRunning = false;
         return NULL;
     }
 
-    if (interfaceCount) {
+    info("Starting the Class Resolver Thread\n")
 
-        InterfaceInfo *interfaceInfo = calloc(interfaceCount, sizeof(InterfaceInfo));
-        if (interfaceInfo <= 0) {
-            error("cannot allocate InterfaceInfo")
-            if(mustLock) {
-                unlock(&classLock, false);
+    while (true) {
+
+        lock(&resolverLock, false);
+
+        ClassNode *classNode = pendingHead;
+
+        if (classNode) {
+            pendingHead = classNode->pendingNext;
+            if (pendingHead == NULL) {
+                pendingTail = NULL;
             }
-            return NULL;
         }
 
-        classNode->numberOfInterfaces = interfaceCount;
-        classNode->interfaces = interfaceInfo;
+        unlock(&resolverLock, false);
 
-        for (int i = 0; i < interfaceCount; i++) {
+        if (classNode) {
+            // Held while the class is written, so a roll never swaps the global buffer out from under it
+            lock(&resolvingLock, false);
+            resolveClass(globalJVMTIInterface, JNIInterface, classNode);
+            unlock(&resolvingLock, false);
+            memoryBarrier();
+            resolverCompleted++;
+            continue;
+        }
 
-            char *interfaceSignature;
-            char *interfaceGeneric;
+        if (!resolverRunning) {
+            break;
+        }
 
-            returnCode = (*jvmtiInterface)->GetClassSignature(jvmtiInterface, interfaces[i], &interfaceSignature, &interfaceGeneric);
-            if (returnCode != JNI_OK) {
-                error("Failed getting interface signature (%d)\n", returnCode)
-                if(mustLock) {
-                    unlock(&classLock, false);
-                }
-                return NULL;
-            }
+        if (!resolverNudged) {
+            struct timespec ts;
+            ts.tv_sec = 0;
+            ts.tv_nsec = 1000000;
+            nanosleep(&ts, NULL);
+        }
+
+        resolverNudged = false;
 
-            if (interfaceSignature) {
+    }
 
-                ClassNode *interfaceClassNode = getClassNode(interfaceSignature);
+    (*vm)->DetachCurrentThread(vm);
 
-                if (interfaceClassNode <= 0) {
-                    debug("Discovering Interface %s on %d\n", JVMStringToPlatform(interfaceSignature), pthread_self())
-                    interfaceClassNode = discoverClass(jvmtiInterface, jni_env, interfaces[i], false);
-                    interfaceInfo[i].classID = interfaceClassNode->classID;
-                    debug("Discovering Interface %s %d on %d\n", JVMStringToPlatform(interfaceSignature), interfaceInfo[i].classID, pthread_self())
-                } else {
-                    interfaceInfo[i].classID = interfaceClassNode->classID;
-                    debug("Setting interface classID to already discovered interface class %s %d on %d\n", JVMStringToPlatform(interfaceClassNode->profilerName), interfaceInfo[i].classID, pthread_self())
-                }
+    return NULL;
 
+}
 
-            }
 
-            if (interfaceSignature)
-                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) interfaceSignature);
-            if (interfaceGeneric)
-                (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) interfaceGeneric);
+void awaitResolver() {
 
-        }
+    uint32_t queued = resolverQueued;
 
+    while (resolverRunning && (int32_t) (queued - resolverCompleted) > 0) {
+        resolverNudged = true;
+        struct timespec ts;
+        ts.tv_sec = 0;
+        ts.tv_nsec = 10000;
+        nanosleep(&ts, NULL);
     }
 
-    if (interfaces)
-        (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) interfaces);
+}
 
-    classNode->classID = atomicIncrement(&uniqueClassID);
 
-    uint32_t numberOfMethods = (uint32_t) methodCount;
+void startResolver() {
 
-    MethodIDNode *methodIDNodeList = calloc(1, (sizeof(MethodIDNode) * numberOfMethods));
-    for (int i = 0; i < numberOfMethods; i++) {
-        methodIDNodeList[i].jvmtiMethodID = methods[i];
-        methodIDNodeList[i].jvmtiClass = class;
-        methodIDNodeList[i].classID = (uint16_t) classNode->classID;
-        methodIDNodeList[i].methodID = (uint16_t) i;
-        methodIDNodeList[i].staticMethod = (classNode->methods[i].modifiers&ACC_STATIC);
-        if(i==0) methodIDNodeList[i].allocationType = LIST_ALLOCATION;
+    resolverRunning = true;
 
-        methodIDNodeList[i].next = NULL;
+    if (pthread_create(&resolverThread, NULL, classResolver, (void*) jvm)) {
+        error("Unable to start the resolver thread (%s)\n", strerror(errno))
+        resolverRunning = false;
     }
 
-    addListToMethodIDHashtable(numberOfMethods, methodIDNodeList, jvmtiInterface);
-
-    if (methods)
-        (*jvmtiInterface)->Deallocate(jvmtiInterface, (unsigned char*) methods);
-
-    addToClassHashtable(classNode);
+}
 
-    debug("Writing Class %s\n", JVMStringToPlatform(classNode->profilerName))
 
-    writeClass(globalBuffer, classNode);
+void stopResolver() {
 
-    if(mustLock) {
-        unlock(&classLock, false);
+    if (resolverRunning) {
+        resolverRunning = false;
+        pthread_join(resolverThread, NULL);
     }
 
-    return classNode;
-
 }
 
 
 void JNICALL MethodEntry(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method) {
 
-    MethodEntryInternal(jvmti_env, jni_env, thread, method, NULL);
+    MethodEntryInternal(jvmti_env, jni_env, NULL, method, NULL);
 
 }
 
 
-void inline MethodEntryInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, Buffer *buffer) {
+void refreshThreadNode(ThreadNode *threadNode) {
 
-    uint64_t start = getTicks();
+    // Cached methods were checked against an earlier file, so look them up again to define their classes in this one
 
-    jvmtiEnv *jvmtiInterface = jvmti_env;
+    memset(threadNode->methodCache, 0, sizeof(threadNode->methodCache));
+    threadNode->cacheEpoch = traceEpoch;
 
-    jvmtiError returnCode;
+    writeThreadDefine(globalBuffer, threadNode);
 
-    ThreadNode *threadNode;
+}
 
-    returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, thread, (void **) &threadNode);
 
-    if (threadNode <= 0) {
+static inline ThreadNode* lookupThreadNode(jvmtiEnv *jvmtiInterface, jthread thread) {
+
+    if (thread == NULL && cachedThreadNode && cachedThreadEpoch == threadEpoch && cachedThreadNode->cacheEpoch == traceEpoch) {
+        return cachedThreadNode;
+    }
+
+    ThreadNode *threadNode = NULL;
+
+    jvmtiError returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, thread, (void **) &threadNode);
+
+    if (returnCode != JNI_OK) {
 #ifdef __MVS__
 #pragma execution_frequency(very_low)
 #endif
-        threadNode = discoverThread(jvmtiInterface, thread);
+        error("Unable to GetThreadLocalStorage (%d)\n", returnCode)
     }
 
-    if(!buffer) {
+    if (threadNode <= 0) {
 #ifdef __MVS__
-#pragma execution_frequency(very_high)
+#pragma execution_frequency(very_low)
 #endif
-        buffer = threadNode->threadBuffer;
+        threadNode = discoverThread(jvmtiInterface, thread);
+    }
+
+    if (threadNode > 0 && threadNode->cacheEpoch != traceEpoch) {
+        refreshThreadNode(threadNode);
+    }
+
+    if (thread == NULL) {
+        cachedThreadNode = threadNode;
+        cachedThreadEpoch = threadEpoch;
     }
 
+    return threadNode;
+
+}
+
+
+static inline MethodIDNode* lookupMethodIDNode(jvmtiEnv *jvmtiInterface, JNIEnv* jni_env, ThreadNode *threadNode, jmethodID method, bool mayDefer) {
+
     uint64_t hashCode = hashUint64((uint64_t) method);
     uint32_t cacheEntry = (uint32_t) (hashCode & METHOD_CACHE_MASK);
 
@@ -2243,18 +5476,50 @@ void inline MethodEntryInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread th
         methodIDNode = getMethodIDNode(method);
         if (methodIDNode > 0) {
             threadNode->methodCache[cacheEntry] = methodIDNode;
+        } else if (mayDefer && resolverRunning) {
+            methodIDNode = reserveMethod(jvmtiInterface, jni_env, method);
+            threadNode->methodCache[cacheEntry] = methodIDNode;
         } else {
             jclass declaringClass;
-            returnCode = (*jvmtiInterface)->GetMethodDeclaringClass(jvmtiInterface, method, &declaringClass);
-            discoverClass(jvmtiInterface, jni_env, declaringClass, true);
+            (*jvmtiInterface)->GetMethodDeclaringClass(jvmtiInterface, method, &declaringClass);
+            discoverClass(jvmtiInterface, jni_env, declaringClass);
             methodIDNode = getMethodIDNode(method);
             threadNode->methodCache[cacheEntry] = methodIDNode;
         }
+        if (methodIDNode > 0) {
+            ensureClassDefined(methodIDNode->classNode);
+        }
         threadNode->cacheMisses++;
     } else {
         threadNode->cacheHits++;
     }
 
+    return methodIDNode;
+
+}
+
+
+void inline MethodEntryInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, Buffer *buffer) {
+
+    uint64_t start = getTicks();
+
+    jvmtiEnv *jvmtiInterface = jvmti_env;
+
+    jvmtiError returnCode;
+
+    ThreadNode *threadNode = lookupThreadNode(jvmtiInterface, thread);
+
+    bool mayDefer = (buffer == NULL);
+
+    if(!buffer) {
+#ifdef __MVS__
+#pragma execution_frequency(very_high)
+#endif
+        buffer = threadNode->threadBuffer;
+    }
+
+    MethodIDNode *methodIDNode = lookupMethodIDNode(jvmtiInterface, jni_env, threadNode, method, mayDefer);
+
     if (methodIDNode <= 0) {
 #ifdef __MVS__
 #pragma execution_frequency(very_low)
@@ -2263,6 +5528,25 @@ void inline MethodEntryInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread th
         return;
     }
 
+    if (methodIDNode->filtered) {
+        return;
+    }
+
+    if (!mayDefer && resolverRunning) {
+        awaitResolver();
+    }
+
+    if (profilingMode == MODE_CCT) {
+        if (threadNode->callTree) {
+            uint32_t generation = callTreeGeneration;
+            if (threadNode->callTree->generation != generation) {
+                renewCallTree(jvmtiInterface, jni_env, threadNode, generation, 1, start);
+            }
+            callTreeEnter(threadNode->callTree, methodIDNode->classID, methodIDNode->methodID, start);
+        }
+        return;
+    }
+
 
 /*
 
@@ -2274,7 +5558,7 @@ void inline MethodEntryInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread th
 #endif
         jclass declaringClass;
         returnCode = (*jvmtiInterface)->GetMethodDeclaringClass(jvmtiInterface, method, &declaringClass);
-        discoverClass(jvmtiInterface, jni_env, declaringClass, true);
+        discoverClass(jvmtiInterface, jni_env, declaringClass);
         methodIDNode = getMethodIDNode(method);
     }
 
@@ -2298,73 +5582,154 @@ void inline MethodEntryInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread th
 
             returnCode = (*jvmtiInterface)->GetTag(jvmtiInterface, this, &tag);
 
-            if (tag == 0) {
-                tag = discoverObject(buffer, jvmtiInterface, this, methodIDNode->classID);
-            } else if (returnCode != JNI_OK) {
+            if (returnCode != JNI_OK) {
                 warn("unable to tag object (%d)\n", returnCode)
+            } else if (tag == 0 || (uint32_t) ((uint64_t) tag >> 32) != traceEpoch) {
+                tag = discoverObject(buffer, jvmtiInterface, this, methodIDNode->classID, tag);
+            }
+
+        }
+    }
+
+    if (threadNode->shadowStack) {
+        deferMethodEntry(buffer, threadNode, methodIDNode->classID, methodIDNode->methodID, (uint32_t) tag, start);
+    } else {
+        writeMethodEntry(buffer, threadNode->threadID, methodIDNode->classID, methodIDNode->methodID, (uint32_t) tag, start);
+    }
+
+    uint32_t overheadPointer = threadNode->overheadPointer++;
+
+    if (overheadPointer < OVERHEAD_STACK_DEPTH) {
+        threadNode->overhead[overheadPointer] = getTicks() - start;
+    }
+
+}
+
+
+void JNICALL MethodExit(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, jboolean was_popped_by_exception, jvalue return_value) {
+
+    MethodExitInternal(jvmti_env, jni_env, NULL, method, was_popped_by_exception, return_value, NULL);
+
+}
+
+
+void inline MethodExitInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, jboolean was_popped_by_exception, jvalue return_value, Buffer *buffer) {
+
+    uint64_t start = getTicks();
+
+    jvmtiEnv *jvmtiInterface = jvmti_env;
+
+    ThreadNode *threadNode = lookupThreadNode(jvmtiInterface, thread);
+
+    if (classFilter) {
+
+        MethodIDNode *methodIDNode = lookupMethodIDNode(jvmtiInterface, jni_env, threadNode, method, true);
+
+        if (methodIDNode <= 0 || methodIDNode->filtered) {
+            return;
+        }
+
+    }
+
+    if (profilingMode == MODE_CCT) {
+        if (threadNode->callTree) {
+            uint32_t generation = callTreeGeneration;
+            if (threadNode->callTree->generation != generation) {
+                renewCallTree(jvmtiInterface, jni_env, threadNode, generation, 0, start);
             }
+            callTreeExit(threadNode->callTree, start);
+        }
+        return;
+    }
+
+    uint64_t entryOverhead = 0;
+
+    if (threadNode->overheadPointer > 0) {
+        uint32_t overheadPointer = --threadNode->overheadPointer;
+        if (overheadPointer < OVERHEAD_STACK_DEPTH) {
+            entryOverhead = threadNode->overhead[overheadPointer];
+        }
+    }
+
+    if(!buffer) {
+#ifdef __MVS__
+#pragma execution_frequency(very_high)
+#endif
+        buffer = threadNode->threadBuffer;
 
-        }
     }
 
-    writeMethodEntry(buffer, threadNode->threadID, methodIDNode->classID, methodIDNode->methodID, (uint32_t) tag, start);
+    if (threadNode->shadowStack && !completeMethodExit(buffer, threadNode, start)) {
+        return;
+    }
 
-    //threadNode->overhead[threadNode->overheadPointer++] = (getTicks() - start);
+    writeMethodExit(buffer, threadNode->threadID, start, entryOverhead);
 
 }
 
 
-void JNICALL MethodExit(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, jboolean was_popped_by_exception, jvalue return_value) {
-
-    MethodExitInternal(jvmti_env, jni_env, thread, method, was_popped_by_exception, return_value, NULL);
-
-}
-
+void JNICALL ClassFileLoadHook(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jclass class_being_redefined, jobject loader, const char* name, jobject protection_domain, jint class_data_len, const unsigned char* class_data, jint* new_class_data_len, unsigned char** new_class_data) {
 
-void inline MethodExitInternal(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, jboolean was_popped_by_exception, jvalue return_value, Buffer *buffer) {
+    debug("LoadHook Class %s\n", name ? JVMStringToPlatform(name) : "(anonymous)")
 
-    uint64_t start = getTicks();
+    if (profilingMode == MODE_INSTRUMENT && loader != NULL && class_being_redefined == NULL) {
+        if (instrumentClass(jvmti_env, classFilter, name, class_data_len, class_data, new_class_data_len, new_class_data)) {
+            readHookModule(jvmti_env, jni_env, loader, name);
+        }
+    }
 
-    jvmtiEnv *jvmtiInterface = jvmti_env;
+}
 
-    jvmtiError returnCode;
 
-    ThreadNode *threadNode;
+static inline jmethodID resolveHook(jvmtiEnv *jvmtiInterface, jint hookID) {
 
-    returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, thread, (void **) &threadNode);
+    jmethodID method = getHookMethod((uint32_t) hookID);
 
-    if (returnCode != JNI_OK) {
+    if (method == NULL) {
 #ifdef __MVS__
 #pragma execution_frequency(very_low)
 #endif
-        error("Unable to GetThreadLocalStorage (%d)\n", returnCode)
+        jlocation location;
+        jvmtiError returnCode = (*jvmtiInterface)->GetFrameLocation(jvmtiInterface, NULL, 1, &method, &location);
+        if (returnCode != JNI_OK) {
+            error("Unable to resolve hook %d (%d)\n", hookID, returnCode)
+            return NULL;
+        }
+        setHookMethod((uint32_t) hookID, method);
     }
 
-    if (threadNode <= 0) {
-#ifdef __MVS__
-#pragma execution_frequency(very_low)
-#endif
-        threadNode = discoverThread(jvmtiInterface, thread);
-    }
+    return method;
 
-//      uint64_t entryOverhead = threadNode->overhead[--threadNode->overheadPointer];
+}
 
-    if(!buffer) {
-#ifdef __MVS__
-#pragma execution_frequency(very_high)
-#endif
-        buffer = threadNode->threadBuffer;
 
+void JNICALL HookEnter(JNIEnv *jni_env, jclass hookClass, jint hookID) {
+
+    if (isUnlockedRelaxed(&profiling)) {
+        return;
     }
 
-    writeMethodExit(buffer, threadNode->threadID, start, 0);
+    jmethodID method = resolveHook(globalJVMTIInterface, hookID);
+
+    if (method) {
+        MethodEntryInternal(globalJVMTIInterface, jni_env, NULL, method, NULL);
+    }
 
 }
 
 
-void JNICALL ClassFileLoadHook(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jclass class_being_redefined, jobject loader, const char* name, jobject protection_domain, jint class_data_len, const unsigned char* class_data, jint* new_class_data_len, unsigned char** new_class_data) {
+void JNICALL HookExit(JNIEnv *jni_env, jclass hookClass, jint hookID) {
 
-    debug("LoadHook Class %s\n", JVMStringToPlatform(name))
+    if (isUnlockedRelaxed(&profiling)) {
+        return;
+    }
+
+    jmethodID method = resolveHook(globalJVMTIInterface, hookID);
+
+    if (method) {
+        jvalue value;
+        MethodExitInternal(globalJVMTIInterface, jni_env, NULL, method, JNI_FALSE, value, NULL);
+    }
 
 }
 
@@ -2392,6 +5757,49 @@ void JNICALL ClassPrepare(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread,
 
     debug("Preparing Class %s\n", JVMStringToPlatform(classSignature))
 
+    if (triggerClass && returnCode == JNI_OK && strcmp(classSignature, triggerClass) == 0) {
+        armTrigger(jvmti_env, class);
+    }
+
+}
+
+
+void JNICALL Breakpoint(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, jlocation location) {
+
+    lock(&triggerLock, false);
+
+    if (!triggerOpen) {
+        openTriggerWindow(jvmti_env, jni_env, thread);
+    } else if (triggerCount && (triggerAllThreads || (*jni_env)->IsSameObject(jni_env, thread, triggerThread))) {
+        countTriggerInvocation(jvmti_env, thread);
+    }
+
+    unlock(&triggerLock, false);
+
+}
+
+
+void JNICALL FramePop(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread, jmethodID method, jboolean was_popped_by_exception) {
+
+    lock(&triggerLock, false);
+
+    // A trigger frame watched in an earlier window may still be on the stack, below those of this window,
+    // so a thread's pops only count while it has frames watched in this one
+
+    ThreadNode *threadNode = triggerOpen ? lookupThreadNode(jvmti_env, thread) : NULL;
+
+    if (threadNode > 0 && threadNode->triggerWindow == triggerWindows && threadNode->triggerPending) {
+
+        threadNode->triggerPending--;
+
+        if (++triggerFinished >= triggerCount) {
+            triggerExpired = true;
+        }
+
+    }
+
+    unlock(&triggerLock, false);
+
 }
 
 
@@ -2407,7 +5815,11 @@ void JNICALL ThreadStart(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread) {
     returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, thread, (void **) &threadNode);
 
     if (threadNode) {
-        flushGlobalBuffer(true);
+        // Classes the thread's events refer to must be defined in the file before the events
+        if (!asyncWriter) {
+            awaitResolver();
+            flushGlobalBuffer(true);
+        }
         writeThreadExit(threadNode->threadBuffer, threadNode->threadID, start);
         flushBuffer(threadNode->threadBuffer);
     }
@@ -2427,11 +5839,24 @@ void JNICALL ThreadEnd(jvmtiEnv *jvmti_env, JNIEnv* jni_env, jthread thread) {
     returnCode = (*jvmtiInterface)->GetThreadLocalStorage(jvmtiInterface, thread, (void **) &threadNode);
 
     if (threadNode) {
-        flushGlobalBuffer(true);
+        writeThreadDefine(globalBuffer, threadNode);
+        // Classes the thread's events refer to must be defined in the file before the events
+        if (!asyncWriter) {
+            awaitResolver();
+            flushGlobalBuffer(true);
+        }
         writeThreadExit(threadNode->threadBuffer, threadNode->threadID, start);
         flushBuffer(threadNode->threadBuffer);
+
+        // The ring of an ended thread is only kept until its memory is wanted by the flight recorder
+
+        if (profilingMode == MODE_FLIGHT && threadNode->threadBuffer->ring) {
+            threadNode->threadBuffer->ring->ended = atomicIncrement(&flightEndings);
+        }
     }
 
+    cachedThreadNode = NULL;
+
 }
 
 
@@ -2441,6 +5866,23 @@ JNIEXPORT jint JNICALL Agent_Unload(JavaVM *vm, char *agentOptions, void *reserv
 }
 
 
+static uint64_t parseByteCount(const char *value) {
+
+    char *suffix;
+    uint64_t count = strtoull(value, &suffix, 10);
+
+    switch (*suffix) {
+        case 'k': case 'K': count <<= 10; break;
+        case 'm': case 'M': count <<= 20; break;
+        case 'g': case 'G': count <<= 30; break;
+        default: break;
+    }
+
+    return count;
+
+}
+
+
 JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *agentOptions, void *reserved) {
 
     parseOptions(agentOptions);
@@ -2459,16 +5901,306 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *agentOptions, void *reserv
         warn("Tagging Objects\n")
     }
 
+    Option *includeOption = getOption("include");
+    Option *excludeOption = getOption("exclude");
+
+    classFilter = createClassFilter(includeOption ? (const char*) includeOption->optionValue : NULL,
+                                    excludeOption ? (const char*) excludeOption->optionValue : NULL);
+
+    Option *traceFormatOption = getOption("traceFormat");
+
+    if (traceFormatOption && traceFormatOption->optionValue) {
+        if (strcasecmp((const char*) traceFormatOption->optionValue, "compact") == 0) {
+            compactFormat = true;
+            headerVersion = COMPACT_HEADER_VERSION;
+        } else if (strcasecmp((const char*) traceFormatOption->optionValue, "jinsight") != 0) {
+            warn("Unknown trace format %s, using jinsight\n", traceFormatOption->optionValue)
+        }
+        warn("Trace Format: %s, version %d\n", compactFormat ? "compact" : "jinsight", headerVersion)
+    }
+
+    Option *modeOption = getOption("mode");
+
+    if (modeOption && modeOption->optionValue) {
+        if (strcasecmp((const char*) modeOption->optionValue, "sample") == 0) {
+            profilingMode = MODE_SAMPLE;
+            Option *sampleIntervalOption = getOption("sampleInterval");
+            if (sampleIntervalOption && sampleIntervalOption->optionValue) {
+                sampleInterval = (uint32_t) strtoul((const char*) sampleIntervalOption->optionValue, NULL, 10);
+                if (sampleInterval == 0) {
+                    sampleInterval = 1;
+                }
+            }
+            Option *sampleDepthOption = getOption("sampleDepth");
+            if (sampleDepthOption && sampleDepthOption->optionValue) {
+                sampleDepth = (uint32_t) strtoul((const char*) sampleDepthOption->optionValue, NULL, 10);
+                if (sampleDepth == 0 || sampleDepth > UINT16_MAX) {
+                    sampleDepth = SAMPLE_MAX_DEPTH;
+                }
+            }
+            warn("Sampling Mode, interval %d ms, depth %d\n", sampleInterval, sampleDepth)
+        } else if (strcasecmp((const char*) modeOption->optionValue, "cct") == 0) {
+            profilingMode = MODE_CCT;
+            warn("Calling Context Tree Mode\n")
+        } else if (strcasecmp((const char*) modeOption->optionValue, "instrument") == 0) {
+            profilingMode = MODE_INSTRUMENT;
+            if (tagObjects) {
+                warn("tagObjects is not supported when instrumenting\n")
+                tagObjects = false;
+            }
+            if (classFilter == NULL) {
+                warn("Instrumenting every class, use include= to select classes\n")
+            }
+            warn("Instrumentation Mode\n")
+        } else if (strcasecmp((const char*) modeOption->optionValue, "flight") == 0) {
+            profilingMode = MODE_FLIGHT;
+            asyncWriter = true;
+            Option *flightMemoryOption = getOption("flightMemory");
+            if (flightMemoryOption && flightMemoryOption->optionValue) {
+                flightMemory = parseByteCount((const char*) flightMemoryOption->optionValue);
+            }
+            warn("Flight Recorder Mode, memory %" PRIu64 " bytes\n", flightMemory)
+        } else if (strcasecmp((const char*) modeOption->optionValue, "trace") != 0) {
+            warn("Unknown mode %s, using trace\n", modeOption->optionValue)
+        }
+    }
+
+    if (getOption("internStrings")) {
+        if (compactFormat) {
+            internStrings = true;
+            warn("Interned Class Strings\n")
+        } else {
+            warn("internStrings requires traceFormat=compact\n")
+        }
+    }
+
+    Option *asyncResolverOption = getOption("asyncResolver");
+
+    if (asyncResolverOption) {
+        if (tagObjects || profilingMode == MODE_INSTRUMENT) {
+            warn("asyncResolver is not supported with tagObjects or instrument mode\n")
+        } else {
+            asyncResolver = true;
+            warn("Asynchronous Class Resolver\n")
+        }
+    }
+
+    Option *minDurationOption = getOption("minDuration");
+
+    if (minDurationOption && minDurationOption->optionValue) {
+        if (profilingMode == MODE_TRACE || profilingMode == MODE_INSTRUMENT || profilingMode == MODE_FLIGHT) {
+            minDuration = strtoull((const char*) minDurationOption->optionValue, NULL, 10);
+            warn("Minimum Duration %" PRIu64 " ns\n", minDuration)
+        } else {
+            warn("minDuration only applies to trace, instrument and flight modes\n")
+        }
+    }
+
+    Option *triggerMethodOption = getOption("triggerMethod");
+
+    if (triggerMethodOption && triggerMethodOption->optionValue) {
+
+        char *value = (char*) triggerMethodOption->optionValue;
+        char *signature = strchr(value, '(');
+        char *separator = NULL;
+
+        for (char *c = value; *c && c != signature; c++) {
+            if (*c == '.') {
+                separator = c;
+            }
+        }
+
+        if (profilingMode != MODE_TRACE && profilingMode != MODE_CCT) {
+            warn("triggerMethod only applies to trace and cct modes\n")
+        } else if (separator == NULL) {
+            warn("triggerMethod needs a class and a method, e.g. com/ourco/Foo.bar\n")
+        } else {
+
+            uint32_t classLength = (uint32_t) (separator - value);
+            uint32_t methodLength = (uint32_t) ((signature ? signature : value + strlen(value)) - separator - 1);
+            char *className = calloc(1, classLength + 3);
+            char *methodName = calloc(1, methodLength + 1);
+            if (className <= 0 || methodName <= 0) {
+                error("Unable to allocate the trigger method name\n")
+                exit(-1);
+            }
+
+            className[0] = 'L';
+            for (uint32_t i = 0; i < classLength; i++) {
+                className[i + 1] = (value[i] == '.') ? '/' : value[i];
+            }
+            className[classLength + 1] = ';';
+
+            memcpy(methodName, separator + 1, methodLength);
+
+            triggerClass = strdup(platformStringToJVM(className));
+            triggerMethod = strdup(platformStringToJVM(methodName));
+            triggerSignature = signature ? strdup(platformStringToJVM(signature)) : NULL;
+
+            free(className);
+            free(methodName);
+
+            Option *triggerDurationOption = getOption("triggerDuration");
+            if (triggerDurationOption && triggerDurationOption->optionValue) {
+                triggerDuration = (uint32_t) strtoul((const char*) triggerDurationOption->optionValue, NULL, 10);
+            }
+
+            Option *triggerCountOption = getOption("triggerCount");
+            if (triggerCountOption && triggerCountOption->optionValue) {
+                triggerCount = (uint32_t) strtoul((const char*) triggerCountOption->optionValue, NULL, 10);
+            }
+
+            if (triggerDuration == 0 && triggerCount == 0) {
+                triggerCount = 1;
+            }
+
+            Option *triggerScopeOption = getOption("triggerScope");
+            if (triggerScopeOption && triggerScopeOption->optionValue) {
+                if (strcasecmp((const char*) triggerScopeOption->optionValue, "all") == 0) {
+                    triggerAllThreads = true;
+                } else if (strcasecmp((const char*) triggerScopeOption->optionValue, "thread") != 0) {
+                    warn("Unknown triggerScope %s, using thread\n", triggerScopeOption->optionValue)
+                }
+            }
+
+            warn("Trigger Method: %s, duration %d ms, count %d, %s\n", value, triggerDuration, triggerCount, triggerAllThreads ? "all threads" : "trigger thread")
+
+        }
+
+    }
+
+    Option *asyncWriterOption = getOption("asyncWriter");
+
+    if (asyncWriterOption) {
+        asyncWriter = true;
+        Option *writerLatencyOption = getOption("writerLatency");
+        if (writerLatencyOption && writerLatencyOption->optionValue) {
+            writerLatency = (uint32_t) strtoul((const char*) writerLatencyOption->optionValue, NULL, 10);
+            if (writerLatency == 0) {
+                writerLatency = 1;
+            }
+        }
+        warn("Asynchronous Writer, latency %d ms\n", writerLatency)
+    }
+
+    Option *rollSizeOption = getOption("rollSize");
+
+    if (rollSizeOption && rollSizeOption->optionValue) {
+        rollSize = parseByteCount((const char*) rollSizeOption->optionValue);
+        warn("Roll Size: %" PRIu64 " bytes\n", rollSize)
+    }
+
+    Option *rollIntervalOption = getOption("rollInterval");
+
+    if (rollIntervalOption && rollIntervalOption->optionValue) {
+        rollInterval = (uint32_t) strtoul((const char*) rollIntervalOption->optionValue, NULL, 10);
+        warn("Roll Interval: %d s\n", rollInterval)
+    }
+
+    if (profilingMode == MODE_FLIGHT && (rollSize || rollInterval)) {
+        warn("rollSize and rollInterval do not apply to flight mode\n")
+        rollSize = 0;
+        rollInterval = 0;
+    }
+
+    Option *keepFilesOption = getOption("keepFiles");
+
+    if (keepFilesOption && keepFilesOption->optionValue) {
+        keepFiles = (uint32_t) strtoul((const char*) keepFilesOption->optionValue, NULL, 10);
+        if (keepFiles) {
+            keptFiles = calloc(keepFiles, sizeof(char*));
+            if (keptFiles <= 0) {
+                error("Unable to allocate the kept file names\n")
+                keepFiles = 0;
+            }
+        }
+        warn("Keep Files: %d\n", keepFiles)
+    }
+
+    Option *compressionOption = getOption("compression");
+
+    if (compressionOption && compressionOption->optionValue) {
+        uint32_t compressionThreads = OUTPUT_COMPRESSION_THREADS;
+        Option *compressionThreadsOption = getOption("compressionThreads");
+        if (compressionThreadsOption && compressionThreadsOption->optionValue) {
+            compressionThreads = (uint32_t) strtoul((const char*) compressionThreadsOption->optionValue, NULL, 10);
+        }
+        configureOutput((const char*) compressionOption->optionValue, compressionThreads);
+    }
+
+    if (getOption("mapTraceFile")) {
+        configureMappedOutput();
+    }
+
+    Option *ioOption = getOption("io");
+
+    if (ioOption && ioOption->optionValue) {
+        if (strcmp((const char*) ioOption->optionValue, "uring") == 0) {
+            configureUringOutput();
+        } else if (strcmp((const char*) ioOption->optionValue, "stdio") != 0) {
+            warn("Unknown io %s, using stdio\n", ioOption->optionValue)
+        }
+    }
+
     Option *traceDirectoryOption = getOption("traceDirectory");
 
+    // Owned, as the rollPolicy command replaces and frees it
+
     if (traceDirectoryOption) {
-        traceDirectory = (char*) traceDirectoryOption->optionValue;
+        traceDirectory = strdup((char*) traceDirectoryOption->optionValue);
         warn("Trace Directory: %s\n", traceDirectory)
     } else {
-        traceDirectory = "/tmp/";
+        traceDirectory = strdup("/tmp/");
+    }
+
+    if (getOption("benchmark")) {
+        benchmarkOutput(traceDirectory);
+    }
+
+    Option *controlPortOption = getOption("controlPort");
+
+    if (controlPortOption && controlPortOption->optionValue) {
+        controlPort = (uint32_t) strtoul((const char*) controlPortOption->optionValue, NULL, 10);
+        if (controlPort > UINT16_MAX) {
+            warn("Invalid control port %d, the network controller is off\n", controlPort)
+            controlPort = 0;
+        }
+    }
+
+    Option *controlAddressOption = getOption("controlAddress");
+
+    if (controlAddressOption && controlAddressOption->optionValue) {
+        controlAddress = (char*) controlAddressOption->optionValue;
+    }
+
+    if (controlPort) {
+        warn("Control Port: %s:%d\n", controlAddress, controlPort)
+    }
+
+    Option *streamTraceOption = getOption("streamTrace");
+
+    if (streamTraceOption) {
+
+        bool withoutFile = streamTraceOption->optionValue && strcmp((const char*) streamTraceOption->optionValue, "only") == 0;
+
+        uint64_t streamBuffer = OUTPUT_COLLECTOR_BUFFER_LENGTH;
+        Option *streamBufferOption = getOption("streamBuffer");
+        if (streamBufferOption && streamBufferOption->optionValue) {
+            streamBuffer = parseByteCount((const char*) streamBufferOption->optionValue);
+        }
+
+        if (controlPort == 0) {
+            warn("streamTrace needs controlPort=, not streaming\n")
+        } else if (streamBuffer == 0) {
+            warn("streamBuffer must not be 0, not streaming\n")
+        } else {
+            streamTrace = configureCollector(streamBuffer, withoutFile);
+        }
     }
 
     jvm = vm;
+    metadataArena = createArena("metadataArena");
+    createInternTable(metadataArena);
     createMethodIDHashtable();
     createClassHashtable();
     createThreadHashtable();
@@ -2491,13 +6223,20 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *agentOptions, void *reserv
         return JNI_ERR;
     }
 
-    requiredCapabilities->can_generate_method_entry_events = 1;
-    requiredCapabilities->can_generate_method_exit_events = 1;
+    if (usesMethodEvents()) {
+        requiredCapabilities->can_generate_method_entry_events = 1;
+        requiredCapabilities->can_generate_method_exit_events = 1;
+    }
     requiredCapabilities->can_generate_all_class_hook_events = 1;
     requiredCapabilities->can_access_local_variables = 1;
     requiredCapabilities->can_tag_objects = 1;
     requiredCapabilities->can_suspend = 1;
 
+    if (triggerClass) {
+        requiredCapabilities->can_generate_breakpoint_events = 1;
+        requiredCapabilities->can_generate_frame_pop_events = 1;
+    }
+
     returnCode = (*jvmtiInterface)->AddCapabilities(jvmtiInterface, requiredCapabilities);
     if (returnCode != JNI_OK) {
         error("Unable to obtain the required capabilities (%d)\n", returnCode)
@@ -2520,6 +6259,8 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *agentOptions, void *reserv
     eventCallbacks->ClassLoad = &ClassLoad;
     eventCallbacks->ClassPrepare = &ClassPrepare;
     eventCallbacks->ClassFileLoadHook = &ClassFileLoadHook;
+    eventCallbacks->Breakpoint = &Breakpoint;
+    eventCallbacks->FramePop = &FramePop;
 
     returnCode = (*jvmtiInterface)->SetEventCallbacks(jvmtiInterface, eventCallbacks, sizeof(jvmtiEventCallbacks));
     if (returnCode != JNI_OK) {
@@ -2545,16 +6286,20 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *agentOptions, void *reserv
         return JNI_ERR;
     }
 
-    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread) NULL);
-    if (returnCode != JNI_OK) {
-        error("Unable to disable JVMTI_EVENT_METHOD_ENTRY (%d)\n", returnCode)
-        return JNI_ERR;
-    }
+    if (usesMethodEvents()) {
+
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_METHOD_ENTRY, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to disable JVMTI_EVENT_METHOD_ENTRY (%d)\n", returnCode)
+            return JNI_ERR;
+        }
+
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_METHOD_EXIT, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to disable JVMTI_EVENT_METHOD_EXIT (%d)\n", returnCode)
+            return JNI_ERR;
+        }
 
-    returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_METHOD_EXIT, (jthread) NULL);
-    if (returnCode != JNI_OK) {
-        error("Unable to disable JVMTI_EVENT_METHOD_EXIT (%d)\n", returnCode)
-        return JNI_ERR;
     }
 
     returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_CLASS_PREPARE, (jthread) NULL);
@@ -2575,6 +6320,30 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *agentOptions, void *reserv
         return JNI_ERR;
     }
 
+    if (profilingMode == MODE_INSTRUMENT) {
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to enable JVMTI_EVENT_CLASS_FILE_LOAD_HOOK (%d)\n", returnCode)
+            return JNI_ERR;
+        }
+    }
+
+    if (triggerClass) {
+
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to enable JVMTI_EVENT_CLASS_PREPARE (%d)\n", returnCode)
+            return JNI_ERR;
+        }
+
+        returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_ENABLE, JVMTI_EVENT_BREAKPOINT, (jthread) NULL);
+        if (returnCode != JNI_OK) {
+            error("Unable to enable JVMTI_EVENT_BREAKPOINT (%d)\n", returnCode)
+            return JNI_ERR;
+        }
+
+    }
+
     returnCode = (*jvmtiInterface)->SetEventNotificationMode(jvmtiInterface, JVMTI_DISABLE, JVMTI_EVENT_THREAD_END, (jthread) NULL);
     if (returnCode != JNI_OK) {
         error("Unable to disable JVMTI_EVENT_THREAD_END (%d)\n", returnCode)
@@ -2587,57 +6356,55 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *agentOptions, void *reserv
         return JNI_ERR;
     }
 
-    uint8_t *traceFileName = generateTraceFileName();
-
-    openTraceFile((char*) traceFileName);
-
-    info("Trace File: %s\n", traceFileName)
-
-    if (traceFile <= 0) {
-        error("Unable to open trace file %s\n", traceFileName)
-        return JNI_ERR;
-    }
-
-    globalBuffer = allocateBuffer(GLOBAL_BUFFER_LENGTH, true);
-
-#ifdef __WIN32__
-
-    uint64_t qpcFrequency;
-    QueryPerformanceFrequency((LARGE_INTEGER *) &qpcFrequency);
-    headerTicksPerMicrosecond = (uint32_t) (qpcFrequency / 1000);
+    if (profilingMode != MODE_FLIGHT) {
 
-#endif
-#ifdef __linux
+        uint8_t *traceFileName = generateTraceFileName();
 
-    uint32_t loops = 10;
-    uint32_t total = 0;
+        openTraceFile((char*) traceFileName);
 
-    for(int i=0;i<loops;i++) {
-        uint64_t start = getTicks();
+        info("Trace File: %s\n", traceFileName)
 
-        struct timespec ts;
-        ts.tv_sec = 0;
-        ts.tv_nsec = 10000000;
-        nanosleep(&ts, NULL);
+        if (!isOutputOpen()) {
+            error("Unable to open trace file %s\n", traceFileName)
+            return JNI_ERR;
+        }
 
-        uint64_t stop= getTicks();
-        total+=(stop-start);
     }
 
-    headerTicksPerMicrosecond = ((total/loops)/10000);
+    globalBuffer = allocateBuffer(GLOBAL_BUFFER_LENGTH, true);
+    registerLock("globalBuffer", &globalBuffer->lock);
+    registerLock("fileLock", &fileLock);
+    registerLock("writerLock", &writerLock);
+    registerLock("classLock", &classLock);
+    registerLock("resolverLock", &resolverLock);
+    registerLock("resolvingLock", &resolvingLock);
+    registerLock("triggerLock", &triggerLock);
 
-#endif
+    Option *tickSourceOption = getOption("tickSource");
 
-#ifdef __MVS__
+    headerTicksPerSecond = selectTickSource(tickSourceOption ? (const char*) tickSourceOption->optionValue : NULL);
+    headerTicksPerMicrosecond = (uint32_t) ((headerTicksPerSecond + 500000) / 1000000);
 
-    headerTicksPerMicrosecond = 4096;
+    info("Tick source: %s, %" PRIu64 " ticks per second\n", getTickSourceName(tickSource), headerTicksPerSecond)
 
-#endif
+    if (minDuration) {
+        minDurationTicks = (uint64_t) ((double) minDuration * headerTicksPerSecond / 1000000000.0);
+        if (minDurationTicks == 0) {
+            minDurationTicks = 1;
+        }
+    }
 
     headerVMStartTime = time(NULL);
     headerConnectionStartTime = headerVMStartTime;
-    headerOverhead = 0;
-    writeDefaultHeader(globalBuffer);
+    calibrateOverhead();
+
+    if (profilingMode != MODE_FLIGHT) {
+        writeDefaultHeader(globalBuffer);
+    }
+
+    if (asyncWriter && profilingMode != MODE_FLIGHT) {
+        startWriter();
+    }
 
     return JNI_OK;
 }
@@ -15,6 +15,36 @@
 
 #define GLOBAL_BUFFER_LENGTH 1048576
 #define THREAD_BUFFER_LENGTH 1048576
+#define THREAD_CHUNK_LENGTH 65536
+#define THREAD_CHUNKS 16
+#define WRITER_LATENCY_MS 100
+#define ROLL_CHECK_MS 10
+#define ROLL_MARKER_LENGTH 256
+#define FLIGHT_CHUNK_LENGTH 16384
+#define FLIGHT_THREAD_CHUNKS 256
+#define FLIGHT_MIN_CHUNKS 2
+#define FLIGHT_MEMORY 67108864
+#define FLIGHT_CHECK_MS 10
+#define TRIGGER_CHECK_MS 10
+#define SAMPLER_BUFFER_LENGTH 1048576
+#define SAMPLE_INTERVAL_MS 10
+#define SAMPLE_MAX_DEPTH 128
+#define CALL_TREE_WIND_DEPTH 2048
+#define CONTROL_FRAME_MARKER 0x7E
+#define CONTROL_COMMAND_LENGTH 65536
+#define CONTROL_REPLY_LENGTH 4096
+#define CONTROL_MAX_ARGUMENTS 16
+#define CONTROL_ADDRESS "127.0.0.1"
+#define CONTROL_IDLE_SECONDS 10
+#define BENCHMARK_LOOPS 1000000
+#define CALIBRATION_LOOPS 10000
+#define CALIBRATION_ROUNDS 16
+
+#define MODE_TRACE 0
+#define MODE_SAMPLE 1
+#define MODE_INSTRUMENT 2
+#define MODE_CCT 3
+#define MODE_FLIGHT 4
 
 #define EVENT_BEGIN_BURST 101
 #define EVENT_END_BURST 102
@@ -27,8 +57,29 @@
 #define EVENT_THREAD_DEFINE 10
 #define EVENT_THREAD_START 11
 #define EVENT_THREAD_EXIT 12
+#define EVENT_THREAD_BLOCK 120
+#define EVENT_COMPACT_METHOD_ENTER 121
+#define EVENT_COMPACT_METHOD_ENTER_OBJECT 122
+#define EVENT_COMPACT_METHOD_LEAVE 123
+#define EVENT_COMPACT_THREAD_METHOD_ENTER 124
+#define EVENT_COMPACT_THREAD_METHOD_ENTER_OBJECT 125
+#define EVENT_COMPACT_THREAD_METHOD_LEAVE 126
+#define EVENT_STACK_SAMPLE 127
+#define EVENT_CALL_TREE 128
+#define EVENT_STRING_DEFINE 129
+#define EVENT_INTERNED_CLASS_LOAD 130
+
+#define JINSIGHT_HEADER_VERSION 8
+#define COMPACT_HEADER_VERSION 10
+#define BLOCK_HEADER_LENGTH 9
+#define COMPACT_MAX_RECORD_LENGTH 32
+#define CALL_TREE_MAX_RECORD_LENGTH 64
+#define VARINT_MAX_LENGTH 5
+#define REGISTRY_CLASS_ID_LIMIT 61440
 
 typedef struct Option_struct Option;
+typedef struct ControlCounters_struct ControlCounters;
+typedef struct CallTreeMerge_struct CallTreeMerge;
 
 #ifdef __WIN32__
 typedef struct EventCleanupStruct_struct EventCleanupStruct;
@@ -36,6 +87,7 @@ struct EventCleanupStruct_struct {
     HANDLE startEvent;
     HANDLE stopEvent;
     HANDLE rollEvent;
+    HANDLE dumpEvent;
 };
 #endif
 
@@ -47,9 +99,25 @@ struct Option_struct {
     uint8_t *optionValue;
 };
 
+struct ControlCounters_struct {
+    uint64_t events;
+    uint64_t cacheHits;
+    uint64_t cacheMisses;
+    uint32_t threads;
+};
+
+struct CallTreeMerge_struct {
+    CallTree *target;
+    uint32_t generation;
+    uint64_t ticks;
+};
+
+void freeBuffer(Buffer *buffer);
 void getAllThreads(jvmtiEnv *jvmtiInterface, jint *numberOfThreads, jthread **threads);
 void startProfiling(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env);
 void stopProfiling(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env);
 void rollTraceFile(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env);
+void dumpFlightRecorder();
+void executeCommand(jvmtiEnv *jvmtiInterface, JNIEnv *jni_env, char *command, char *reply, uint32_t replyLength);
 
 #endif /* PROFILER_H_ */
@@ -10,16 +10,38 @@
 #include <inttypes.h>
 #include "tables.h"
 #include "util.h"
+#include "intern.h"
+#include "output.h"
 
 MethodIDHashtable *methodIDHashtable;
 ClassHashtable *classHashtable;
 ThreadHashtable *threadHashtable;
+Arena *metadataArena;
+
+static MethodIDTable* allocateMethodIDTable(uint32_t capacity) {
+
+    MethodIDTable *table = calloc(1, sizeof(MethodIDTable) + (sizeof(MethodIDSlot) * capacity));
+    if(table<=0) {
+        error("Unable to allocate MethodIDTable\n");
+        return NULL;
+    }
+
+    table->capacity = capacity;
+    table->mask = capacity - 1;
+    return table;
+
+}
 
 void createMethodIDHashtable() {
     methodIDHashtable = calloc(1, sizeof(MethodIDHashtable));
     if(methodIDHashtable<=0) {
         exit(-1);
     }
+    methodIDHashtable->current = allocateMethodIDTable(METHOD_ID_TABLE_CAPACITY);
+    if(methodIDHashtable->current<=0) {
+        exit(-1);
+    }
+    registerLock("methodIDHashtable", &methodIDHashtable->lock);
 
 }
 
@@ -28,6 +50,7 @@ void createClassHashtable() {
     if(classHashtable<=0) {
         exit(-1);
     }
+    registerLock("classHashtable", &classHashtable->lock);
 
 }
 
@@ -36,6 +59,7 @@ void createThreadHashtable() {
     if(threadHashtable<=0) {
         exit(-1);
     }
+    registerLock("threadHashtable", &threadHashtable->lock);
 
 }
 
@@ -91,29 +115,66 @@ ClassNode* getClassNode(char *name) {
 
 }
 
+static inline MethodIDNode* probeMethodIDTable(MethodIDTable *table, jmethodID jvmtiMethodID, uint64_t hashCode) {
+
+    uint32_t index = (uint32_t) (hashCode & table->mask);
+
+    while(true) {
+
+        jmethodID key = table->slots[index].jvmtiMethodID;
+
+        if(key == jvmtiMethodID) {
+            return table->slots[index].node;
+        }
+
+        if(key == NULL) {
+            return NULL;
+        }
+
+        index = (index + 1) & table->mask;
+    }
+
+}
+
 MethodIDNode* getMethodIDNode(jmethodID jvmtiMethodID) {
 
     if(jvmtiMethodID<=0) return NULL;
 
     uint64_t hashCode = hashUint64((uintptr_t)jvmtiMethodID);
-    uint32_t key = (uint32_t) (hashCode & METHOD_ID_HASHTABLE_MASK);
 
-    volatile MethodIDBucket *bucket = methodIDHashtable->buckets[key];
+    MethodIDNode *node = probeMethodIDTable(methodIDHashtable->current, jvmtiMethodID, hashCode);
+    if(node>0) {
+        return node;
+    }
 
-    if(bucket>0) {
+    // A miss is only trusted if no resize started or finished while both tables were probed
 
-        volatile MethodIDNode *node = bucket->rootNode;
+    uint32_t sequence;
 
-        while(node>0) {
+    do {
 
-            if(node->jvmtiMethodID == jvmtiMethodID) {
-                return (MethodIDNode*)node;
-            }
+        sequence = methodIDHashtable->sequence;
+        if(sequence & 1) {
+            cpuRelax();
+            continue;
+        }
 
-            node = node->next;
+        memoryBarrier();
+
+        MethodIDTable *previous = methodIDHashtable->previous;
+        node = probeMethodIDTable(methodIDHashtable->current, jvmtiMethodID, hashCode);
+
+        if(node<=0 && previous>0) {
+            node = probeMethodIDTable(previous, jvmtiMethodID, hashCode);
         }
 
-    }
+        if(node>0) {
+            return node;
+        }
+
+        memoryBarrier();
+
+    } while((sequence & 1) || sequence != methodIDHashtable->sequence);
 
     return NULL;
 
@@ -147,85 +208,139 @@ ThreadNode* getThreadNode(uint32_t threadID) {
 
 }
 
-void addListToMethodIDHashtable(uint32_t numberOfMethods, MethodIDNode *methodIDNodeList, jvmtiEnv *jvmtiInterface) {
+static bool insertIntoMethodIDTable(MethodIDTable *table, MethodIDNode *node) {
 
-    lock(&methodIDHashtable->lock, false);
+    uint32_t index = (uint32_t) (hashUint64((uintptr_t) node->jvmtiMethodID) & table->mask);
 
-    for (int i = 0; i < numberOfMethods; i++) {
+    while(true) {
 
-        uint64_t hashCode = hashUint64((uintptr_t) methodIDNodeList[i].jvmtiMethodID);
-        uint32_t key = (uint32_t) (hashCode & METHOD_ID_HASHTABLE_MASK);
+        jmethodID key = table->slots[index].jvmtiMethodID;
 
-        MethodIDBucket *bucket = methodIDHashtable->buckets[key];
+        if(key == node->jvmtiMethodID) {
+            return false;
+        }
 
-        if (methodIDHashtable->buckets[key] <= 0) {
-           bucket = calloc(1, sizeof(MethodIDBucket));
-            if (bucket <= 0) {
-                error("Unable to allocate MethodIDBucket\n");
-                unlock(&methodIDHashtable->lock, false);
-                return;
-            }
+        if(key == NULL) {
+            table->slots[index].node = node;
+            memoryBarrier();
+            table->slots[index].jvmtiMethodID = node->jvmtiMethodID;
+            table->entries++;
+            return true;
+        }
 
-           if (!compareAndSwapPtrBool((volatile uintptr_t *) &methodIDHashtable->buckets[key], NULL, bucket)) {
-                error("Bucket was supposed to be NULL!\n");
-            }
+        index = (index + 1) & table->mask;
+    }
 
-        }
+}
 
-        volatile MethodIDNode *newNode = &methodIDNodeList[i];
-        if (!compareAndSwapPtrBool((volatile uintptr_t*) &bucket->rootNode, NULL, newNode)) {
+static void migrateMethodIDTable(uint32_t numberOfSlots) {
 
-            volatile MethodIDNode *node = bucket->rootNode;
-            while (!compareAndSwapPtrBool((volatile uintptr_t *) &node->next, NULL, newNode)) {
+    MethodIDTable *previous = methodIDHashtable->previous;
+    if(previous<=0) {
+        return;
+    }
 
-                node = node->next;
-            }
+    uint32_t limit = methodIDHashtable->migrated + numberOfSlots;
+    if(limit > previous->capacity) {
+        limit = previous->capacity;
+    }
+
+    for(; methodIDHashtable->migrated < limit; methodIDHashtable->migrated++) {
 
+        MethodIDSlot *slot = &previous->slots[methodIDHashtable->migrated];
+        if(slot->jvmtiMethodID != NULL) {
+            insertIntoMethodIDTable(methodIDHashtable->current, slot->node);
         }
+    }
 
-        bucket->chainLength++;
+    if(methodIDHashtable->migrated == previous->capacity) {
 
-    }
+        // Readers may still be probing the old table so it is only freed when the hashtable is cleared
 
-    unlock(&methodIDHashtable->lock, false);
+        methodIDHashtable->sequence++;
+        memoryBarrier();
+        methodIDHashtable->previous = NULL;
+        memoryBarrier();
+        methodIDHashtable->sequence++;
+
+        previous->retired = methodIDHashtable->retired;
+        methodIDHashtable->retired = previous;
+    }
 
 }
 
+static void growMethodIDHashtable() {
 
+    if(methodIDHashtable->previous>0) {
+        migrateMethodIDTable(methodIDHashtable->previous->capacity);
+    }
 
-void addToMethodIDHashtable(jmethodID jvmtiMethodID, jclass jvmtiClass, uint16_t classID, uint16_t methodID) {
+    MethodIDTable *table = allocateMethodIDTable(methodIDHashtable->current->capacity << 1);
+    if(table<=0) {
+        return;
+    }
 
-    uint64_t hashCode = hashUint64((uint64_t)jvmtiMethodID);
-    uint32_t key = (uint32_t) (hashCode & METHOD_ID_HASHTABLE_MASK);
+    methodIDHashtable->sequence++;
+    memoryBarrier();
+    methodIDHashtable->previous = methodIDHashtable->current;
+    methodIDHashtable->current = table;
+    memoryBarrier();
+    methodIDHashtable->sequence++;
 
-    lock(&methodIDHashtable->lock, false);
+    methodIDHashtable->migrated = 0;
+    methodIDHashtable->resizes++;
 
-    MethodIDBucket *bucket = methodIDHashtable->buckets[key];
+}
 
-    if(bucket<=0) {
+static void insertIntoMethodIDHashtable(MethodIDNode *node) {
 
-        bucket = methodIDHashtable->buckets[key];
-        if(bucket<=0) {
-            bucket = calloc(1, sizeof(MethodIDBucket));
-            if(bucket<=0) {
-                error("Unable to allocate MethodIDBucket\n");
-                unlock(&methodIDHashtable->lock, false);
-                return;
-            }
+    migrateMethodIDTable(METHOD_ID_TABLE_MIGRATION_STEP);
 
-            if(!compareAndSwapPtrBool((volatile uintptr_t *)&methodIDHashtable->buckets[key], NULL, bucket)) {
-                error("Bucket was supposed to be NULL!\n");
-            }
+    MethodIDTable *current = methodIDHashtable->current;
+
+    if((current->entries + 1) * 2 > current->capacity) {
+        growMethodIDHashtable();
+        current = methodIDHashtable->current;
+        if(current->entries + 1 >= current->capacity) {
+            error("MethodIDHashtable is full\n");
+            return;
         }
+    }
+
+    // The first node registered for a jmethodID wins, as it did with the bucket chains
 
+    MethodIDTable *previous = methodIDHashtable->previous;
+    if(previous>0 && probeMethodIDTable(previous, node->jvmtiMethodID, hashUint64((uintptr_t) node->jvmtiMethodID))>0) {
+        return;
+    }
+
+    if(insertIntoMethodIDTable(current, node)) {
+        methodIDHashtable->entries++;
     }
 
-    lock(&bucket->lock, false);
+}
+
+void addListToMethodIDHashtable(uint32_t numberOfMethods, MethodIDNode *methodIDNodeList, jvmtiEnv *jvmtiInterface) {
+
+    lock(&methodIDHashtable->lock, false);
 
-    MethodIDNode *newNode = calloc(1, sizeof(MethodIDNode));
+    for (int i = 0; i < numberOfMethods; i++) {
+        insertIntoMethodIDHashtable(&methodIDNodeList[i]);
+    }
+
+    unlock(&methodIDHashtable->lock, false);
+
+}
+
+
+
+void addToMethodIDHashtable(jmethodID jvmtiMethodID, jclass jvmtiClass, uint16_t classID, uint16_t methodID) {
+
+    lock(&methodIDHashtable->lock, false);
+
+    MethodIDNode *newNode = arenaAllocate(metadataArena, sizeof(MethodIDNode));
     if(newNode<=0) {
         error("Unable to allocateMethodIDNode\n");
-        unlock(&bucket->lock, false);
         unlock(&methodIDHashtable->lock, false);
         return;
     }
@@ -234,27 +349,52 @@ void addToMethodIDHashtable(jmethodID jvmtiMethodID, jclass jvmtiClass, uint16_t
     newNode->jvmtiClass = jvmtiClass;
     newNode->classID = classID;
     newNode->methodID = methodID;
-    newNode->allocationType = SINGLE_ALLOCATION;
 
-    if(!compareAndSwapPtrBool((volatile uintptr_t *)&bucket->rootNode, NULL, newNode)) {
+    insertIntoMethodIDHashtable(newNode);
+
+    unlock(&methodIDHashtable->lock, false);
+
+}
+
+
+static ClassBucket* getClassBucket(uint32_t key) {
+
+    ClassBucket *bucket = classHashtable->buckets[key];
+
+    if(bucket<=0) {
+
+        bucket = arenaAllocate(metadataArena, sizeof(ClassBucket));
+        if(bucket<=0) {
+            error("Unable to allocate ClassBucket\n");
+            return NULL;
+        }
 
-        volatile MethodIDNode *node = bucket->rootNode;
+        if(!compareAndSwapPtrBool(( uintptr_t *)&classHashtable->buckets[key], NULL, bucket)) {
+            bucket = classHashtable->buckets[key];
+        }
 
-        while(!compareAndSwapPtrBool((volatile uintptr_t *)&node->next, NULL, newNode)) {
+    }
+
+    return bucket;
+
+}
+
+static void appendClassNode(ClassBucket *bucket, ClassNode *classNode) {
+
+    if(!compareAndSwapPtrBool(( uintptr_t *)&bucket->rootNode, NULL, classNode)) {
+
+        ClassNode *node = bucket->rootNode;
+
+        while(!compareAndSwapPtrBool(( uintptr_t *)&node->next, NULL, classNode)) {
             node = node->next;
         }
 
-    } else {
     }
 
     bucket->chainLength++;
 
-    unlock(&bucket->lock, false);
-    unlock(&methodIDHashtable->lock, false);
-
 }
 
-
 void addToClassHashtable(ClassNode *classNode) {
 
     uint32_t hashCode = jenkins_one_at_a_time_hash((char*)classNode->name, strlen((const char*)classNode->name));
@@ -266,40 +406,100 @@ void addToClassHashtable(ClassNode *classNode) {
 
     classNode->hashCode = hashCode;
 
-    ClassBucket *bucket = classHashtable->buckets[key];
+    ClassBucket *bucket = getClassBucket(key);
+
+    if(bucket>0) {
+        appendClassNode(bucket, classNode);
+    }
+
+    unlock(&classHashtable->lock, true);
+
+}
+
+/*
+ * Inserts classNode locked, as the in progress marker for its name, unless another
+ * thread is already discovering a class of that name, in which case that node is returned
+ */
+ClassNode* claimClassNode(ClassNode *classNode) {
+
+    uint32_t hashCode = jenkins_one_at_a_time_hash((char*)classNode->name, strlen((const char*)classNode->name));
+    uint32_t key = hashCode & CLASS_HASHTABLE_MASK;
+
+    lock(&classHashtable->lock, true);
+
+    ClassBucket *bucket = getClassBucket(key);
 
     if(bucket<=0) {
+        unlock(&classHashtable->lock, true);
+        return NULL;
+    }
 
-        bucket = calloc(1, sizeof(ClassBucket));
-        if(bucket<=0) {
-            error("Unable to allocate ClassBucket\n");
+    for(ClassNode *node = bucket->rootNode; node>0; node = node->next) {
+        if(node->hashCode==hashCode && isLocked(&node->lock) && strcmp((const char*)node->name, (const char*)classNode->name)==0) {
             unlock(&classHashtable->lock, true);
-            return;
+            return node;
         }
+    }
 
-        if(!compareAndSwapPtrBool(( uintptr_t *)&classHashtable->buckets[key], NULL, bucket)) {
-            free(bucket);
-            bucket = classHashtable->buckets[key];
-        }
+    classNode->hashCode = hashCode;
+    classNode->lock = LOCKED;
 
-    }
+    appendClassNode(bucket, classNode);
 
-    if(!compareAndSwapPtrBool(( uintptr_t *)&bucket->rootNode, NULL, classNode)) {
+    unlock(&classHashtable->lock, true);
 
-        ClassNode *node = bucket->rootNode;
+    return classNode;
 
-        while(!compareAndSwapPtrBool(( uintptr_t *)&node->next, NULL, classNode)) {
-            node = node->next;
+}
+
+/*
+ * Unlinks a claimed node whose discovery failed, so the next lookup of its name discovers the class again. The node
+ * itself stays in the arena, so walks of the chain already on it carry on past it.
+ */
+void removeClassNode(ClassNode *classNode) {
+
+    uint32_t key = classNode->hashCode & CLASS_HASHTABLE_MASK;
+
+    lock(&classHashtable->lock, true);
+
+    ClassBucket *bucket = classHashtable->buckets[key];
+
+    if(bucket>0) {
+
+        lock(&bucket->lock, false);
+
+        if(bucket->rootNode == classNode) {
+            bucket->rootNode = classNode->next;
+            bucket->chainLength--;
+        } else {
+            for(ClassNode *node = bucket->rootNode; node>0; node = node->next) {
+                if(node->next == classNode) {
+                    node->next = classNode->next;
+                    bucket->chainLength--;
+                    break;
+                }
+            }
         }
 
-    }
+        unlock(&bucket->lock, false);
 
-    bucket->chainLength++;
+    }
 
     unlock(&classHashtable->lock, true);
 
 }
 
+void waitForClassNode(ClassNode *classNode) {
+
+    atomicIncrement(&classHashtable->contended);
+
+    uint64_t sleptFor = lock(&classNode->lock, false);
+    unlock(&classNode->lock, false);
+
+    __sync_fetch_and_add(&classHashtable->contendedFor, sleptFor);
+
+}
+
 void addToThreadHashtable(ThreadNode *threadNode) {
 
     uint64_t hashCode = hashUint64((uint64_t) threadNode->threadID);
@@ -360,35 +560,68 @@ void addToThreadHashtable(ThreadNode *threadNode) {
 
 
 
-void clearMethodIDHashtable() {
+void forEachClassNode(void (*callback)(ClassNode *classNode, void *arg), void *arg) {
 
+    // nodes are only appended, with a compare and swap on the chain, until clearClassHashtable
 
-    for(int i=0;i <METHOD_ID_HASHTABLE_BUCKETS; i++) {
+    for (int i = 0; i < CLASS_HASHTABLE_BUCKETS; i++) {
 
+        ClassBucket *bucket = classHashtable->buckets[i];
 
-        if(methodIDHashtable->buckets[i] != NULL) {
+        if (bucket != NULL) {
 
+            ClassNode *node = bucket->rootNode;
 
-            MethodIDNode *node = methodIDHashtable->buckets[i]->rootNode;
+            while (node != NULL) {
+                callback(node, arg);
+                node = node->next;
+            }
 
-            while(node!=NULL) {
+        }
 
+    }
 
-                MethodIDNode *tempNode = node;
-                node = node->next;
+}
 
-                if(tempNode->allocationType==LIST_ALLOCATION || tempNode->allocationType==SINGLE_ALLOCATION) {
-                    free(tempNode);
-                }
 
-            }
+void forEachThreadNode(void (*callback)(ThreadNode *threadNode, void *arg), void *arg) {
+
+    // nodes are only ever appended, or released in clearThreadHashtable, so the chains can be walked without the bucket locks
 
-            free(methodIDHashtable->buckets[i]);
+    for(int i=0;i <THREAD_HASHTABLE_BUCKETS; i++) {
+
+        ThreadBucket *bucket = threadHashtable->buckets[i];
+
+        if(bucket != NULL) {
+
+            ThreadNode *node = bucket->rootNode;
+
+            while(node != NULL) {
+                callback(node, arg);
+                node = node->next;
+            }
 
         }
 
     }
 
+}
+
+
+void clearMethodIDHashtable() {
+
+    if(methodIDHashtable->previous>0) {
+        free(methodIDHashtable->previous);
+    }
+
+    MethodIDTable *table = methodIDHashtable->retired;
+    while(table>0) {
+        MethodIDTable *tempTable = table;
+        table = table->retired;
+        free(tempTable);
+    }
+
+    free(methodIDHashtable->current);
     free(methodIDHashtable);
     createMethodIDHashtable();
 
@@ -406,7 +639,9 @@ void clearThreadHashtable() {
             while(node!=NULL) {
 
                 if(node->name) free(node->name);
-                if(node->threadBuffer) free(node->threadBuffer);
+                if(node->threadBuffer) freeBuffer(node->threadBuffer);
+                if(node->callTree) freeCallTree(node->callTree);
+                if(node->shadowStack) free(node->shadowStack);
                 //if(node->methodCache) free(node->methodCache);
 
 
@@ -426,63 +661,38 @@ void clearThreadHashtable() {
 
 void clearClassHashtable() {
 
-    for(int i=0;i <CLASS_HASHTABLE_BUCKETS; i++) {
-
-        if(classHashtable->buckets[i] != NULL) {
-
-            ClassNode *node = classHashtable->buckets[i]->rootNode;
-
-            while(node!=NULL) {
-
-                if(node->name) free(node->name);
-
-                if(node->profilerName) free(node->profilerName);
-
-                if(node->methods) {
-                    for(int j=0;j<node->numberOfMethods;j++){
-                        if(node->methods[j].name) free(node->methods[j].name);
-                        if(node->methods[j].signature) free(node->methods[j].signature);
-                        if(node->methods[j].generic) free(node->methods[j].generic);
-                    }
-
-                    free(node->methods);
-                }
+    // Class metadata lives in metadataArena and is released with resetArena
 
+    free(classHashtable);
+    createClassHashtable();
 
-                if(node->fields) {
-                    for(int j=0;j<node->numberOfFields;j++){
-                        if(node->fields[j].name) free(node->fields[j].name);
-                        if(node->fields[j].signature) free(node->fields[j].signature);
-                        if(node->fields[j].generic) free(node->fields[j].generic);
-                    }
+}
 
-                    free(node->fields);
-                }
 
 
-                if(node->interfaces) free(node->interfaces);
+static void addProbeLengths(MethodIDTable *table, uint32_t *histogram, uint32_t *longestProbe) {
 
+    for(uint32_t i=0;i < table->capacity; i++) {
 
-                ClassNode *tempNode = node;
-                node = node->next;
-                free(tempNode);
+        if(table->slots[i].jvmtiMethodID != NULL) {
 
+            uint32_t home = (uint32_t) (hashUint64((uintptr_t) table->slots[i].jvmtiMethodID) & table->mask);
+            uint32_t probeLength = (i - home) & table->mask;
 
+            uint32_t bucket = 0;
+            while(bucket < METHOD_ID_PROBE_HISTOGRAM - 1 && probeLength >= (1u << bucket)) {
+                bucket++;
             }
 
-            free(classHashtable->buckets[i]);
-
+            histogram[bucket]++;
+            if(probeLength > *longestProbe) {
+                *longestProbe = probeLength;
+            }
         }
-
     }
 
-    free(classHashtable);
-    createClassHashtable();
-
 }
 
-
-
 void reportStatistics() {
 
 
@@ -490,20 +700,22 @@ void reportStatistics() {
     uint32_t longestChain = 0;
     uint32_t totalEntries = 0;
 
-    for(int i=0;i <METHOD_ID_HASHTABLE_BUCKETS; i++) {
-        if(methodIDHashtable->buckets[i] != NULL) {
-            numberOfUsedBuckets++;
-            totalEntries += methodIDHashtable->buckets[i]->chainLength;
-            if(methodIDHashtable->buckets[i]->chainLength > longestChain) {
-                longestChain = methodIDHashtable->buckets[i]->chainLength;
-            }
-        }
-    }
+    uint32_t probeHistogram[METHOD_ID_PROBE_HISTOGRAM] = {0};
+    uint32_t longestProbe = 0;
+    MethodIDTable *current = methodIDHashtable->current;
+
+    addProbeLengths(current, probeHistogram, &longestProbe);
 
     info("MethodIDHashTable:\n");
-    info("\tNumber of Used Buckets: %d\n", numberOfUsedBuckets);
-    info("\tTotal Entries: %d\n", totalEntries);
-    info("\tLongest Chain: %d\n", longestChain);
+    info("\tCapacity: %d, Load: %d%%\n", current->capacity, (uint32_t) ((current->entries * 100ull) / current->capacity));
+    info("\tTotal Entries: %d\n", methodIDHashtable->entries);
+    info("\tResizes: %d\n", methodIDHashtable->resizes);
+    info("\tLongest Probe: %d\n", longestProbe);
+    info("\tProbe Length 0: %d\n", probeHistogram[0]);
+    for(int i=1;i < METHOD_ID_PROBE_HISTOGRAM - 1; i++) {
+        info("\tProbe Length %d-%d: %d\n", 1 << (i - 1), (1 << i) - 1, probeHistogram[i]);
+    }
+    info("\tProbe Length %d+: %d\n", 1 << (METHOD_ID_PROBE_HISTOGRAM - 2), probeHistogram[METHOD_ID_PROBE_HISTOGRAM - 1]);
     info("\n");
 
 
@@ -526,6 +738,7 @@ void reportStatistics() {
     info("\tTotal Entries: %d\n", totalEntries);
     info("\tLongest Chain: %d\n", longestChain);
     info("\tLockedFor: %" PRIu64 "\n", classHashtable->lockedFor);
+    info("\tContended Discoveries: %d, Wait Ticks: %" PRIu64 "\n", classHashtable->contended, classHashtable->contendedFor);
     info("\n");
 
 
@@ -554,5 +767,9 @@ void reportStatistics() {
     longestChain = 0;
     totalEntries = 0;
 
+    reportOutputStatistics();
+    reportInternStatistics();
+    reportArenaStatistics(metadataArena);
+    reportLockStatistics();
 
 }
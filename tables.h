@@ -15,11 +15,14 @@
 #include <pthread.h>
 #endif
 #include "util.h"
+#include "arena.h"
+#include "cct.h"
 #include "profiler.h"
 #include "jvmti.h"
 
-#define METHOD_ID_HASHTABLE_BUCKETS 16384
-#define METHOD_ID_HASHTABLE_MASK 16383
+#define METHOD_ID_TABLE_CAPACITY 16384
+#define METHOD_ID_TABLE_MIGRATION_STEP 8
+#define METHOD_ID_PROBE_HISTOGRAM 8
 
 #define CLASS_HASHTABLE_BUCKETS 4096
 #define CLASS_HASHTABLE_MASK 4095
@@ -30,13 +33,14 @@
 #define METHOD_CACHE_ENTRIES 1024
 #define METHOD_CACHE_MASK 1023
 
-#define LIST_ALLOCATION 1
-#define SINGLE_ALLOCATION 2
+#define OVERHEAD_STACK_DEPTH 4096
+#define SHADOW_STACK_DEPTH 4096
 
 #define ACC_STATIC 0x0008
 
 typedef struct MethodIDHashtable_struct MethodIDHashtable;
-typedef struct MethodIDBucket_struct MethodIDBucket;
+typedef struct MethodIDSlot_struct MethodIDSlot;
+typedef struct MethodIDTable_struct MethodIDTable;
 typedef struct MethodIDNode_struct MethodIDNode;
 
 typedef struct ClassHashtable_struct ClassHashtable;
@@ -49,6 +53,7 @@ typedef struct InterfaceInfo_struct InterfaceInfo;
 typedef struct ThreadHashtable_struct ThreadHashtable;
 typedef struct ThreadBucket_struct ThreadBucket;
 typedef struct ThreadNode_struct ThreadNode;
+typedef struct ShadowFrame_struct ShadowFrame;
 
 #ifdef __WIN32__
 typedef uint64_t NativeThreadID;
@@ -61,6 +66,8 @@ typedef pthread_t NativeThreadID;
 #endif
 
 
+extern Arena *metadataArena;
+
 void createMethodIDHashtable();
 void createClassHashtable();
 void createThreadHashtable();
@@ -77,34 +84,53 @@ ThreadNode* getThreadNode(uint32_t threadID);
 void addListToMethodIDHashtable(uint32_t numberOfMethods, MethodIDNode *methodIDNodeList, jvmtiEnv *jvmtiInterface);
 void addToMethodIDHashtable(jmethodID jvmtiMethodID, jclass jvmtiClass, uint16_t classID, uint16_t methodID);
 void addToClassHashtable(ClassNode *classNode);
+ClassNode* claimClassNode(ClassNode *classNode);
+void removeClassNode(ClassNode *classNode);
+void waitForClassNode(ClassNode *classNode);
 void addToThreadHashtable(ThreadNode *threadNode);
 
+void forEachThreadNode(void (*callback)(ThreadNode *threadNode, void *arg), void *arg);
+void forEachClassNode(void (*callback)(ClassNode *classNode, void *arg), void *arg);
+
 void reportStatistics();
 
 struct MethodIDHashtable_struct {
     volatile LockStructure lock;
+    volatile uint32_t sequence;
     uint32_t entries;
-    uint32_t collisions;
+    uint32_t resizes;
+    uint32_t migrated;
     uint64_t lockedFor;
-    MethodIDBucket *buckets[METHOD_ID_HASHTABLE_BUCKETS];
+    MethodIDTable * volatile current;
+    MethodIDTable * volatile previous;
+    MethodIDTable *retired;
 };
 
 
-struct MethodIDBucket_struct {
-    volatile LockStructure lock;
-    uint32_t chainLength;
-	MethodIDNode *rootNode;
+struct MethodIDSlot_struct {
+    volatile jmethodID jvmtiMethodID;
+    MethodIDNode * volatile node;
+};
+
+
+struct MethodIDTable_struct {
+    uint32_t capacity;
+    uint32_t mask;
+    uint32_t entries;
+    MethodIDTable *retired;
+    MethodIDSlot slots[];
 };
 
 
 struct MethodIDNode_struct {
     jmethodID jvmtiMethodID;
     jclass jvmtiClass;
+    ClassNode *classNode;
     uint16_t classID;
     uint16_t methodID;
-    uint8_t allocationType;
     uint8_t staticMethod;
-	MethodIDNode *next;
+    uint8_t filtered;
+    uint8_t instrumented;
 };
 
 
@@ -113,6 +139,8 @@ struct ClassHashtable_struct {
     uint32_t entries;
     uint32_t collisions;
     uint64_t lockedFor;
+    volatile uint32_t contended;
+    uint64_t contendedFor;
     ClassBucket *buckets[CLASS_HASHTABLE_BUCKETS];
 };
 
@@ -126,18 +154,26 @@ struct ClassBucket_struct {
 
 struct ClassNode_struct {
     uint64_t hashCode;
-    volatile LockStructure written;
+    volatile uint32_t epoch;
     volatile LockStructure lock;
     uint8_t *name;
     uint8_t *profilerName;
     uint32_t classID;
     uint32_t superClassID;
+    ClassNode *superClass;
     uint32_t numberOfMethods;
     MethodInfo *methods;
     uint32_t numberOfFields;
     FieldInfo *fields;
     uint32_t numberOfInterfaces;
     InterfaceInfo *interfaces;
+    uint8_t filtered;
+    volatile uint8_t resolved;
+    volatile uint8_t failed;
+    jclass jvmtiClass;
+    jmethodID *jvmtiMethods;
+    MethodIDNode *methodIDNodes;
+    ClassNode *pendingNext;
     ClassNode *next;
 };
 
@@ -160,6 +196,7 @@ struct FieldInfo_struct {
 
 struct InterfaceInfo_struct {
     uint32_t classID;
+    ClassNode *classNode;
 };
 
 
@@ -179,16 +216,32 @@ struct ThreadBucket_struct {
 };
 
 
+struct ShadowFrame_struct {
+    uint64_t ticks;
+    uint32_t objectID;
+    uint16_t classID;
+    uint16_t methodID;
+};
+
 struct ThreadNode_struct {
     uint64_t threadID;
     uint8_t* name;
+    volatile uint32_t epoch;
+    uint32_t cacheEpoch;
     Buffer *threadBuffer;
     ThreadNode *next;
 	uint32_t overheadPointer;
-	uint64_t overhead[4096];
+	uint64_t overhead[OVERHEAD_STACK_DEPTH];
     uint32_t cacheHits;
     uint32_t cacheMisses;
     MethodIDNode *methodCache[METHOD_CACHE_ENTRIES];
+    CallTree *callTree;
+    ShadowFrame *shadowStack;
+    uint32_t shadowPointer;
+    uint32_t shadowEmitted;
+    uint64_t shadowSuppressed;
+    uint32_t triggerWindow;
+    uint32_t triggerPending;
 };
 
 
@@ -0,0 +1,190 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include "ticks.h"
+#include "util.h"
+
+#if defined __linux && (defined __x86_64__ || defined __i386__)
+#include <cpuid.h>
+#endif
+
+#ifdef __MVS__
+uint32_t tickSource = TICK_SOURCE_STCKF;
+#elif __powerpc64__
+uint32_t tickSource = TICK_SOURCE_TIMEBASE;
+#else
+uint32_t tickSource = TICK_SOURCE_TSC;
+#endif
+
+
+const char* getTickSourceName(uint32_t source) {
+
+    switch (source) {
+    case TICK_SOURCE_TSC:
+        return "tsc";
+    case TICK_SOURCE_CLOCK:
+        return "clock";
+    case TICK_SOURCE_STCKF:
+        return "stckf";
+    case TICK_SOURCE_TIMEBASE:
+        return "timebase";
+    }
+
+    return "unknown";
+
+}
+
+
+#ifdef __linux
+
+static bool hasInvariantTSC() {
+
+#if defined __x86_64__ || defined __i386__
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+        return false;
+    }
+
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+
+    return (edx & (1 << 8)) != 0;
+#else
+    return false;
+#endif
+
+}
+
+
+static bool kernelUsesTSC() {
+
+    FILE *file = fopen(CLOCKSOURCE_FILE, "r");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    char name[32] = { 0 };
+    bool tsc = fgets(name, sizeof(name), file) != NULL && strncmp(name, "tsc", 3) == 0;
+
+    fclose(file);
+
+    return tsc;
+
+}
+
+#endif
+
+
+#ifndef __MVS__
+
+static uint64_t getRawNanos() {
+
+#ifdef __WIN32__
+    // getTicks reads the TSC on Windows too, so it is calibrated against the performance counter
+
+    LARGE_INTEGER counter;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&counter);
+    QueryPerformanceFrequency(&frequency);
+
+    uint64_t count = (uint64_t) counter.QuadPart;
+    uint64_t rate = (uint64_t) frequency.QuadPart;
+
+    return count / rate * CLOCK_TICKS_PER_SECOND + count % rate * CLOCK_TICKS_PER_SECOND / rate;
+#else
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+
+    return (uint64_t) ts.tv_sec * CLOCK_TICKS_PER_SECOND + ts.tv_nsec;
+#endif
+
+}
+
+
+static uint64_t calibrateTicksPerSecond() {
+
+    uint64_t rates[TICK_CALIBRATION_ROUNDS];
+
+    for (int round = 0; round < TICK_CALIBRATION_ROUNDS; round++) {
+
+        uint64_t startTicks = getTicks();
+        uint64_t startNanos = getRawNanos();
+        uint64_t ticks;
+        uint64_t nanos;
+
+        do {
+            ticks = getTicks();
+            nanos = getRawNanos();
+        } while (nanos - startNanos < TICK_CALIBRATION_NS);
+
+        uint64_t rate = (ticks - startTicks) * CLOCK_TICKS_PER_SECOND / (nanos - startNanos);
+
+        int i = round;
+        while (i > 0 && rates[i - 1] > rate) {
+            rates[i] = rates[i - 1];
+            i--;
+        }
+        rates[i] = rate;
+
+    }
+
+    // A tick counter that does not move would leave every duration dividing by zero
+
+    return rates[TICK_CALIBRATION_ROUNDS / 2] ? rates[TICK_CALIBRATION_ROUNDS / 2] : DEFAULT_TICKS_PER_SECOND;
+
+}
+
+#endif
+
+
+uint64_t selectTickSource(const char *requested) {
+
+#ifdef __linux
+
+#if defined __x86_64__ || defined __i386__
+    if (requested && strcasecmp(requested, "clock") == 0) {
+        tickSource = TICK_SOURCE_CLOCK;
+    } else if (requested && strcasecmp(requested, "tsc") == 0) {
+        tickSource = TICK_SOURCE_TSC;
+    } else {
+        bool invariant = hasInvariantTSC();
+        bool kernel = kernelUsesTSC();
+        tickSource = (invariant && kernel) ? TICK_SOURCE_TSC : TICK_SOURCE_CLOCK;
+        if (tickSource == TICK_SOURCE_CLOCK) {
+            warn("TSC not usable (invariant: %d, kernel clocksource tsc: %d), using clock_gettime\n", invariant, kernel)
+        }
+    }
+#else
+    if (requested && strcasecmp(requested, "clock") == 0) {
+        tickSource = TICK_SOURCE_CLOCK;
+    }
+#endif
+
+    if (tickSource == TICK_SOURCE_CLOCK) {
+        return CLOCK_TICKS_PER_SECOND;
+    }
+
+    return calibrateTicksPerSecond();
+
+#elif __MVS__
+
+    return STCKF_TICKS_PER_SECOND;
+
+#else
+
+    return calibrateTicksPerSecond();
+
+#endif
+
+}
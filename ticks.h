@@ -0,0 +1,31 @@
+/*
+ *
+ * Author: Paul Anderson, 2022
+ *
+ */
+
+#ifndef TICKS_H_
+#define TICKS_H_
+
+#include <stdint.h>
+
+#define TICK_SOURCE_TSC 0
+#define TICK_SOURCE_CLOCK 1
+#define TICK_SOURCE_STCKF 2
+#define TICK_SOURCE_TIMEBASE 3
+
+#define TICK_CALIBRATION_ROUNDS 5
+#define TICK_CALIBRATION_NS 1000000
+#define STCKF_TICKS_PER_SECOND 4096000000ULL
+#define CLOCK_TICKS_PER_SECOND 1000000000ULL
+#define DEFAULT_TICKS_PER_SECOND 2400000000ULL
+
+#define CLOCKSOURCE_FILE "/sys/devices/system/clocksource/clocksource0/current_clocksource"
+
+extern uint32_t tickSource;
+
+uint64_t selectTickSource(const char *requested);
+const char* getTickSourceName(uint32_t source);
+
+
+#endif /* TICKS_H_ */
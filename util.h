@@ -16,6 +16,8 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <time.h>
+#include "ticks.h"
+#include "locks.h"
 
 #ifdef __WIN32__
 #include <windows.h>
@@ -29,6 +31,8 @@
 #include <errno.h>
 #endif
 
+#define THREAD_LOCAL __thread
+
 
 #ifdef __MVS__
 #pragma map(cond_timed_wait, "BPX4CTW")
@@ -143,6 +147,8 @@ void cond_timed_wait(
 typedef uint32_t LockStructure;
 
 typedef struct Buffer_struct Buffer;
+typedef struct Chunk_struct Chunk;
+typedef struct ChunkRing_struct ChunkRing;
 
 struct Buffer_struct {
     uint32_t bufferLength;
@@ -150,6 +156,28 @@ struct Buffer_struct {
     int shared;
     volatile LockStructure lock;
     uint8_t *buffer;
+    ChunkRing *ring;
+    uint32_t threadID;
+    uint64_t lastTicks;
+    uint64_t events;
+};
+
+
+struct Chunk_struct {
+    uint8_t *data;
+    uint32_t length;
+};
+
+
+struct ChunkRing_struct {
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    uint32_t numberOfChunks;
+    uint32_t chunkLength;
+    uint32_t snapshot;
+    uint32_t stalls;
+    volatile uint32_t ended;
+    Chunk *chunks;
 };
 
 
@@ -234,8 +262,22 @@ static inline uint32_t jenkins_one_at_a_time_hash(const char *key, size_t len) {
 
 }
 
+static inline uint64_t zigzagEncode(int64_t value) {
+
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+
+}
+
 static inline uint64_t getTicks() {
 
+#ifdef __linux
+    if (tickSource == TICK_SOURCE_CLOCK) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t) ts.tv_sec * CLOCK_TICKS_PER_SECOND + ts.tv_nsec;
+    }
+#endif
+
 #ifdef __x86_64__
     uint32_t lower;
     uint32_t upper;
@@ -298,6 +340,20 @@ static inline uint32_t atomicIncrement(uint32_t *pointer) {
 #endif
 
 
+static inline void memoryBarrier() {
+
+#if defined __linux || defined __WIN32__
+    __sync_synchronize();
+#elif __MVS__
+    uint32_t barrier = 0;
+    uint32_t old = 0;
+    uint32_t new = 0;
+    __cs1(&old, &barrier, &new);
+#endif
+
+}
+
+
 #ifdef __MVS__
 static inline int nanosleep(const struct timespec *rqtp, struct timespec *rmtp) {
 
@@ -315,6 +371,80 @@ static inline int nanosleep(const struct timespec *rqtp, struct timespec *rmtp)
 #endif
 
 
+#ifdef __linux
+static inline bool isLocked(volatile LockStructure *lock) {
+
+    return (__sync_fetch_and_or(lock, 0) & LOCK_STATE_MASK) != UNLOCKED;
+
+}
+
+
+static inline bool isUnlocked(volatile LockStructure *lock) {
+
+    return (__sync_fetch_and_or(lock, 0) & LOCK_STATE_MASK) == UNLOCKED;
+
+}
+
+
+static inline bool unlockIfLocked(volatile LockStructure *lock) {
+
+    uint32_t tag = *lock & ~LOCK_STATE_MASK;
+    bool nowUnlocked = __sync_bool_compare_and_swap(lock, tag | LOCKED, tag | UNLOCKED);
+
+    debug("unlockedIfLocked %d\n", nowUnlocked);
+    return(nowUnlocked);
+
+}
+
+
+static inline bool lockIfUnlocked(volatile LockStructure *lock) {
+
+    uint32_t tag = *lock & ~LOCK_STATE_MASK;
+    bool nowLocked = __sync_bool_compare_and_swap(lock, tag | UNLOCKED, tag | LOCKED);
+
+    debug("lockIfUnlocked %d\n", nowLocked);
+    return(nowLocked);
+
+}
+#endif
+
+
+#ifdef __WIN32__
+static inline bool isLocked(volatile LockStructure *lock) {
+
+    return __sync_val_compare_and_swap(lock, UNLOCKED, UNLOCKED) != UNLOCKED;
+
+}
+
+
+static inline bool isUnlocked(volatile LockStructure *lock) {
+
+    return __sync_val_compare_and_swap(lock, UNLOCKED, UNLOCKED) == UNLOCKED;
+
+}
+
+
+static inline bool unlockIfLocked(volatile LockStructure *lock) {
+
+    bool nowUnlocked = __sync_bool_compare_and_swap(lock, LOCKED, UNLOCKED);
+
+    debug("unlockedIfLocked %d\n", nowUnlocked);
+    return(nowUnlocked);
+
+}
+
+
+static inline bool lockIfUnlocked(volatile LockStructure *lock) {
+
+    bool nowLocked = __sync_bool_compare_and_swap(lock, UNLOCKED, LOCKED);
+
+    debug("lockIfUnlocked %d\n", nowLocked);
+    return(nowLocked);
+
+}
+#endif
+
+
 #ifdef __MVS__
 static inline bool isLocked(volatile LockStructure *lock) {
 
@@ -359,6 +489,65 @@ static inline bool lockIfUnlocked(volatile LockStructure *lock) {
 #endif
 
 
+// A plain read for paths too hot for the interlocked checks above, which may see a change a little late
+
+static inline bool isUnlockedRelaxed(volatile LockStructure *lock) {
+
+    return (*lock & LOCK_STATE_MASK) == UNLOCKED;
+
+}
+
+
+static inline void cpuRelax() {
+
+#if defined __x86_64__ || defined __i386__
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__ ("" ::: "memory");
+#endif
+
+}
+
+
+#ifdef __linux
+/*
+ * Three state futex lock: UNLOCKED, LOCKED and CONTENDED when there may be
+ * waiters parked in the kernel. Returns the ticks spent waiting. The bits
+ * above LOCK_STATE_MASK hold the registered index of a named lock, so an
+ * unnamed lock never touches the statistics table.
+ */
+static inline uint64_t lock(volatile LockStructure *lock, bool log) {
+
+    uint64_t waitTicks = 0;
+    uint32_t tag = *lock & ~LOCK_STATE_MASK;
+    bool contended = !__sync_bool_compare_and_swap(lock, tag | UNLOCKED, tag | LOCKED);
+
+    if (contended) {
+        waitTicks = lockContended(lock);
+    }
+
+    if (tag != 0) {
+        recordLock(tag, contended, waitTicks);
+    }
+
+    return waitTicks;
+
+}
+
+
+static inline void unlock(volatile LockStructure *lock, bool log) {
+
+    uint32_t previous = __sync_fetch_and_sub(lock, 1);
+
+    if ((previous & LOCK_STATE_MASK) != LOCKED) {
+        __sync_lock_test_and_set(lock, previous & ~LOCK_STATE_MASK);
+        wakeLockWaiter(lock);
+    }
+
+}
+
+#else
+
 static inline uint64_t lock(volatile LockStructure *lock, bool log) {
 
     uint64_t sleepNS = MIN_LOCK_WAIT_NS;
@@ -425,7 +614,7 @@ static inline uint64_t lock(volatile LockStructure *lock, bool log) {
 
 static inline void unlock(volatile LockStructure *lock, bool log) {
 
-#ifdef __linux
+#ifdef __WIN32__
     __sync_lock_test_and_set(lock, UNLOCKED);
 #elif __MVS__
     uint32_t locked = LOCKED;
@@ -439,6 +628,8 @@ static inline void unlock(volatile LockStructure *lock, bool log) {
 
 }
 
+#endif
+
 
 static inline uint32_t compareAndSwapPtrBool(volatile uintptr_t *targetPtr, volatile void *oldPtr, volatile void *newPtr) {
 //debug("target: %p old:%p new:%p\n", targetPtr, oldPtr, newPtr);
@@ -472,4 +663,29 @@ static inline uint32_t alreadyWritten(volatile uint32_t *writtenFlag) {
 
 }
 
+static inline bool claimEpoch(volatile uint32_t *epochFlag, uint32_t epoch) {
+
+    uint32_t previous = *epochFlag;
+
+    while (previous != epoch) {
+
+#if defined __linux || defined __WIN32__
+        uint32_t current = __sync_val_compare_and_swap(epochFlag, previous, epoch);
+#elif __MVS__
+        uint32_t current = previous;
+        uint32_t target = epoch;
+        __cs1((void*)&current, (void*)epochFlag, (void*)&target);
+#endif
+
+        if (current == previous) {
+            return true;
+        }
+
+        previous = current;
+    }
+
+    return false;
+
+}
+
 #endif /* UTIL_H_ */